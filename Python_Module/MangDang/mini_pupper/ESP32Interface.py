@@ -132,3 +132,300 @@ class ESP32Interface:
         power = {"volt": raw_power[0],
                  "ampere": raw_power[1]}
         return power
+
+    def _decode_all(self, data):
+        raw_data = unpack("<Qq12H12h8f", data[2:])
+        state = {"generation": raw_data[0],
+                 "timestamp_ns": raw_data[1],
+                 "position": list(raw_data[2:14]),
+                 "load": list(raw_data[14:26]),
+                 "imu": {"ax": raw_data[26],
+                         "ay": raw_data[27],
+                         "az": raw_data[28],
+                         "gx": raw_data[29],
+                         "gy": raw_data[30],
+                         "gz": raw_data[31]},
+                 "power": {"volt": raw_data[32],
+                           "ampere": raw_data[33]}}
+        return state
+
+    def get_all(self):
+        try:
+            self.sock.sendall(pack("BB", 2, 8))
+            data = self.sock.recv(98)
+        except Exception as e:
+            if e.errno == errno.EPIPE or e.errno == errno.ENOTCONN or e.errno == errno.EBADF:
+                self.close()
+                self.connect()
+            else:
+                print("%s" % e)
+            return None
+
+        if data[0:2] != pack("BB", 98, 8):
+            print("Invalid Ack")
+            self.close()
+            return None
+
+        return self._decode_all(data)
+
+    def servos_set_position_torque_get_all(self, positions, torque):
+        try:
+            self.sock.sendall(pack("BB12B12H", 38, 9, *torque, *positions))
+            data = self.sock.recv(98)
+        except Exception as e:
+            if e.errno == errno.EPIPE or e.errno == errno.ENOTCONN or e.errno == errno.EBADF:
+                self.close()
+                self.connect()
+            else:
+                print("%s" % e)
+            return None
+
+        if data[0:2] != pack("BB", 98, 9):
+            print("Invalid Ack")
+            self.close()
+            return None
+
+        return self._decode_all(data)
+
+    def servos_set_position_get_all(self, positions):
+        torque = [1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1]
+        return self.servos_set_position_torque_get_all(positions, torque)
+
+    def get_timing(self):
+        """Return the ESP32 sample times of the last feedback generation.
+
+        Times are time.monotonic_ns() times, 0 when the ESP32 does not use
+        host protocol version 2. The end-to-end delay of the servo feedback
+        is the timestamp_ns of get_all() minus servo_time_ns.
+        """
+        try:
+            self.sock.sendall(pack("BB", 2, 14))
+            data = self.sock.recv(50)
+        except Exception as e:
+            if e.errno == errno.EPIPE or e.errno == errno.ENOTCONN or e.errno == errno.EBADF:
+                self.close()
+                self.connect()
+            else:
+                print("%s" % e)
+            return None
+
+        if data[0:2] != pack("BB", 50, 14):
+            print("Invalid Ack")
+            self.close()
+            return None
+
+        raw_data = unpack("<QIIqqqq", data[2:])
+        timing = {"generation": raw_data[0],
+                  "protocol_version": raw_data[1],
+                  "frame_counter": raw_data[2],
+                  "servo_time_ns": raw_data[3],
+                  "imu_time_ns": raw_data[4],
+                  "esp32_tx_time_ns": raw_data[5],
+                  "clock_uncertainty_ns": raw_data[6]}
+        return timing
+
+    def get_extra(self):
+        """Return the servo speed, temperature and feedback age of the last feedback generation.
+
+        They are sent by the ESP32 only when esp32-proxy requests their field
+        (--feedback), fields is the mask of the fields in use. The feedback
+        ages are in us (100us resolution), None for a servo never read.
+        """
+        try:
+            self.sock.sendall(pack("BB", 2, 16))
+            data = self.sock.recv(74)
+        except Exception as e:
+            if e.errno == errno.EPIPE or e.errno == errno.ENOTCONN or e.errno == errno.EBADF:
+                self.close()
+                self.connect()
+            else:
+                print("%s" % e)
+            return None
+
+        if data[0:2] != pack("BB", 74, 16):
+            print("Invalid Ack")
+            self.close()
+            return None
+
+        raw_data = unpack("<QI12h12B12H", data[2:])
+        extra = {"generation": raw_data[0],
+                 "fields": raw_data[1],
+                 "speed": list(raw_data[2:14]),
+                 "temperature": list(raw_data[14:26]),
+                 "servo_age_us": [None if age == 0xFFFF else age * 100
+                                  for age in raw_data[26:38]]}
+        return extra
+
+    def acquire_lease(self, priority, lease_ms):
+        """Send the setpoints of this client to its own staging slot.
+
+        The live lease with the highest priority drives the servos. The lease
+        stays live while setpoints are sent more often than lease_ms.
+        A lease_ms of 0 releases the lease. Return True if granted.
+        """
+        try:
+            self.sock.sendall(pack("<BBBH", 5, 12, priority, lease_ms))
+            data = self.sock.recv(3)
+        except Exception as e:
+            if e.errno == errno.EPIPE or e.errno == errno.ENOTCONN or e.errno == errno.EBADF:
+                self.close()
+                self.connect()
+            else:
+                print("%s" % e)
+            return False
+
+        if data[0:2] != pack("BB", 3, 12):
+            print("Invalid Ack")
+            self.close()
+            return False
+
+        return data[2] == 1
+
+    def release_lease(self):
+        self.acquire_lease(0, 0)
+
+    def servos_set_trajectory(self, base_ns, points, torque=None, replace=False):
+        """Queue future servo positions (requires a lease).
+
+        base_ns is a time.monotonic_ns() time, points a list of
+        (offset_us, positions) sorted by offset. Each position set is reached
+        at base_ns + offset_us, the proxy interpolates in between.
+        replace discards the positions already queued.
+        Return the count of points queued.
+        """
+        if torque is None:
+            torque = [1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1]
+        queued = 0
+        for first in range(0, len(points), 8):
+            batch = points[first:first + 8]
+            mode = 1 if replace and first == 0 else 0
+            packet = pack("<BBBq12B", 23 + 28 * len(batch), 13, mode, base_ns, *torque)
+            for offset_us, positions in batch:
+                packet += pack("<I12H", offset_us, *positions)
+            try:
+                self.sock.sendall(packet)
+                data = self.sock.recv(3)
+            except Exception as e:
+                if e.errno == errno.EPIPE or e.errno == errno.ENOTCONN or e.errno == errno.EBADF:
+                    self.close()
+                    self.connect()
+                else:
+                    print("%s" % e)
+                return queued
+
+            if data[0:2] != pack("BB", 3, 13):
+                print("Invalid Ack")
+                self.close()
+                return queued
+            queued += data[2]
+        return queued
+
+    def _esp32_request(self, instruction, parameters=b""):
+        """Forward an instruction to the ESP32 through the proxy.
+
+        Return (status, parameters) of the ESP32 reply, None when the
+        ESP32 did not reply in time.
+        """
+        try:
+            self.sock.sendall(pack("BBB", 3 + len(parameters), 15, instruction) + parameters)
+            data = self.sock.recv(256)
+        except Exception as e:
+            if e.errno == errno.EPIPE or e.errno == errno.ENOTCONN or e.errno == errno.EBADF:
+                self.close()
+                self.connect()
+            else:
+                print("%s" % e)
+            return None
+
+        if data[0:2] != pack("BB", len(data), 15):
+            print("Invalid Ack")
+            self.close()
+            return None
+
+        if len(data) < 4 or data[3] != instruction:
+            return None
+        return data[2], data[4:]
+
+    def get_esp32_stats(self):
+        """Return the ESP32 statistics : host link, servo bus, IMU.
+
+        The servo bus load is None with older firmwares, which do not send it.
+        """
+        reply = self._esp32_request(0x10)
+        if reply is None or reply[0] != 0 or len(reply[1]) < 56:
+            return None
+
+        raw_data = unpack("<4If5I2f2I", reply[1][:56])
+        stats = {"host_frames": raw_data[0],
+                 "host_checksum_errors": raw_data[1],
+                 "host_syntax_errors": raw_data[2],
+                 "host_nacks": raw_data[3],
+                 "host_frequency_hz": raw_data[4],
+                 "servo_frames": raw_data[5],
+                 "servo_checksum_errors": raw_data[6],
+                 "servo_syntax_errors": raw_data[7],
+                 "servo_time_out_errors": raw_data[8],
+                 "servo_truncated_errors": raw_data[9],
+                 "servo_frequency_hz": raw_data[10],
+                 "imu_frequency_hz": raw_data[11],
+                 "uptime_ms": raw_data[12],
+                 "free_heap": raw_data[13],
+                 "servo_tx_bytes_per_s": None,
+                 "servo_rx_bytes_per_s": None,
+                 "servo_tx_saved_bytes_per_s": None,
+                 "servo_bus_utilisation": None}
+        if len(reply[1]) >= 72:
+            load = unpack("<4f", reply[1][56:72])
+            stats["servo_tx_bytes_per_s"] = load[0]
+            stats["servo_rx_bytes_per_s"] = load[1]
+            stats["servo_tx_saved_bytes_per_s"] = load[2]
+            stats["servo_bus_utilisation"] = load[3]
+        return stats
+
+    def get_esp32_config(self, entry):
+        """Return the value of an ESP32 runtime configuration entry.
+
+        Entries : 1 servo bus period (ms), 2 servos polled for feedback
+        (bit N-1 : servo ID N).
+        """
+        reply = self._esp32_request(0x11, pack("B", entry))
+        if reply is None or reply[0] != 0 or len(reply[1]) != 5:
+            return None
+        return unpack("<I", reply[1][1:])[0]
+
+    def set_esp32_config(self, entry, value):
+        """Write an ESP32 runtime configuration entry, return the value in use.
+
+        Return None when the entry is unknown or the value out of range.
+        """
+        reply = self._esp32_request(0x12, pack("<BI", entry, value))
+        if reply is None or reply[0] != 0 or len(reply[1]) != 5:
+            return None
+        return unpack("<I", reply[1][1:])[0]
+
+    def servos_read_registers(self, ids, address, length):
+        """Read the same registers of several servos.
+
+        Return a list of (status, bytes) per servo, status 0 on success.
+        """
+        reply = self._esp32_request(0x13, pack("BB%dB" % len(ids), address, length, *ids))
+        if reply is None or reply[0] != 0 or len(reply[1]) != len(ids) * (1 + length):
+            return None
+        data = reply[1]
+        return [(data[index * (1 + length)], data[index * (1 + length) + 1:(index + 1) * (1 + length)])
+                for index in range(len(ids))]
+
+    def servos_write_registers(self, ids, address, values):
+        """Write the same registers of several servos.
+
+        values holds one bytes object per servo, all of the same length.
+        Return the status of each servo, 0 on success.
+        """
+        length = len(values[0])
+        parameters = pack("BB", address, length)
+        for servo_id, value in zip(ids, values):
+            parameters += pack("B", servo_id) + bytes(value)
+        reply = self._esp32_request(0x14, parameters)
+        if reply is None or reply[0] != 0 or len(reply[1]) != len(ids):
+            return None
+        return list(reply[1])
@@ -121,6 +121,25 @@ extern "C" void app_main(void)
     servo.start();
     ESP_LOGI(TAG, "Servo control & feedback service started, but disabled.");
 
+    // read servo bus baud rate from flash, checked with pings at the first servo power-up
+    int saved_baud_rate {0};
+    {
+        FILE * f = fopen(SERVO_BAUD_RATE_PATH, "r");
+        if(f)
+        {
+            int baud_rate {0};
+            fscanf(f,"%d\n", &baud_rate);
+            fclose(f);
+            if(servo.set_uart_baud_rate(baud_rate)==SERVO_STATUS_OK)
+            {
+                saved_baud_rate = baud_rate;
+                ESP_LOGI(TAG, "Servo bus baud rate read : %d", baud_rate);
+            }
+            else
+                ESP_LOGE(TAG, "Invalid servo bus baud rate : %d", baud_rate);
+        }
+    }
+
     // read calibration data from flash
     {
         // save to flash
@@ -193,6 +212,25 @@ extern "C" void app_main(void)
                     // enable SERVO power and wait a little while
                     servo.enable_power();
                     ESP_LOGI(TAG, "Servo power supply enabled.");
+                    // check the saved servo bus baud rate, once
+                    if(saved_baud_rate)
+                    {
+                        vTaskDelay(100 / portTICK_PERIOD_MS);
+                        int const baud_rate {servo.check_baud_rate()};
+                        if(baud_rate && baud_rate!=saved_baud_rate)
+                        {
+                            FILE * f = fopen(SERVO_BAUD_RATE_PATH, "w");
+                            if(f)
+                            {
+                                fprintf(f,"%d\n", baud_rate);
+                                fclose(f);
+                                ESP_LOGI(TAG, "Servo bus baud rate saved : %d", baud_rate);
+                            }
+                            else
+                                ESP_LOGE(TAG, "Failed to save the servo bus baud rate");
+                        }
+                        saved_baud_rate = 0;
+                    }
                     servo.enable_service();
                     ESP_LOGI(TAG, "Servo service enabled.");
                     // force torque disable
@@ -52,4 +52,7 @@ enum e_mini_pupper_state
 
 extern e_mini_pupper_state state; 
 
+// servo bus baud rate, saved in flash by the servo-setBaudRate and servo-probeBaudRate commands
+#define SERVO_BAUD_RATE_PATH "/data/servo_baud.txt"
+
 #endif //_mini_pupper_app_H
@@ -477,6 +477,79 @@ static void register_mini_pupper_cmd_setID(void)
     ESP_ERROR_CHECK( esp_console_cmd_register(&cmd_servo_setID) );
 }
 
+static void save_baud_rate(int baud_rate)
+{
+    FILE * f = fopen(SERVO_BAUD_RATE_PATH, "w");
+    if (f == NULL) {
+        printf("Failed to save the baud rate\r\n");
+        return;
+    }
+    fprintf(f,"%d\n", baud_rate);
+    fclose(f);
+}
+
+static struct {
+    struct arg_int *baud_rate;
+    struct arg_end *end;
+} servo_baud_rate_args;
+
+static int mini_pupper_cmd_setBaudRate(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&servo_baud_rate_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, servo_baud_rate_args.end, argv[0]);
+        return 0;
+    }
+
+    /* migrate all the servos, then the ESP32 UART */
+    int baud_rate = servo_baud_rate_args.baud_rate->ival[0];
+    if(servo.set_baud_rate(baud_rate)!=SERVO_STATUS_OK) {
+        printf("Baud rate change failed, servo bus at %d\r\n", servo.get_baud_rate());
+        return 0;
+    }
+    save_baud_rate(baud_rate);
+    printf("Servo bus at %d\r\n", baud_rate);
+    return 0;
+}
+
+static void register_mini_pupper_cmd_setBaudRate(void)
+{
+    servo_baud_rate_args.baud_rate = arg_int1(NULL, "baud", "<n>", "Baud rate");
+    servo_baud_rate_args.end = arg_end(2);
+    const esp_console_cmd_t cmd_servo_setBaudRate = {
+        .command = "servo-setBaudRate",
+        .help = "Change the baud rate of all the servos, and of the ESP32",
+        .hint = "--baud <1000000|500000|250000|128000|115200...>",
+        .func = &mini_pupper_cmd_setBaudRate,
+        .argtable = &servo_baud_rate_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd_servo_setBaudRate) );
+}
+
+static int mini_pupper_cmd_probeBaudRate(int argc, char **argv)
+{
+    int const baud_rate {servo.probe_baud_rate()};
+    if(baud_rate==0) {
+        printf("No servo on the bus\r\n");
+        return 0;
+    }
+    save_baud_rate(baud_rate);
+    printf("Servo bus at %d\r\n", baud_rate);
+    return 0;
+}
+
+static void register_mini_pupper_cmd_probeBaudRate(void)
+{
+    const esp_console_cmd_t cmd_servo_probeBaudRate = {
+        .command = "servo-probeBaudRate",
+        .help = "find the baud rate of the servos, and use it",
+        .hint = NULL,
+        .func = &mini_pupper_cmd_probeBaudRate,
+        .argtable = NULL
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd_servo_probeBaudRate) );
+}
+
 static int mini_pupper_cmd_getPosition(int argc, char **argv)
 {
     int nerrors = arg_parse(argc, argv, (void **)&servo_id_loop_args);
@@ -984,6 +1057,19 @@ static int mini_pupper_cmd_stats(int argc, char **argv)
         sqrtf(servo.p_monitor.frequency_var),
         servo.p_monitor.counter
     );      
+    int const polled_servos {__builtin_popcount(servo.getFeedbackMaskAsync())};
+    ESP_LOGI(TAG, "SERVO bus utilisation: %.1f%%  setpoints:%.0fHz  feedback:%.0fHz per servo  (tx:%lld bytes rx:%lld bytes)",
+        servo.b_monitor.utilisation*100.0f,
+        servo.p_monitor.frequency_mean,
+        polled_servos ? servo.b_monitor.frame_frequency/(float)polled_servos : 0.0f,
+        servo.b_monitor.tx_bytes,
+        servo.b_monitor.rx_bytes
+    );
+    ESP_LOGI(TAG, "SERVO bus bytes: tx:%.0fB/s (%.0fB/s with all the setpoints written every cycle)  rx:%.0fB/s",
+        servo.b_monitor.tx_byte_frequency,
+        servo.b_monitor.tx_byte_frequency+servo.b_monitor.tx_saved_byte_frequency,
+        servo.b_monitor.rx_byte_frequency
+    );
     ESP_LOGI(TAG, "IMU service frequency:   %.0fHz < %.0fHz < %.0fHz  [var:%.1fHz] (count:%lld)",
         imu.p_monitor.frequency_min,
         imu.p_monitor.frequency_mean,
@@ -1033,6 +1119,8 @@ void register_mini_pupper_cmds(void)
 {
     register_mini_pupper_cmd_scan();
     register_mini_pupper_cmd_setID();
+    register_mini_pupper_cmd_setBaudRate();
+    register_mini_pupper_cmd_probeBaudRate();
     register_mini_pupper_cmd_calibrate_begin();
     register_mini_pupper_cmd_calibrate_end();
     register_mini_pupper_cmd_calibrate_clear();
@@ -16,6 +16,8 @@ static const char* TAG = "HOST";
 
 #include "driver/uart.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
 #include <string.h>
 
 #define HOST_SERVER_TXD 17
@@ -32,7 +34,7 @@ _uart_port_num(2),
 _is_service_enabled(false),
 _task_handle(NULL),
 _uart_queue(NULL),
-f_monitor(_protocol_handler.f_monitor)
+f_monitor(_protocol_parser.f_monitor)
 {
     // set UART port
     uart_config_t uart_config;
@@ -71,12 +73,367 @@ void HOST::enable_service(bool enable)
     _is_service_enabled = enable;
 }
 
+HOST::instruction_entry const HOST::_instructions[] {
+    // instruction                  parameter length (min, max)                                         handler
+    {INST_CONTROL,                  sizeof(parameters_control_instruction_format),
+                                    sizeof(parameters_control_instruction_format),                      &HOST::on_control},
+    {INST_CONTROL_SEQ,              1+sizeof(parameters_control_instruction_format),
+                                    1+sizeof(parameters_control_instruction_format),                    &HOST::on_control_seq},
+    {INST_PROTOCOL,                 1,  1,                                                              &HOST::on_protocol},
+    {INST_GET_STATS,                0,  0,                                                              &HOST::on_get_stats},
+    {INST_GET_CONFIG,               1,  1,                                                              &HOST::on_get_config},
+    {INST_SET_CONFIG,               1+4,1+4,                                                            &HOST::on_set_config},
+    {INST_READ_SERVO_REGISTERS,     2+1,2+SERVO::REGISTER_ACCESS_MAX_SERVOS,                            &HOST::on_read_servo_registers},
+    {INST_WRITE_SERVO_REGISTERS,    2+2,2+HOST_SERVO_REGISTERS_MAX_DATA,                                &HOST::on_write_servo_registers},
+};
+
+void HOST::dispatch(u8 const * payload, size_t payload_length, instruction_context & context)
+{
+    // payload : instruction, parameters, checksum
+    u8 const instruction {payload[0]};
+    size_t const parameter_length {payload_length-2};
+    for(auto const & entry : _instructions)
+    {
+        if(entry.instruction!=instruction) continue;
+        if(parameter_length<entry.min_parameter_length || parameter_length>entry.max_parameter_length)
+        {
+            send_nack(HOST_STATUS_BAD_PARAMETERS,instruction);
+            return;
+        }
+        (this->*entry.handler)(payload+1,parameter_length,context);
+        return;
+    }
+    // unknown instruction : no log on the hot path
+    send_nack(HOST_STATUS_UNKNOWN_INSTRUCTION,instruction);
+}
+
+// apply the setpoints of a CONTROL or CONTROL_SEQ frame
+void HOST::apply_control(u8 const * buffer)
+{
+    // decode parameters
+    parameters_control_instruction_format parameters;
+    memcpy(&parameters,buffer,sizeof(parameters_control_instruction_format));
+
+    // log
+    ESP_LOGD(TAG, "Goal Position: %d %d %d %d %d %d %d %d %d %d %d %d",
+        parameters.goal_position[0],parameters.goal_position[1],parameters.goal_position[2],
+        parameters.goal_position[3],parameters.goal_position[4],parameters.goal_position[5],
+        parameters.goal_position[6],parameters.goal_position[7],parameters.goal_position[8],
+        parameters.goal_position[9],parameters.goal_position[10],parameters.goal_position[11]
+    );
+    ESP_LOGD(TAG, "Torque Switch: %d %d %d %d %d %d %d %d %d %d %d %d",
+        parameters.torque_enable[0],parameters.torque_enable[1],parameters.torque_enable[2],
+        parameters.torque_enable[3],parameters.torque_enable[4],parameters.torque_enable[5],
+        parameters.torque_enable[6],parameters.torque_enable[7],parameters.torque_enable[8],
+        parameters.torque_enable[9],parameters.torque_enable[10],parameters.torque_enable[11]
+    );
+
+    // update servo setpoint only if service is enabled
+    if(_is_service_enabled)
+    {
+        servo.setTorque12Async(parameters.torque_enable);
+        servo.setPosition12Async(parameters.goal_position);
+    }
+}
+
+// send a CONTROL acknowledge, or a CONTROL_SEQ acknowledge echoing the sequence number (sequence>=0)
+// - the parameters are the fields of the negotiated mask, only these fields are sampled
+void HOST::send_acknowledge(int sequence)
+{
+    uint32_t const fields {_feedback_fields};
+    feedback_values values;
+
+    // servo feedback
+    if(fields & ((1u<<FEEDBACK_POSITION)|(1u<<FEEDBACK_POSITION_PACKED))) servo.getPosition12Async(values.feedback.present_position);
+    if(fields & ((1u<<FEEDBACK_LOAD)|(1u<<FEEDBACK_LOAD_PACKED))) servo.getLoad12Async(values.feedback.present_load);
+    if(fields & (1u<<FEEDBACK_SPEED)) servo.getSpeed12Async(values.extra.present_speed);
+    if(fields & (1u<<FEEDBACK_SERVO_AGE)) servo.getFeedbackAge12Async(values.extra.servo_age);
+    if(fields & (1u<<FEEDBACK_TEMPERATURE))
+    {
+        for(size_t index=0; index<12; ++index)
+        {
+            values.extra.present_temperature[index] = servo.getTemperatureAsync(index+1);
+        }
+    }
+    // imu feedback
+    if(fields & (1u<<FEEDBACK_IMU))
+    {
+        values.feedback.ax = imu.ax;
+        values.feedback.ay = imu.ay;
+        values.feedback.az = imu.az;
+        values.feedback.gx = imu.gx;
+        values.feedback.gy = imu.gy;
+        values.feedback.gz = imu.gz;
+    }
+    if(fields & (1u<<FEEDBACK_IMU_RAW)) memcpy(values.raw.imu,imu.raw,sizeof(values.raw.imu));
+    // power supply feedback
+    if(fields & (1u<<FEEDBACK_POWER))
+    {
+        values.feedback.voltage_V = POWER::get_voltage_V();
+        values.feedback.current_A = POWER::get_current_A();
+    }
+    if(fields & (1u<<FEEDBACK_POWER_PACKED))
+    {
+        values.raw.voltage_mV = POWER::get_voltage_mV();
+        values.raw.current_mA = POWER::get_current_mA();
+    }
+    // timing
+    ++_frame_counter;
+    if(fields & (1u<<FEEDBACK_TIMING))
+    {
+        values.timing.frame_counter = _frame_counter;
+        values.timing.reserved = 0;
+        values.timing.servo_time_us = servo.getOldestFeedbackTimeAsync();
+        values.timing.imu_time_us = __atomic_load_n(&imu.sample_time_us,__ATOMIC_RELAXED);
+        values.timing.tx_time_us = esp_timer_get_time();
+    }
+
+    // build acknowledge frame
+    size_t const sequence_length {sequence>=0 ? (size_t)1 : (size_t)0};
+    u8 tx_buffer[4+1+1+FEEDBACK_FIELDS_MAX_SIZE+1] {
+        0xFF,                                       // Start of Frame
+        0xFF,                                       // Start of Frame
+        0x01,                                       // ID
+        0x00,                                       // Length
+        0x00,                                       // Status
+        (u8)sequence                                // Sequence number (CONTROL_SEQ only)
+    };
+    size_t const fields_length {encode_feedback_fields(values,fields,tx_buffer+5+sequence_length)};
+    size_t const tx_payload_length {1+sequence_length+fields_length+1};
+    size_t const tx_buffer_size {4+tx_payload_length};
+    tx_buffer[3] = (u8)tx_payload_length;
+
+    // compute checksum
+    tx_buffer[tx_buffer_size-1] = compute_checksum(tx_buffer);
+
+    // send frame to host
+    uart_write_bytes(_uart_port_num,tx_buffer,tx_buffer_size);
+
+    // Wait for packet to be sent
+    //ESP_ERROR_CHECK(uart_wait_tx_done(_uart_port_num, 10)); // wait timeout is 10 RTOS ticks (TickType_t)
+}
+
+// send a reply : status, instruction, parameters
+void HOST::send_reply(u8 status, u8 instruction, u8 const * parameters, size_t parameter_length)
+{
+    size_t const tx_payload_length {1+1+parameter_length+1};
+    size_t const tx_buffer_size {4+tx_payload_length};
+    u8 tx_buffer[4+protocol_parser::MAX_PAYLOAD_LENGTH] {
+        0xFF,                                       // Start of Frame
+        0xFF,                                       // Start of Frame
+        0x01,                                       // ID
+        (u8)tx_payload_length,                      // Length
+        status,                                     // Status
+        instruction                                 // Instruction replied
+    };
+    if(parameter_length) memcpy(tx_buffer+6,parameters,parameter_length);
+    tx_buffer[tx_buffer_size-1] = compute_checksum(tx_buffer);
+    uart_write_bytes(_uart_port_num,tx_buffer,tx_buffer_size);
+}
+
+void HOST::send_nack(u8 status, u8 instruction)
+{
+    ++_nack_count;
+    send_reply(status,instruction,nullptr,0);
+}
+
+void HOST::on_control(u8 const * parameters, size_t parameter_length, instruction_context & context)
+{
+    apply_control(parameters);
+
+    // send have_to_reply
+    context.have_to_reply = true;
+}
+
+// several CONTROL_SEQ frames may be pipelined in one event, each one is acknowledged
+void HOST::on_control_seq(u8 const * parameters, size_t parameter_length, instruction_context & context)
+{
+    apply_control(parameters+1);
+    send_acknowledge(parameters[0]);
+}
+
+// use the requested version, or the latest supported, with the acknowledge fields of this version
+void HOST::on_protocol(u8 const * parameters, size_t parameter_length, instruction_context & context)
+{
+    u8 const requested_version {parameters[0]};
+    _protocol_version = requested_version<HOST_PROTOCOL_VERSION_1 ? HOST_PROTOCOL_VERSION_1
+                      : requested_version>HOST_PROTOCOL_VERSION ? HOST_PROTOCOL_VERSION
+                      : requested_version;
+    _feedback_fields = _protocol_version>=HOST_PROTOCOL_VERSION_2 ? FEEDBACK_FIELDS_VERSION_2 : FEEDBACK_FIELDS_VERSION_1;
+    ESP_LOGI(TAG, "Protocol version: %d (requested %d)",_protocol_version,requested_version);
+    u8 tx_buffer[4+1+1+1] {
+        0xFF,                                       // Start of Frame
+        0xFF,                                       // Start of Frame
+        0x01,                                       // ID
+        1+1+1,                                      // Length
+        0x00,                                       // Status
+        _protocol_version                           // Protocol version in use
+    };
+    tx_buffer[sizeof(tx_buffer)-1] = compute_checksum(tx_buffer);
+    uart_write_bytes(_uart_port_num,tx_buffer,sizeof(tx_buffer));
+}
+
+void HOST::on_get_stats(u8 const * parameters, size_t parameter_length, instruction_context & context)
+{
+    using mini_pupper::frame_error_rate_monitor;
+    parameters_stats_format stats;
+    stats.host_frames = f_monitor.counter[frame_error_rate_monitor::ALL];
+    stats.host_checksum_errors = f_monitor.counter[frame_error_rate_monitor::CHECKSUM_ERROR];
+    stats.host_syntax_errors = f_monitor.counter[frame_error_rate_monitor::SYNTAX_ERROR];
+    stats.host_nacks = _nack_count;
+    stats.host_frequency_hz = p_monitor.frequency_mean;
+    stats.servo_frames = servo.f_monitor.counter[frame_error_rate_monitor::ALL];
+    stats.servo_checksum_errors = servo.f_monitor.counter[frame_error_rate_monitor::CHECKSUM_ERROR];
+    stats.servo_syntax_errors = servo.f_monitor.counter[frame_error_rate_monitor::SYNTAX_ERROR];
+    stats.servo_time_out_errors = servo.f_monitor.counter[frame_error_rate_monitor::TIME_OUT_ERROR];
+    stats.servo_truncated_errors = servo.f_monitor.counter[frame_error_rate_monitor::TRUNCATED_ERROR];
+    stats.servo_frequency_hz = servo.p_monitor.frequency_mean;
+    stats.imu_frequency_hz = imu.p_monitor.frequency_mean;
+    stats.uptime_ms = (uint32_t)(esp_timer_get_time()/1000);
+    stats.free_heap = esp_get_free_heap_size();
+    stats.servo_tx_bytes_per_s = servo.b_monitor.tx_byte_frequency;
+    stats.servo_rx_bytes_per_s = servo.b_monitor.rx_byte_frequency;
+    stats.servo_tx_saved_bytes_per_s = servo.b_monitor.tx_saved_byte_frequency;
+    stats.servo_bus_utilisation = servo.b_monitor.utilisation;
+    send_reply(HOST_STATUS_OK,INST_GET_STATS,reinterpret_cast<u8 const *>(&stats),sizeof(stats));
+}
+
+bool HOST::get_config(u8 entry, uint32_t & value) const
+{
+    switch(entry)
+    {
+    case HOST_CONFIG_SERVO_PERIOD_MS:
+        value = servo.getPeriodAsync();
+        return true;
+    case HOST_CONFIG_FEEDBACK_SERVO_MASK:
+        value = servo.getFeedbackMaskAsync();
+        return true;
+    case HOST_CONFIG_FEEDBACK_FIELDS:
+        value = _feedback_fields;
+        return true;
+    case HOST_CONFIG_SERVO_REFRESH_MS:
+        value = servo.getRefreshPeriodAsync();
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool HOST::set_config(u8 entry, uint32_t value)
+{
+    switch(entry)
+    {
+    case HOST_CONFIG_SERVO_PERIOD_MS:
+        if(value>20) return false;
+        servo.setPeriodAsync((u8)value);
+        return true;
+    case HOST_CONFIG_FEEDBACK_SERVO_MASK:
+        if(value==0 || value>0x0FFF) return false;
+        servo.setFeedbackMaskAsync((u16)value);
+        return true;
+    case HOST_CONFIG_FEEDBACK_FIELDS:
+        if(!is_valid_feedback_fields(value)) return false;
+        _feedback_fields = value;
+        return true;
+    case HOST_CONFIG_SERVO_REFRESH_MS:
+        if(value>1000) return false;
+        servo.setRefreshPeriodAsync((u16)value);
+        return true;
+    default:
+        return false;
+    }
+}
+
+void HOST::on_get_config(u8 const * parameters, size_t parameter_length, instruction_context & context)
+{
+    u8 reply[1+4] {parameters[0]};
+    uint32_t value {0};
+    if(!get_config(parameters[0],value))
+    {
+        send_nack(HOST_STATUS_BAD_PARAMETERS,INST_GET_CONFIG);
+        return;
+    }
+    memcpy(reply+1,&value,4);
+    send_reply(HOST_STATUS_OK,INST_GET_CONFIG,reply,sizeof(reply));
+}
+
+void HOST::on_set_config(u8 const * parameters, size_t parameter_length, instruction_context & context)
+{
+    u8 reply[1+4] {parameters[0]};
+    uint32_t value {0};
+    memcpy(&value,parameters+1,4);
+    if(!set_config(parameters[0],value) || !get_config(parameters[0],value))
+    {
+        send_nack(HOST_STATUS_BAD_PARAMETERS,INST_SET_CONFIG);
+        return;
+    }
+    ESP_LOGI(TAG, "Configuration: entry %d = %lu",parameters[0],(unsigned long)value);
+    memcpy(reply+1,&value,4);
+    send_reply(HOST_STATUS_OK,INST_SET_CONFIG,reply,sizeof(reply));
+}
+
+// parameters : address, length, IDs ; reply : status and registers of each servo
+void HOST::on_read_servo_registers(u8 const * parameters, size_t parameter_length, instruction_context & context)
+{
+    u8 const address {parameters[0]};
+    u8 const length {parameters[1]};
+    u8 const * IDs {parameters+2};
+    size_t const count {parameter_length-2};
+    if(length==0 || count*(1+length)>HOST_SERVO_REGISTERS_MAX_DATA)
+    {
+        send_nack(HOST_STATUS_BAD_PARAMETERS,INST_READ_SERVO_REGISTERS);
+        return;
+    }
+    u8 data[HOST_SERVO_REGISTERS_MAX_DATA];
+    u8 status[SERVO::REGISTER_ACCESS_MAX_SERVOS];
+    if(servo.readRegistersAsync(IDs,count,address,length,data,status)!=SERVO_STATUS_OK)
+    {
+        send_nack(HOST_STATUS_FAILED,INST_READ_SERVO_REGISTERS);
+        return;
+    }
+    u8 reply[HOST_SERVO_REGISTERS_MAX_DATA];
+    for(size_t index=0; index<count; ++index)
+    {
+        reply[index*(1+length)] = status[index];
+        memcpy(reply+index*(1+length)+1,data+index*length,length);
+    }
+    send_reply(HOST_STATUS_OK,INST_READ_SERVO_REGISTERS,reply,count*(1+length));
+}
+
+// parameters : address, length, then ID and registers of each servo ; reply : status of each servo
+void HOST::on_write_servo_registers(u8 const * parameters, size_t parameter_length, instruction_context & context)
+{
+    u8 const address {parameters[0]};
+    u8 const length {parameters[1]};
+    if(length==0 || (parameter_length-2)%(1+length)!=0 || (parameter_length-2)/(1+length)>SERVO::REGISTER_ACCESS_MAX_SERVOS)
+    {
+        send_nack(HOST_STATUS_BAD_PARAMETERS,INST_WRITE_SERVO_REGISTERS);
+        return;
+    }
+    size_t const count {(parameter_length-2)/(1+length)};
+    u8 IDs[SERVO::REGISTER_ACCESS_MAX_SERVOS];
+    u8 data[HOST_SERVO_REGISTERS_MAX_DATA];
+    for(size_t index=0; index<count; ++index)
+    {
+        IDs[index] = parameters[2+index*(1+length)];
+        memcpy(data+index*length,parameters+2+index*(1+length)+1,length);
+    }
+    u8 status[SERVO::REGISTER_ACCESS_MAX_SERVOS];
+    if(servo.writeRegistersAsync(IDs,count,address,length,data,status)!=SERVO_STATUS_OK)
+    {
+        send_nack(HOST_STATUS_FAILED,INST_WRITE_SERVO_REGISTERS);
+        return;
+    }
+    send_reply(HOST_STATUS_OK,INST_WRITE_SERVO_REGISTERS,status,count);
+}
+
 void HOST_TASK(void * parameters)
 {
     HOST * host = reinterpret_cast<HOST*>(parameters);
     uart_event_t event;
     u8 rx_buffer[1024] {0};
-    protocol_interpreter_handler & protocol_handler {host->_protocol_handler};
+    protocol_parser & parser {host->_protocol_parser};
+
     for(;;)
     {
         // Waiting for UART event.
@@ -96,91 +453,21 @@ void HOST_TASK(void * parameters)
                     // read a frame from host
                     int const read_length {uart_read_bytes(host->_uart_port_num,rx_buffer,event.size,portMAX_DELAY)};
 
-                    // decode received data
-                    bool have_to_reply {false};
-                    for(size_t index=0; index<read_length; ++index)
+                    // decode received data : frames are handed out in place, in rx_buffer
+                    HOST::instruction_context context;
+                    u8 const * rx_data {rx_buffer};
+                    size_t rx_length {read_length>0 ? (size_t)read_length : 0};
+                    protocol_frame frame;
+                    protocol_parser_status status;
+                    while((status=parser.parse(rx_data,rx_length,frame))!=PROTOCOL_NEED_DATA)
                     {
-                        bool const payload = protocol_interpreter(rx_buffer[index],protocol_handler);
-                        if(payload)
-                        {
-                            // waitinf for a INST_CONTROL frame
-                            if(protocol_handler.payload_buffer[0]==INST_CONTROL && protocol_handler.payload_length == sizeof(parameters_control_instruction_format)+2)
-                            {
-                                // decode parameters
-                                parameters_control_instruction_format parameters;
-                                memcpy(&parameters,&protocol_handler.payload_buffer[1],sizeof(parameters_control_instruction_format));
-
-                                // log
-                                ESP_LOGD(TAG, "Goal Position: %d %d %d %d %d %d %d %d %d %d %d %d",
-                                    parameters.goal_position[0],parameters.goal_position[1],parameters.goal_position[2],
-                                    parameters.goal_position[3],parameters.goal_position[4],parameters.goal_position[5],
-                                    parameters.goal_position[6],parameters.goal_position[7],parameters.goal_position[8],
-                                    parameters.goal_position[9],parameters.goal_position[10],parameters.goal_position[11]
-                                );
-                                ESP_LOGD(TAG, "Torque Switch: %d %d %d %d %d %d %d %d %d %d %d %d",
-                                    parameters.torque_enable[0],parameters.torque_enable[1],parameters.torque_enable[2],
-                                    parameters.torque_enable[3],parameters.torque_enable[4],parameters.torque_enable[5],
-                                    parameters.torque_enable[6],parameters.torque_enable[7],parameters.torque_enable[8],
-                                    parameters.torque_enable[9],parameters.torque_enable[10],parameters.torque_enable[11]
-                                );
-
-                                // update servo setpoint only if service is enabled
-                                if(host->_is_service_enabled)
-                                {
-                                    servo.setTorque12Async(parameters.torque_enable);
-                                    servo.setPosition12Async(parameters.goal_position);
-                                }
-
-                                // send have_to_reply
-                                have_to_reply = true;
-
-                            }
-                            else
-                            {
-                                ESP_LOGI(TAG, "RX unexpected frame. Instr:%d. Length:%d",protocol_handler.payload_buffer[0],protocol_handler.payload_length);        
-                                host->f_monitor.update(mini_pupper::frame_error_rate_monitor::SYNTAX_ERROR, false);
-                            }
-                        }
+                        if(status==PROTOCOL_FRAME) host->dispatch(frame.payload,frame.payload_length,context);
                     }
 
                     // have to reply ?
-                    if(have_to_reply)
+                    if(context.have_to_reply)
                     {
-                        // servo feedback
-                        parameters_control_acknowledge_format feedback_parameters;
-                        servo.getPosition12Async(feedback_parameters.present_position);
-                        servo.getLoad12Async(feedback_parameters.present_load);
-                        // imu feedback
-                        feedback_parameters.ax = imu.ax;
-                        feedback_parameters.ay = imu.ay;
-                        feedback_parameters.az = imu.az;
-                        feedback_parameters.gx = imu.gx;
-                        feedback_parameters.gy = imu.gy;
-                        feedback_parameters.gz = imu.gz;
-                        // power supply feedback
-                        feedback_parameters.voltage_V = POWER::get_voltage_V();
-                        feedback_parameters.current_A = POWER::get_current_A();
-
-                        // build acknowledge frame
-                        static size_t const tx_payload_length {1+sizeof(parameters_control_acknowledge_format)+1};            
-                        static size_t const tx_buffer_size {4+tx_payload_length};            
-                        u8 tx_buffer[tx_buffer_size] {
-                            0xFF,                                       // Start of Frame
-                            0xFF,                                       // Start of Frame
-                            0x01,                                       // ID
-                            tx_payload_length,                          // Length
-                            0x00,                                       // Status
-                        };
-                        memcpy(tx_buffer+5,&feedback_parameters,sizeof(parameters_control_acknowledge_format));
-
-                        // compute checksum
-                        tx_buffer[tx_buffer_size-1] = compute_checksum(tx_buffer);
-
-                        // send frame to host
-                        uart_write_bytes(host->_uart_port_num,tx_buffer,tx_buffer_size);
-
-                        // Wait for packet to be sent
-                        //ESP_ERROR_CHECK(uart_wait_tx_done(host->_uart_port_num, 10)); // wait timeout is 10 RTOS ticks (TickType_t)
+                        host->send_acknowledge(-1);
                     }
 
                     // stats
@@ -35,8 +35,55 @@ private:
 
     int _uart_port_num {2};
     bool _is_service_enabled {false};
+
+    // negotiated host protocol version, CONTROL acknowledges sent since boot
+    u8 _protocol_version {HOST_PROTOCOL_VERSION_1};
+    uint32_t _frame_counter {0};
+
+    // acknowledge fields (FEEDBACK_xxx bits), set by PROTOCOL then SET_CONFIG
+    uint32_t _feedback_fields {FEEDBACK_FIELDS_VERSION_1};
+
+    // instructions answered with a NACK since boot
+    uint32_t _nack_count {0};
     
-    protocol_interpreter_handler _protocol_handler;
+    protocol_parser _protocol_parser;
+
+    // instruction dispatch table : handlers are called with the parameters of a valid frame,
+    // once their length is checked against the table
+    struct instruction_context
+    {
+        bool have_to_reply {false};     // one CONTROL acknowledge for all the CONTROL frames of a UART event
+    };
+    typedef void (HOST::*instruction_handler)(u8 const * parameters, size_t parameter_length, instruction_context & context);
+    struct instruction_entry
+    {
+        u8 instruction;
+        u8 min_parameter_length;
+        u8 max_parameter_length;
+        instruction_handler handler;
+    };
+    static instruction_entry const _instructions[];
+    void dispatch(u8 const * payload, size_t payload_length, instruction_context & context);
+
+    // instruction handlers
+    void on_control(u8 const * parameters, size_t parameter_length, instruction_context & context);
+    void on_control_seq(u8 const * parameters, size_t parameter_length, instruction_context & context);
+    void on_protocol(u8 const * parameters, size_t parameter_length, instruction_context & context);
+    void on_get_stats(u8 const * parameters, size_t parameter_length, instruction_context & context);
+    void on_get_config(u8 const * parameters, size_t parameter_length, instruction_context & context);
+    void on_set_config(u8 const * parameters, size_t parameter_length, instruction_context & context);
+    void on_read_servo_registers(u8 const * parameters, size_t parameter_length, instruction_context & context);
+    void on_write_servo_registers(u8 const * parameters, size_t parameter_length, instruction_context & context);
+
+    // runtime configuration entries, return false for an unknown entry or a value out of range
+    bool get_config(u8 entry, uint32_t & value) const;
+    bool set_config(u8 entry, uint32_t value);
+
+    // frames to the host
+    void apply_control(u8 const * parameters);
+    void send_acknowledge(int sequence);
+    void send_reply(u8 status, u8 instruction, u8 const * parameters, size_t parameter_length);
+    void send_nack(u8 status, u8 instruction);
 
     // background host serial bus service
     TaskHandle_t _task_handle {NULL};    
@@ -7,6 +7,9 @@
 #define _mini_pupper_host_base_H
 
 #include "mini_pupper_types.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
 
 /* PROTOCOL
@@ -51,10 +54,112 @@
  *      * 12 x load     (s16) [-1000..+1000]
  *
  *
+ * CONTROL_SEQ exchange (pipelined) :
+ *
+ *  1) HOST sends a CONTROL_SEQ instruction, possibly before the acknowledge of the previous one.
+ *     Instruction code = 0x02
+ *     Parameters = sequence number (u8), then the CONTROL parameters
+ *
+ *  2) ESP32 replies a CONTROL_SEQ acknowledge for each frame, in order.
+ *     Status code = 0x00
+ *     Parameters = sequence number (u8) of the instruction, then the CONTROL acknowledge parameters
+ *
+ *     The host matches each acknowledge to its frame with the sequence number, so that one or
+ *     two frames can be in flight on the UART while the ESP32 processes the previous one.
+ *
+ *
+ * PROTOCOL exchange (version negotiation) :
+ *
+ *  1) HOST sends a PROTOCOL instruction.
+ *     Instruction code = 0x03
+ *     Parameters = requested protocol version (u8)
+ *
+ *  2) ESP32 replies the version in use : the requested one, or the latest it supports.
+ *     Status code = 0x00
+ *     Parameters = protocol version (u8)
+ *
+ *     The ESP32 starts with version 1. A firmware without PROTOCOL instruction does not
+ *     reply : the host keeps version 1.
+ *     From version 2, the CONTROL and CONTROL_SEQ acknowledges end with the timing parameters :
+ *      * frame counter (u32), reserved (u32)
+ *      * esp_timer time (s64, us) of the oldest servo feedback sample, of the IMU sample,
+ *        and of the acknowledge itself
+ *
+ *
+ * Feedback layout :
+ *
+ *  The parameters of a CONTROL or CONTROL_SEQ acknowledge are the feedback fields of a mask,
+ *  in field order (see feedback_fields below). The PROTOCOL exchange selects the fields of
+ *  the version in use :
+ *   version 1 : POSITION LOAD IMU POWER          (parameters_control_acknowledge_format)
+ *   version 2 : POSITION LOAD IMU POWER TIMING   (then parameters_control_acknowledge_timing_format)
+ *  From version 2, the host may select other fields with SET_CONFIG, entry FEEDBACK_FIELDS :
+ *  fields out of the mask are neither sampled nor sent. A mask whose fields do not fit in a
+ *  frame (FEEDBACK_FIELDS_MAX_SIZE) gets a NACK.
+ *  The packed fields carry the same values in fewer bytes : 10 and 11 bits positions and loads,
+ *  the raw IMU sample and the power supply in mV and mA. With FEEDBACK_FIELDS_PACKED, the
+ *  version 2 parameters take 80 bytes instead of 114.
+ *  SERVO_AGE tells how fresh each joint is : with one servo read per cycle (servos without
+ *  sync read), the servos are not read at the same rate. Ages are in SERVO_AGE_UNIT_US units,
+ *  SERVO_AGE_NEVER_READ for a servo not read since power-up.
+ *
+ *
+ * Other exchanges (tuning and inspection) :
+ *
+ *  The ESP32 replies to each of them with a status code, the instruction code, then the
+ *  parameters of the reply. The host sends them with no CONTROL frame in flight, and tells
+ *  the reply from an acknowledge by the instruction code.
+ *  An unknown instruction, or bad parameters, get a NACK : an error status code and the
+ *  instruction code, without parameters.
+ *
+ *  GET_STATS (0x10) : no parameter. Reply parameters = parameters_stats_format.
+ *
+ *  GET_CONFIG (0x11) : parameter = entry (u8).
+ *  SET_CONFIG (0x12) : parameters = entry (u8), value (u32).
+ *     Reply parameters = entry (u8), value in use (u32).
+ *
+ *  READ_SERVO_REGISTERS (0x13) : parameters = address (u8), length (u8), servo IDs (u8 each).
+ *     Reply parameters = for each servo : status (u8, 0 : OK), registers (length bytes).
+ *
+ *  WRITE_SERVO_REGISTERS (0x14) : parameters = address (u8), length (u8), then for each
+ *     servo : ID (u8), registers (length bytes).
+ *     Reply parameters = for each servo : status (u8, 0 : OK).
+ *
+ *     Register access runs on the servo bus between two cycles of the servo service : the
+ *     ESP32 answers CONTROL frames again once the registers of all servos are accessed.
+ *
+ *
  */
 
 // host instruction code
 #define INST_CONTROL 0x01   // Host sends servo position setpoints, ESP32 replies with servo feedback, attitude, ....
+#define INST_CONTROL_SEQ 0x02   // Same as CONTROL, with a sequence number echoed in the acknowledge (pipelined exchanges)
+#define INST_PROTOCOL 0x03  // Host requests a protocol version, ESP32 replies the version in use
+#define INST_GET_STATS 0x10     // ESP32 replies its host link, servo bus and task statistics
+#define INST_GET_CONFIG 0x11    // ESP32 replies the value of a runtime configuration entry
+#define INST_SET_CONFIG 0x12    // Host writes a runtime configuration entry, ESP32 replies the value in use
+#define INST_READ_SERVO_REGISTERS 0x13  // ESP32 reads the same registers of several servos
+#define INST_WRITE_SERVO_REGISTERS 0x14 // ESP32 writes the same registers of several servos
+
+// host reply status code (first payload byte of a reply)
+#define HOST_STATUS_OK 0x00
+#define HOST_STATUS_UNKNOWN_INSTRUCTION 0x01   // NACK : instruction not supported
+#define HOST_STATUS_BAD_PARAMETERS 0x02        // NACK : bad parameters length or value
+#define HOST_STATUS_FAILED 0x03                // NACK : servo bus busy or powered off
+
+// runtime configuration entries (INST_GET_CONFIG, INST_SET_CONFIG)
+#define HOST_CONFIG_SERVO_PERIOD_MS 0x01        // servo bus cycle period [0..20] ms, 0 : back to back (default)
+#define HOST_CONFIG_FEEDBACK_SERVO_MASK 0x02    // servos polled for feedback (bit N-1 : servo ID N), default 0x0FFF
+#define HOST_CONFIG_FEEDBACK_FIELDS 0x03        // acknowledge fields (bit N : feedback_field N), default : fields of the protocol version
+#define HOST_CONFIG_SERVO_REFRESH_MS 0x04       // all the servo setpoints written again [0..1000] ms (0 : every cycle), default 100
+
+// servo register access (INST_READ_SERVO_REGISTERS, INST_WRITE_SERVO_REGISTERS) : servo count x (1 + length) bytes at most
+#define HOST_SERVO_REGISTERS_MAX_DATA 64
+
+// host protocol versions
+#define HOST_PROTOCOL_VERSION_1 1   // CONTROL acknowledge carries the feedback parameters
+#define HOST_PROTOCOL_VERSION_2 2   // CONTROL acknowledge carries the timing parameters too
+#define HOST_PROTOCOL_VERSION HOST_PROTOCOL_VERSION_2
 
 // frame parameters format for control instruction
 struct parameters_control_instruction_format
@@ -81,5 +186,307 @@ struct parameters_control_acknowledge_format
     float current_A;
 };
 
+// frame parameters appended to the control acknowledge from protocol version 2 (esp_timer times)
+struct parameters_control_acknowledge_timing_format
+{
+    uint32_t frame_counter;     // CONTROL acknowledges sent since ESP32 boot
+    uint32_t reserved;
+    int64_t servo_time_us;      // oldest servo feedback sample
+    int64_t imu_time_us;        // IMU sample
+    int64_t tx_time_us;         // acknowledge sent
+};
+
+// frame parameters of the feedback fields beyond the control acknowledge
+struct parameters_feedback_extra_format
+{
+    s16 present_speed[12];
+    u8 present_temperature[12];     // 0 with SCS 0009
+    uint16_t servo_age[12];         // age of each servo feedback when the acknowledge is sent (SERVO_AGE_UNIT_US)
+};
+
+// raw IMU and power supply samples, carried by the packed feedback fields
+struct parameters_feedback_raw_format
+{
+    int16_t imu[6];                 // ax, ay, az (FEEDBACK_ACCEL_SCALE_G), gx, gy, gz (FEEDBACK_GYRO_SCALE_DPS)
+    uint16_t voltage_mV;
+    uint16_t current_mA;
+};
+
+// QMI8658C full scales (see IMU::init) : 2g, 2048dps
+#define FEEDBACK_ACCEL_SCALE_G (1.0f/16384.0f)
+#define FEEDBACK_GYRO_SCALE_DPS (1.0f/16.0f)
+
+// servo feedback age : 100us units up to SERVO_AGE_MAX (6.5s, saturated), SERVO_AGE_NEVER_READ for a servo never read
+#define SERVO_AGE_UNIT_US 100
+#define SERVO_AGE_MAX 0xFFFE
+#define SERVO_AGE_NEVER_READ 0xFFFF
+
+// all the feedback values an acknowledge may carry
+struct feedback_values
+{
+    parameters_control_acknowledge_format feedback;
+    parameters_control_acknowledge_timing_format timing;
+    parameters_feedback_extra_format extra;
+    parameters_feedback_raw_format raw;
+};
+
+/* Packed fields
+ *
+ *  Values of N bits (N<=11) packed in a little endian bit stream : value i is bits i*N to i*N+N-1.
+ *  Positions (0..1023) take 10 bits, loads (-1023..1023, saturated) 11 bits.
+ */
+inline void pack_bits(uint16_t const * values, size_t count, unsigned bits, u8 * packed)
+{
+    memset(packed,0,(count*bits+7)/8);
+    for(size_t index=0, position=0; index<count; ++index, position+=bits)
+    {
+        uint32_t const value {(uint32_t)(values[index] & ((1u<<bits)-1)) << (position%8)};
+        unsigned const end {(unsigned)(position%8)+bits};
+        packed[position/8] |= (u8)value;
+        if(end>8) packed[position/8+1] |= (u8)(value>>8);
+        if(end>16) packed[position/8+2] |= (u8)(value>>16);
+    }
+}
+
+inline void unpack_bits(u8 const * packed, size_t count, unsigned bits, uint16_t * values)
+{
+    for(size_t index=0, position=0; index<count; ++index, position+=bits)
+    {
+        unsigned const end {(unsigned)(position%8)+bits};
+        uint32_t value {packed[position/8]};
+        if(end>8) value |= (uint32_t)packed[position/8+1]<<8;
+        if(end>16) value |= (uint32_t)packed[position/8+2]<<16;
+        values[index] = (uint16_t)((value>>(position%8)) & ((1u<<bits)-1));
+    }
+}
+
+inline void encode_position_packed(feedback_values const & values, u8 * parameters)
+{
+    uint16_t positions[12];
+    for(size_t index=0; index<12; ++index) positions[index] = values.feedback.present_position[index]>1023 ? 1023 : values.feedback.present_position[index];
+    pack_bits(positions,12,10,parameters);
+}
+
+inline void decode_position_packed(u8 const * parameters, feedback_values & values)
+{
+    uint16_t positions[12];
+    unpack_bits(parameters,12,10,positions);
+    for(size_t index=0; index<12; ++index) values.feedback.present_position[index] = positions[index];
+}
+
+inline void encode_load_packed(feedback_values const & values, u8 * parameters)
+{
+    uint16_t loads[12];
+    for(size_t index=0; index<12; ++index)
+    {
+        int const load {values.feedback.present_load[index]};
+        loads[index] = (uint16_t)(load<-1024 ? -1024 : load>1023 ? 1023 : load);
+    }
+    pack_bits(loads,12,11,parameters);
+}
+
+inline void decode_load_packed(u8 const * parameters, feedback_values & values)
+{
+    uint16_t loads[12];
+    unpack_bits(parameters,12,11,loads);
+    for(size_t index=0; index<12; ++index) values.feedback.present_load[index] = (s16)((int16_t)(loads[index]<<5)>>5);    // sign extension
+}
+
+inline void encode_imu_raw(feedback_values const & values, u8 * parameters)
+{
+    memcpy(parameters,values.raw.imu,sizeof(values.raw.imu));
+}
+
+inline void decode_imu_raw(u8 const * parameters, feedback_values & values)
+{
+    memcpy(values.raw.imu,parameters,sizeof(values.raw.imu));
+    values.feedback.ax = values.raw.imu[0]*FEEDBACK_ACCEL_SCALE_G;
+    values.feedback.ay = values.raw.imu[1]*FEEDBACK_ACCEL_SCALE_G;
+    values.feedback.az = values.raw.imu[2]*FEEDBACK_ACCEL_SCALE_G;
+    values.feedback.gx = values.raw.imu[3]*FEEDBACK_GYRO_SCALE_DPS;
+    values.feedback.gy = values.raw.imu[4]*FEEDBACK_GYRO_SCALE_DPS;
+    values.feedback.gz = values.raw.imu[5]*FEEDBACK_GYRO_SCALE_DPS;
+}
+
+inline void encode_power_packed(feedback_values const & values, u8 * parameters)
+{
+    memcpy(parameters,&values.raw.voltage_mV,sizeof(uint16_t));
+    memcpy(parameters+sizeof(uint16_t),&values.raw.current_mA,sizeof(uint16_t));
+}
+
+inline void decode_power_packed(u8 const * parameters, feedback_values & values)
+{
+    memcpy(&values.raw.voltage_mV,parameters,sizeof(uint16_t));
+    memcpy(&values.raw.current_mA,parameters+sizeof(uint16_t),sizeof(uint16_t));
+    values.feedback.voltage_V = values.raw.voltage_mV*0.001f;
+    values.feedback.current_A = values.raw.current_mA*0.001f;
+}
+
+/* Feedback fields
+ *
+ *  One description for the ESP32 and the host : the acknowledge parameters are the fields of
+ *  the negotiated mask, in this order. A field is copied from (ESP32) or to (host) feedback_values
+ *  as is, or converted by its encode and decode functions (packed fields). The host gets the
+ *  same feedback_values members from a field and from its packed variant.
+ *  The fields of protocol versions 1 and 2 come first, so that their masks give the same
+ *  layouts as before.
+ */
+enum feedback_field
+{
+    FEEDBACK_POSITION,          // present position (12 x u16)
+    FEEDBACK_LOAD,              // present load (12 x s16)
+    FEEDBACK_IMU,               // ax, ay, az, gx, gy, gz (6 x float)
+    FEEDBACK_POWER,             // voltage_V, current_A (2 x float)
+    FEEDBACK_TIMING,            // parameters_control_acknowledge_timing_format
+    FEEDBACK_SPEED,             // present speed (12 x s16)
+    FEEDBACK_TEMPERATURE,       // present temperature (12 x u8)
+    FEEDBACK_POSITION_PACKED,   // present position (12 x 10 bits)
+    FEEDBACK_LOAD_PACKED,       // present load (12 x 11 bits)
+    FEEDBACK_IMU_RAW,           // raw IMU sample (6 x s16)
+    FEEDBACK_POWER_PACKED,      // voltage and current in mV and mA (2 x u16)
+    FEEDBACK_SERVO_AGE,         // age of each servo feedback (12 x u16, SERVO_AGE_UNIT_US)
+    FEEDBACK_FIELD_COUNT
+};
+
+#define FEEDBACK_FIELDS_VERSION_1 ((1u<<FEEDBACK_POSITION)|(1u<<FEEDBACK_LOAD)|(1u<<FEEDBACK_IMU)|(1u<<FEEDBACK_POWER))
+#define FEEDBACK_FIELDS_VERSION_2 (FEEDBACK_FIELDS_VERSION_1|(1u<<FEEDBACK_TIMING))
+// the fields of version 2, packed
+#define FEEDBACK_FIELDS_PACKED ((1u<<FEEDBACK_POSITION_PACKED)|(1u<<FEEDBACK_LOAD_PACKED)|(1u<<FEEDBACK_IMU_RAW)|(1u<<FEEDBACK_POWER_PACKED)|(1u<<FEEDBACK_TIMING))
+#define FEEDBACK_FIELDS_ALL ((1u<<FEEDBACK_FIELD_COUNT)-1)
+// acknowledge payload of 127 bytes at most : status, sequence number, fields, checksum
+#define FEEDBACK_FIELDS_MAX_SIZE 124
+
+struct feedback_field_description
+{
+    char const * name;
+    uint16_t offset;    // in feedback_values, fields copied as is
+    uint16_t size;      // in the acknowledge, bytes
+    void (*encode)(feedback_values const & values, u8 * parameters);    // nullptr : copied as is
+    void (*decode)(u8 const * parameters, feedback_values & values);
+};
+
+constexpr feedback_field_description feedback_fields[FEEDBACK_FIELD_COUNT]
+{
+    {"position",        offsetof(feedback_values,feedback)+offsetof(parameters_control_acknowledge_format,present_position),    12*sizeof(u16),     nullptr, nullptr},
+    {"load",            offsetof(feedback_values,feedback)+offsetof(parameters_control_acknowledge_format,present_load),        12*sizeof(s16),     nullptr, nullptr},
+    {"imu",             offsetof(feedback_values,feedback)+offsetof(parameters_control_acknowledge_format,ax),                  6*sizeof(float),    nullptr, nullptr},
+    {"power",           offsetof(feedback_values,feedback)+offsetof(parameters_control_acknowledge_format,voltage_V),           2*sizeof(float),    nullptr, nullptr},
+    {"timing",          offsetof(feedback_values,timing),                                                                       sizeof(parameters_control_acknowledge_timing_format), nullptr, nullptr},
+    {"speed",           offsetof(feedback_values,extra)+offsetof(parameters_feedback_extra_format,present_speed),               12*sizeof(s16),     nullptr, nullptr},
+    {"temperature",     offsetof(feedback_values,extra)+offsetof(parameters_feedback_extra_format,present_temperature),         12*sizeof(u8),      nullptr, nullptr},
+    {"packed_position", 0,                                                                                                      (12*10+7)/8,        encode_position_packed, decode_position_packed},
+    {"packed_load",     0,                                                                                                      (12*11+7)/8,        encode_load_packed,     decode_load_packed},
+    {"raw_imu",         0,                                                                                                      6*sizeof(int16_t),  encode_imu_raw,         decode_imu_raw},
+    {"packed_power",    0,                                                                                                      2*sizeof(uint16_t), encode_power_packed,    decode_power_packed},
+    {"servo_age",       offsetof(feedback_values,extra)+offsetof(parameters_feedback_extra_format,servo_age),                   12*sizeof(uint16_t),nullptr,                nullptr},
+};
+
+// Size of the acknowledge parameters of a field mask
+constexpr size_t feedback_fields_size(uint32_t fields)
+{
+    size_t size {0};
+    for(size_t field=0; field<FEEDBACK_FIELD_COUNT; ++field)
+    {
+        if(fields & (1u<<field)) size += feedback_fields[field].size;
+    }
+    return size;
+}
+
+static_assert(feedback_fields_size(FEEDBACK_FIELDS_VERSION_1)==sizeof(parameters_control_acknowledge_format), "version 1 acknowledge layout");
+static_assert(feedback_fields_size(FEEDBACK_FIELDS_VERSION_2)==sizeof(parameters_control_acknowledge_format)+sizeof(parameters_control_acknowledge_timing_format), "version 2 acknowledge layout");
+static_assert(feedback_fields_size(FEEDBACK_FIELDS_PACKED)==80, "packed acknowledge layout");
+
+// A field mask the ESP32 accepts : known fields, not empty, fitting in a frame
+constexpr bool is_valid_feedback_fields(uint32_t fields)
+{
+    return fields!=0 && (fields & ~FEEDBACK_FIELDS_ALL)==0 && feedback_fields_size(fields)<=FEEDBACK_FIELDS_MAX_SIZE;
+}
+
+// Serialize the fields of a mask, return the length of the parameters
+inline size_t encode_feedback_fields(feedback_values const & values, uint32_t fields, u8 * parameters)
+{
+    size_t length {0};
+    for(size_t field=0; field<FEEDBACK_FIELD_COUNT; ++field)
+    {
+        if(!(fields & (1u<<field))) continue;
+        feedback_field_description const & description {feedback_fields[field]};
+        if(description.encode) description.encode(values,parameters+length);
+        else memcpy(parameters+length,reinterpret_cast<u8 const *>(&values)+description.offset,description.size);
+        length += description.size;
+    }
+    return length;
+}
+
+// Deserialize the fields of a mask, the other values are left untouched
+inline void decode_feedback_fields(u8 const * parameters, uint32_t fields, feedback_values & values)
+{
+    for(size_t field=0; field<FEEDBACK_FIELD_COUNT; ++field)
+    {
+        if(!(fields & (1u<<field))) continue;
+        feedback_field_description const & description {feedback_fields[field]};
+        if(description.decode) description.decode(parameters,values);
+        else memcpy(reinterpret_cast<u8 *>(&values)+description.offset,parameters,description.size);
+        parameters += description.size;
+    }
+}
+
+// frame parameters format for stats reply
+struct parameters_stats_format
+{
+    // host link : frames received, errors, instructions answered with a NACK
+    uint32_t host_frames;
+    uint32_t host_checksum_errors;
+    uint32_t host_syntax_errors;
+    uint32_t host_nacks;
+    float host_frequency_hz;        // UART events processed per second
+    // servo bus : feedback reads, errors
+    uint32_t servo_frames;
+    uint32_t servo_checksum_errors;
+    uint32_t servo_syntax_errors;
+    uint32_t servo_time_out_errors;
+    uint32_t servo_truncated_errors;
+    float servo_frequency_hz;       // servo bus cycles per second
+    // IMU
+    float imu_frequency_hz;         // samples per second
+    // ESP32
+    uint32_t uptime_ms;
+    uint32_t free_heap;             // bytes
+    // servo bus load (missing from the replies of older firmwares)
+    float servo_tx_bytes_per_s;
+    float servo_rx_bytes_per_s;
+    float servo_tx_saved_bytes_per_s;   // not sent, the setpoints being unchanged
+    float servo_bus_utilisation;        // 0..1
+};
+
+// CONTROL or CONTROL_SEQ acknowledge, of any protocol version or field mask
+struct control_acknowledge : feedback_values
+{
+    int sequence;               // echoed sequence number, -1 for a CONTROL acknowledge
+    int version;                // HOST_PROTOCOL_VERSION_2 when timing is valid
+    uint32_t fields;            // fields decoded, the other values are zero
+};
+
+// Decode the payload of an acknowledge : status, [sequence], fields, checksum
+// - payload_length includes the checksum, as protocol_frame::payload_length
+// - fields : the negotiated field mask, 0 if not known (the layouts of versions 1 and 2 are told apart by length)
+inline bool decode_control_acknowledge(u8 const * payload, size_t payload_length, uint32_t fields, control_acknowledge & ack)
+{
+    if(payload[0]!=0x00) return false;
+    uint32_t const candidates[2] { fields ? fields : FEEDBACK_FIELDS_VERSION_1, fields ? fields : FEEDBACK_FIELDS_VERSION_2 };
+    for(uint32_t const candidate : candidates)
+    {
+        size_t const length {1+feedback_fields_size(candidate)+1};
+        if(payload_length!=length && payload_length!=length+1) continue;
+        bool const has_sequence {payload_length==length+1};
+        ack.sequence = has_sequence ? payload[1] : -1;
+        ack.version = (candidate & (1u<<FEEDBACK_TIMING)) ? HOST_PROTOCOL_VERSION_2 : HOST_PROTOCOL_VERSION_1;
+        ack.fields = candidate;
+        feedback_values & values = ack;
+        memset(&values,0,sizeof(feedback_values));
+        decode_feedback_fields(payload+(has_sequence ? 2 : 1),candidate,values);
+        return true;
+    }
+    return false;
+}
 
 #endif //_mini_pupper_host_base_H
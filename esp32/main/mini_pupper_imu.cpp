@@ -5,6 +5,7 @@
 
 #include "mini_pupper_imu.h"
 #include "mini_pupper_tasks.h"
+#include "mini_pupper_host_base.h"
 
 
 #include "esp_log.h"
@@ -162,18 +163,24 @@ uint8_t IMU::read_bytes(uint8_t reg_addr, uint8_t data[], uint8_t size)
 
 uint8_t IMU::read_6dof()
 {
-  uint8_t raw[12];
+  uint8_t bytes[12];
   uint8_t reg_addr = QMI8658C_ACC_GYRO_OUTX_L_XL_REG;
-  uint8_t err = i2c_master_write_read_device(I2C_MASTER_NUM, I2C_DEV_ADDR, &reg_addr, 1, raw, sizeof(raw), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+  uint8_t err = i2c_master_write_read_device(I2C_MASTER_NUM, I2C_DEV_ADDR, &reg_addr, 1, bytes, sizeof(bytes), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
 
   if(!err)
   {
-    ax = 1.0/16384.0*((int16_t)(raw[1]<<8) | raw[0]);
-    ay = 1.0/16384.0*((int16_t)(raw[3]<<8) | raw[2]);
-    az = 1.0/16384.0*((int16_t)(raw[5]<<8) | raw[4]);
-    gx = 1.0/16.0* ((int16_t)(raw[7]<<8) | raw[6]);
-    gy = 1.0/16.0* ((int16_t)(raw[9]<<8) | raw[8]);
-    gz = 1.0/16.0* ((int16_t)(raw[11]<<8) | raw[10]);
+    // keep the raw sample for the packed host feedback, convert in single precision (no double FPU)
+    for(size_t index=0; index<6; ++index)
+    {
+      raw[index] = (int16_t)((bytes[2*index+1]<<8) | bytes[2*index]);
+    }
+    ax = FEEDBACK_ACCEL_SCALE_G*raw[0];
+    ay = FEEDBACK_ACCEL_SCALE_G*raw[1];
+    az = FEEDBACK_ACCEL_SCALE_G*raw[2];
+    gx = FEEDBACK_GYRO_SCALE_DPS*raw[3];
+    gy = FEEDBACK_GYRO_SCALE_DPS*raw[4];
+    gz = FEEDBACK_GYRO_SCALE_DPS*raw[5];
+    __atomic_store_n(&sample_time_us,esp_timer_get_time(),__ATOMIC_RELAXED);
     // stats
     f_monitor.update();
   }
@@ -185,6 +192,7 @@ uint8_t IMU::read_6dof()
     gx = 0.0f;
     gy = 0.0f;
     gz = 0.0f;
+    memset(this->raw,0,sizeof(this->raw));
     // stats
     f_monitor.update(mini_pupper::frame_error_rate_monitor::TIME_OUT_ERROR);
     return 6;
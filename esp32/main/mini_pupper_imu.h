@@ -37,6 +37,8 @@ struct IMU
 
   float ax, ay, az;
   float gx, gy, gz;
+  int16_t raw[6] {0};          // last 6DOF sample : ax, ay, az, gx, gy, gz (LSB)
+  int64_t sample_time_us {0};  // esp_timer time of the last 6DOF sample, read by HOST_TASK : __atomic accesses only
   
   // public stats
     mini_pupper::periodic_process_monitor p_monitor;
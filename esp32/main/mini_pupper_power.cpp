@@ -19,6 +19,10 @@ namespace POWER
     static float ALPHA_VOLTAGE {0.1f};
     static float ALPHA_CURRENT {0.1f};
 
+    // ADC (12 bits, 3.3V) to current (10A per 2.5V) and voltage (14.7/4.7 divider), in single precision (no double FPU)
+    static float const CURRENT_A_PER_LSB {3.3f / 4096.0f * 10.0f / 2.5f};
+    static float const VOLTAGE_V_PER_LSB {3.3f / 4096.0f * 14.7f / 4.7f};
+
     static size_t const SAMPLE_COUNT {12}; // count
     static size_t const SAMPLE_FREQ {SOC_ADC_SAMPLE_FREQ_THRES_LOW}; // 611Hz
 
@@ -102,12 +106,12 @@ namespace POWER
                     {
                     case ADC_CHANNEL_0: // current
                         {
-                            current = ALPHA_CURRENT * sample_data->type2.data * 3.3 / 4096.0 * 10.0 / 2.5 + (1.0-ALPHA_CURRENT) * current;
+                            current = ALPHA_CURRENT * sample_data->type2.data * CURRENT_A_PER_LSB + (1.0f-ALPHA_CURRENT) * current;
                         }
                         break;
                     case ADC_CHANNEL_1: // voltage
                         {
-                            voltage = ALPHA_VOLTAGE * sample_data->type2.data * 3.3 / 4096.0 * 14.7 / 4.7 + (1.0-ALPHA_VOLTAGE) * voltage;
+                            voltage = ALPHA_VOLTAGE * sample_data->type2.data * VOLTAGE_V_PER_LSB + (1.0f-ALPHA_VOLTAGE) * voltage;
                         }
                         break;
                     //default:
@@ -128,4 +132,14 @@ namespace POWER
         return current;
     }
 
+    u16 get_voltage_mV()
+    {
+        return (u16)(voltage * 1000.0f + 0.5f);
+    }
+
+    u16 get_current_mA()
+    {
+        return (u16)(current * 1000.0f + 0.5f);
+    }
+
 } // namespace POWER
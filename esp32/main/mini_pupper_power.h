@@ -22,6 +22,10 @@ namespace POWER
     float get_voltage_V();
     float get_current_A();    
 
+    // same values, rounded to the mV and mA (packed host feedback)
+    u16 get_voltage_mV();
+    u16 get_current_mA();
+
 };
 
 #endif //_mini_pupper_power_H
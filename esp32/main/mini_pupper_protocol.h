@@ -8,19 +8,39 @@
 
 #include "mini_pupper_types.h"
 #include "mini_pupper_stats.h"
+#include <stdint.h>
 #include <string.h>
 
 ///#include "esp_log.h"
 
-inline u8 compute_checksum(u8 const buffer[])
+// Sum of bytes modulo 256, one 32-bit word at a time
+// - the bytes of a word are added into two 16-bit lanes : no carry crosses a lane for up to 128 words
+inline u8 sum_bytes(u8 const * data, size_t length)
 {
-    size_t const frame_size { (size_t)(buffer[3]+4) };
-    u8 chk_sum = 0;
-    for(size_t index=2; index<(frame_size-1); ++index)
+    uint32_t lanes {0};
+    u8 sum {0};
+    while(length>=4)
     {
-        chk_sum += buffer[index];
+        size_t const words { length/4<128 ? length/4 : 128 };
+        for(size_t index=0; index<words; ++index)
+        {
+            uint32_t word;
+            memcpy(&word,data+4*index,4);
+            lanes += (word & 0x00FF00FFU) + ((word>>8) & 0x00FF00FFU);
+        }
+        sum += (u8)(lanes + (lanes>>16));
+        lanes = 0;
+        data += 4*words;
+        length -= 4*words;
     }
-    return ~chk_sum;
+    while(length--) sum += *data++;
+    return sum;
+}
+
+inline u8 compute_checksum(u8 const buffer[])
+{
+    size_t const frame_size { (size_t)(buffer[3]+4) };
+    return ~sum_bytes(buffer+2,frame_size-3);
 }
 
 inline bool checksum(u8 const buffer[], u8 & expected_checksum)
@@ -85,7 +105,7 @@ inline bool protocol_interpreter(u8 input_byte, protocol_interpreter_handler & h
             handler.payload_length = input_byte;
             handler.checksum += input_byte;
             handler.payload_byte_cout = 0;
-            if(handler.payload_length>0 && handler.payload_length<handler.MAX_PAYLOAD_LENGTH) handler.state = PAYLOAD; // reject empty payload, reject too large payload
+            if(handler.payload_length>1 && handler.payload_length<handler.MAX_PAYLOAD_LENGTH) handler.state = PAYLOAD; // reject empty payload, reject too large payload
             else
             {
                 handler.state = HEADER1;   
@@ -121,4 +141,133 @@ inline bool protocol_interpreter(u8 input_byte, protocol_interpreter_handler & h
     return false; // no valid payload found
 }
 
+enum protocol_parser_status
+{
+    PROTOCOL_NEED_DATA,         // all the input is consumed
+    PROTOCOL_FRAME,             // a frame with a valid checksum
+    PROTOCOL_CHECKSUM_ERROR     // a frame with a bad checksum
+};
+
+struct protocol_frame
+{
+    u8 const * payload {nullptr};   // instruction (or status), parameters, checksum
+    u8 payload_length {0};          // Length field of the frame : payload bytes, checksum included
+};
+
+// Buffer-oriented parser : same frames, resync and f_monitor accounting as protocol_interpreter
+// - headers are found with memchr, the checksum is computed in one pass over the whole payload
+// - a frame received in one buffer is handed out in place : only frames split across two
+//   buffers are copied into payload_buffer
+struct protocol_parser
+{
+    protocol_interpreter_state state{HEADER1};
+    u8 payload_length {0};
+    u8 payload_byte_count {0};
+    static u8 const MAX_PAYLOAD_LENGTH {128};
+    u8 payload_buffer[MAX_PAYLOAD_LENGTH] {0};
+    mini_pupper::frame_error_rate_monitor f_monitor;
+
+    // Parse the input up to the end of the next frame
+    // - data and length are advanced past the consumed bytes : call again until PROTOCOL_NEED_DATA
+    // - frame.payload points into the input, or into payload_buffer : valid until the next call
+    protocol_parser_status parse(u8 const * & data, size_t & length, protocol_frame & frame)
+    {
+        while(length>0)
+        {
+            switch(state)
+            {
+            default:
+            case HEADER1: // scan for a new frame starting with 0xFF
+                {
+                    u8 const * header { static_cast<u8 const *>(memchr(data,0xFF,length)) };
+                    if(!header)
+                    {
+                        data += length;
+                        length = 0;
+                        return PROTOCOL_NEED_DATA;
+                    }
+                    length -= header+1-data;
+                    data = header+1;
+                    state = HEADER2;
+                }
+                break;
+            case HEADER2: // waiting for a second 0xFF
+                {
+                    state = (*data==0xFF) ? ID : HEADER1;
+                    ++data;
+                    --length;
+                }
+                break;
+            case ID: // waiting for an ID (=0x01)
+                {
+                    u8 const id {*data++};
+                    --length;
+                    if(id==0x01) state = LENGTH;
+                    else if(id!=0xFF)
+                    {
+                        state = HEADER1;
+                        f_monitor.update(mini_pupper::frame_error_rate_monitor::SYNTAX_ERROR);
+                    }
+                }
+                break;
+            case LENGTH: // waiting for a length
+                {
+                    payload_length = *data++;
+                    --length;
+                    if(payload_length<2 || payload_length>=MAX_PAYLOAD_LENGTH) // reject empty payload, reject too large payload
+                    {
+                        state = HEADER1;
+                        f_monitor.update(mini_pupper::frame_error_rate_monitor::SYNTAX_ERROR);
+                        break;
+                    }
+                    if(length>=payload_length) // whole payload in the input : checked in place
+                    {
+                        state = HEADER1;
+                        frame.payload = data;
+                        frame.payload_length = payload_length;
+                        data += payload_length;
+                        length -= payload_length;
+                        return check(frame);
+                    }
+                    payload_byte_count = 0;
+                    state = PAYLOAD;
+                }
+                break;
+            case PAYLOAD: // payload split across buffers
+                {
+                    size_t const count { length<(size_t)(payload_length-payload_byte_count) ? length : (size_t)(payload_length-payload_byte_count) };
+                    memcpy(payload_buffer+payload_byte_count,data,count);
+                    payload_byte_count += count;
+                    data += count;
+                    length -= count;
+                    if(payload_byte_count==payload_length)
+                    {
+                        state = HEADER1;
+                        frame.payload = payload_buffer;
+                        frame.payload_length = payload_length;
+                        return check(frame);
+                    }
+                }
+                break;
+            }
+        }
+        return PROTOCOL_NEED_DATA;
+    }
+
+private:
+
+    protocol_parser_status check(protocol_frame const & frame)
+    {
+        // checksum of ID (=0x01), length and payload
+        u8 const sum { (u8)(0x01 + frame.payload_length + sum_bytes(frame.payload,frame.payload_length-1)) };
+        if(frame.payload[frame.payload_length-1]==(u8)(~sum))
+        {
+            f_monitor.update();
+            return PROTOCOL_FRAME;
+        }
+        f_monitor.update(mini_pupper::frame_error_rate_monitor::CHECKSUM_ERROR);
+        return PROTOCOL_CHECKSUM_ERROR;
+    }
+};
+
 #endif //_mini_pupper_protocol_H
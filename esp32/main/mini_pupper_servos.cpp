@@ -6,18 +6,29 @@
 #include "mini_pupper_servos.h"
 #include "mini_pupper_math.h"
 #include "mini_pupper_tasks.h"
+#include "mini_pupper_host_base.h"
 
 #include "driver/uart.h"
 #include "driver/gpio.h"
 #include "hal/gpio_hal.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include <string.h>
+#include <stdlib.h>
 
 // reference :
 //https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-reference/peripherals/uart.html
 
 static char const * TAG {"SERVOS"};
 
+void reply_timer_callback(void * parameters)
+{
+    // tag the time-out with the transaction the timer was armed for, then wake the reply wait up
+    SERVO * servo = reinterpret_cast<SERVO*>(parameters);
+    __atomic_store_n(&servo->_timed_out_transaction,__atomic_load_n(&servo->_armed_transaction,__ATOMIC_ACQUIRE),__ATOMIC_RELEASE);
+    xSemaphoreGive(servo->_reply_time_out);
+}
+
 SERVO servo;
 
 SERVO::SERVO()
@@ -36,7 +47,7 @@ SERVO::SERVO()
 
     // set UART port
     uart_config_t uart_config;
-    uart_config.baud_rate = 500000;
+    uart_config.baud_rate = _baud_rate;
     uart_config.data_bits = UART_DATA_8_BITS;
     uart_config.parity = UART_PARITY_DISABLE;
     uart_config.stop_bits = UART_STOP_BITS_1;
@@ -48,9 +59,30 @@ SERVO::SERVO()
     uart_config.source_clk = UART_SCLK_XTAL;
 #endif
     uart_port_num = UART_NUM_1;
-    ESP_ERROR_CHECK(uart_driver_install(uart_port_num, 1024, 1024, 0, NULL, 0));
+    ESP_ERROR_CHECK(uart_driver_install(uart_port_num, 1024, 1024, UART_QUEUE_LENGTH, &_uart_queue, 0));
     ESP_ERROR_CHECK(uart_param_config(uart_port_num, &uart_config));
     ESP_ERROR_CHECK(uart_set_pin(uart_port_num, 4, 5, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+    // RX event as soon as the bus is idle for 2 bytes, at the end of each reply
+    ESP_ERROR_CHECK(uart_set_rx_timeout(uart_port_num, 2));
+
+    // reply time-out of the async service, given to a private semaphore : the reply wait selects the
+    // UART events (read only, the driver owns the queue) or the time-out
+    _reply_time_out = xSemaphoreCreateBinaryStatic(&_reply_time_out_semaphore);
+    _reply_events = xQueueCreateSet(UART_QUEUE_LENGTH+1);
+    xQueueAddToSet(_uart_queue,_reply_events);
+    xQueueAddToSet(_reply_time_out,_reply_events);
+    esp_timer_create_args_t const reply_timer_args {
+        .callback = &reply_timer_callback,
+        .arg = (void*)this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "servo reply"
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&reply_timer_args, &_reply_timer));
+
+    // register access requests to the async service
+    _register_access_mutex = xSemaphoreCreateMutexStatic(&_register_access_semaphores[0]);
+    _register_access_request = xSemaphoreCreateBinaryStatic(&_register_access_semaphores[1]);
+    _register_access_done = xSemaphoreCreateBinaryStatic(&_register_access_semaphores[2]);
 }
 
 static size_t const stack_size = 10000;
@@ -84,6 +116,10 @@ void SERVO::enable_power(bool enable)
         gpio_set_level(GPIO_NUM_8, 1);
         _is_power_enabled = true;
         _is_service_enabled = false;
+        // try sync read again, servos may have changed
+        _use_sync_read = true;
+        _sync_read_mask = 0;
+        _sync_read_failures = 0;
     }
     else
     {
@@ -544,10 +580,24 @@ int SERVO::setID(u8 servoID, u8 newID)
 }
 
 
+// the setpoint is written at the next bus cycle if it changes or was never written (the servo task clears the dirty bits)
+template<typename T> void SERVO::update_setpoint(SERVO_STATE & servoState, T & setpoint, T value, u8 setpoint_bit)
+{
+    if(setpoint==value && (servoState.written&setpoint_bit)) return;
+    setpoint = value;
+    __atomic_fetch_or(&servoState.dirty,setpoint_bit,__ATOMIC_RELEASE);
+}
+
+void SERVO::mark_setpoints_dirty()
+{
+    for(auto & servoState : state)
+        __atomic_fetch_or(&servoState.dirty,(u8)(SETPOINT_TORQUE|SETPOINT_POSITION|servoState.written),__ATOMIC_RELEASE);
+}
+
 void SERVO::setTorqueAsync(u8 servoID, u8 servoTorque)
 {
     if(0<servoID && servoID<=12)
-        state[servoID-1].torque_enable=servoTorque;
+        update_setpoint(state[servoID-1],state[servoID-1].torque_enable,servoTorque,SETPOINT_TORQUE);
     
     // (re)start sync service
     enable_service();
@@ -556,7 +606,7 @@ void SERVO::setTorqueAsync(u8 servoID, u8 servoTorque)
 void SERVO::setTorque12Async(u8 const servoTorques[])
 {
     for(size_t index=0;index<12;++index)
-        state[index].torque_enable = servoTorques[index];
+        update_setpoint(state[index],state[index].torque_enable,servoTorques[index],SETPOINT_TORQUE);
     
     // (re)start sync service
     enable_service();
@@ -565,7 +615,7 @@ void SERVO::setTorque12Async(u8 const servoTorques[])
 void SERVO::setPositionAsync(u8 servoID, u16 servoPosition)
 {
     if(0<servoID && servoID<=12)
-        state[servoID-1].goal_position=servoPosition; // TODO : take in account calibration_offset and constrain from 0 to 1023 !
+        update_setpoint(state[servoID-1],state[servoID-1].goal_position,servoPosition,SETPOINT_POSITION); // TODO : take in account calibration_offset and constrain from 0 to 1023 !
     
     // (re)start sync service
     enable_service();
@@ -574,12 +624,30 @@ void SERVO::setPositionAsync(u8 servoID, u16 servoPosition)
 void SERVO::setPosition12Async(u16 const servoPositions[])
 {
     for(size_t index=0;index<12;++index)
-        state[index].goal_position = servoPositions[index]; // TODO : take in account calibration_offset and constrain from 0 to 1023 !
+        update_setpoint(state[index],state[index].goal_position,servoPositions[index],SETPOINT_POSITION); // TODO : take in account calibration_offset and constrain from 0 to 1023 !
     
     // (re)start sync service
     enable_service();
 }
 
+void SERVO::setGoalSpeedAsync(u8 servoID, u16 servoSpeed)
+{
+    if(0<servoID && servoID<=12)
+        update_setpoint(state[servoID-1],state[servoID-1].goal_speed,servoSpeed,SETPOINT_SPEED);
+
+    // (re)start sync service
+    enable_service();
+}
+
+void SERVO::setGoalSpeed12Async(u16 const servoSpeeds[])
+{
+    for(size_t index=0;index<12;++index)
+        update_setpoint(state[index],state[index].goal_speed,servoSpeeds[index],SETPOINT_SPEED);
+
+    // (re)start sync service
+    enable_service();
+}
+
 void SERVO::getGoalPosition12Async(u16 servoPositions[])
 {
     // (re)start sync service
@@ -616,6 +684,132 @@ void SERVO::getLoad12Async(s16 servoLoads[])
         servoLoads[index] = state[index].present_load;
 }
 
+int64_t SERVO::getOldestFeedbackTimeAsync()
+{
+    // 64-bit loads are not single instructions on Xtensa : read the times written by SERVO_TASK atomically
+    int64_t oldest_time_us {INT64_MAX};
+    for(size_t index=0;index<12;++index)
+    {
+        if(!(_feedback_mask&(1<<index))) continue;
+        int64_t const feedback_time_us {__atomic_load_n(&state[index].feedback_time_us,__ATOMIC_RELAXED)};
+        if(feedback_time_us<oldest_time_us) oldest_time_us = feedback_time_us;
+    }
+    return oldest_time_us;
+}
+
+void SERVO::getFeedbackAge12Async(u16 servoAges[])
+{
+    int64_t const now_us {esp_timer_get_time()};
+    for(size_t index=0;index<12;++index)
+    {
+        int64_t const feedback_time_us {__atomic_load_n(&state[index].feedback_time_us,__ATOMIC_RELAXED)};
+        servoAges[index] = (feedback_time_us==0) ? SERVO_AGE_NEVER_READ : (u16)std::min<int64_t>((now_us-feedback_time_us)/SERVO_AGE_UNIT_US,SERVO_AGE_MAX);
+    }
+}
+
+void SERVO::setPeriodAsync(u8 period_ms)
+{
+    _period_ms = std::min(period_ms,(u8)20);
+}
+
+u8 SERVO::getPeriodAsync() const
+{
+    return _period_ms;
+}
+
+void SERVO::setRefreshPeriodAsync(u16 period_ms)
+{
+    _refresh_period_ms = std::min(period_ms,(u16)1000);
+}
+
+u16 SERVO::getRefreshPeriodAsync() const
+{
+    return _refresh_period_ms;
+}
+
+void SERVO::setFeedbackMaskAsync(u16 mask)
+{
+    mask &= 0x0FFF;
+    if(mask) _feedback_mask = mask;
+}
+
+u16 SERVO::getFeedbackMaskAsync() const
+{
+    return _feedback_mask;
+}
+
+int SERVO::readRegistersAsync(u8 const IDs[], size_t count, u8 address, u8 length, u8 data[], u8 status[])
+{
+    // check request size
+    if(count==0 || count>REGISTER_ACCESS_MAX_SERVOS || length==0 || count*length>REGISTER_ACCESS_MAX_DATA) return SERVO_STATUS_FAIL;
+
+    REGISTER_ACCESS access;
+    access.write = false;
+    access.count = count;
+    access.address = address;
+    access.length = length;
+    memcpy(access.IDs,IDs,count);
+    if(run_register_access(access)!=SERVO_STATUS_OK) return SERVO_STATUS_FAIL;
+    memcpy(data,access.data,count*length);
+    memcpy(status,access.status,count);
+    return SERVO_STATUS_OK;
+}
+
+int SERVO::writeRegistersAsync(u8 const IDs[], size_t count, u8 address, u8 length, u8 const data[], u8 status[])
+{
+    // check request size
+    if(count==0 || count>REGISTER_ACCESS_MAX_SERVOS || length==0 || count*length>REGISTER_ACCESS_MAX_DATA) return SERVO_STATUS_FAIL;
+
+    REGISTER_ACCESS access;
+    access.write = true;
+    access.count = count;
+    access.address = address;
+    access.length = length;
+    memcpy(access.IDs,IDs,count);
+    memcpy(access.data,data,count*length);
+    if(run_register_access(access)!=SERVO_STATUS_OK) return SERVO_STATUS_FAIL;
+    memcpy(status,access.status,count);
+    return SERVO_STATUS_OK;
+}
+
+int SERVO::run_register_access(REGISTER_ACCESS & access)
+{
+    // abort if servo not powered on
+    if(!_is_power_enabled) return SERVO_STATUS_FAIL;
+
+    // async service suspended : the bus is free
+    if(!_is_service_enabled)
+    {
+        process_register_access(access);
+        return SERVO_STATUS_OK;
+    }
+
+    // post the request to the async service, between two bus cycles
+    xSemaphoreTake(_register_access_mutex,portMAX_DELAY);
+    xSemaphoreTake(_register_access_done,0); // completion of a previous request that timed out
+    _register_access = access;
+    xSemaphoreGive(_register_access_request);
+    xSemaphoreGive(_register_access_mutex);
+
+    // wait for completion : one bus cycle, plus a 2 ms reply time-out per missing servo
+    TickType_t const timeout {(TickType_t)((_period_ms+2*REGISTER_ACCESS_MAX_SERVOS+10) / portTICK_PERIOD_MS)};
+    if(xSemaphoreTake(_register_access_done,timeout)!=pdTRUE) return SERVO_STATUS_FAIL;
+    xSemaphoreTake(_register_access_mutex,portMAX_DELAY);
+    access = _register_access;
+    xSemaphoreGive(_register_access_mutex);
+    return SERVO_STATUS_OK;
+}
+
+void SERVO::process_register_access(REGISTER_ACCESS & access)
+{
+    for(size_t index=0; index<access.count; ++index)
+    {
+        u8 * data {access.data+index*access.length};
+        access.status[index] = access.write ? write_registers(access.IDs[index],access.address,data,access.length)
+                                            : read_registers(access.IDs[index],access.address,data,access.length);
+    }
+}
+
 u16  SERVO::getPositionAsync(u8 servoID)
 {
     // (re)start sync service
@@ -704,7 +898,9 @@ void SERVO::enable_service(bool enable)
     // (re)start sync service
     if(enable)
     {
-        // (re)start sync task and wait a moment to synchronise local feedback data base
+        // (re)start sync task and wait a moment to synchronise local feedback data base ; the setpoints
+        // may have been changed by the sync API meanwhile, write them all
+        mark_setpoints_dirty();
         _is_service_enabled = true; 
         vTaskDelay(20 / portTICK_PERIOD_MS);   
     }
@@ -719,84 +915,103 @@ void SERVO::enable_service(bool enable)
     uart_flush(uart_port_num);    
 }
 
-void SERVO::sync_all_goal_position()
+void SERVO::sync_write_setpoints()
 {
-    static size_t const buffer_size {64};               // Buffer size
-    static u8 buffer[buffer_size] {0xFF,0xFF,0xFE};     // Fixed header (boradcast)
     /*
-     * First sync write frame : torque switch disable
+     * Setpoints to write : the ones changed since the previous cycle, and all the written ones every
+     * refresh period (a lost frame is healed).
      *
      *  A servo receiving a goal position automatically switches to torque enable.
-     *  So we send only torque disable to servo to be disabled.
+     *  So we send only torque disable to servo to be disabled, and the goal position with torque enable.
      *
      */
+    int64_t const now_us {esp_timer_get_time()};
+    bool const refresh {now_us-_refresh_time_us>=(int64_t)_refresh_period_ms*1000};
+    if(refresh) _refresh_time_us = now_us;
+    u16 torque_disable_mask {0};
+    u16 position_mask {0};
+    u16 speed_mask {0};
+    u16 torques[12] {0};
+    u16 positions[12] {0};
+    u16 speeds[12] {0};
+    size_t torque_disable_count {0};
+    for(size_t index=0; index<12; ++index)
     {
-        // prepare sync write frame to servo
-        static size_t const L {1};  // Length of data sent to each servo : torque switch register is one-byte
-        // prepare pyaload : instruction and parameters
-        buffer[4] = INST_SYNC_WRITE;        // Instruction
-        buffer[5] = SERVO_TORQUE_ENABLE;    // Parameter 1 : Register address
-        buffer[6] = L;                      // Parameter 2 : L
-        // build frame payload
-        size_t index {7};
-        size_t n {0}; // effective servo count
-        for(auto & servo : state)
+        SERVO_STATE & servoState {state[index]};
+        u8 dirty {__atomic_exchange_n(&servoState.dirty,(u8)0,__ATOMIC_ACQUIRE)};
+        if(refresh) dirty |= servoState.written;
+        if(servoState.torque_enable==0)
         {
-            if(servo.torque_enable==0)
+            ++torque_disable_count;
+            if(dirty&SETPOINT_TORQUE)
             {
-                ++n;
-                buffer[index++] = servo.ID;                    // Parameter 3 = Servo Number
-                buffer[index++] = servo.torque_enable;         // Write the data
+                torque_disable_mask |= 1<<index;
+                servoState.written |= SETPOINT_TORQUE;
             }
         }
-        // compute payload length
-        buffer[3] = (L+1)*n+4;
-        // compute checksum
-        u8 chk_sum {0};
-        for(size_t chk_index=2; chk_index<index; ++chk_index) {
-            chk_sum += buffer[chk_index];
-        }
-        buffer[index++] = ~chk_sum;
-        // send frame to all servo    
-        uart_write_bytes(uart_port_num,buffer,index);
-    }
-    /*
-     * Second sync write frame : goal position
-     *
-     */
-    {
-        // prepare sync write frame to servo
-        static size_t const L {2};  // Length of data sent to each servo : goal position register is one-word
-        // prepare pyaload : instruction and parameters
-        buffer[4] = INST_SYNC_WRITE;        // Instruction
-        buffer[5] = SERVO_GOAL_POSITION_L;  // Parameter 1 : Register address
-        buffer[6] = L;                      // Parameter 2 : L
-        // build frame payload
-        size_t index {7};
-        size_t n {0}; // effective servo count
-        for(auto & servo : state)
+        else if(dirty&(SETPOINT_TORQUE|SETPOINT_POSITION))
         {
-            if(servo.torque_enable==1)
-            {
-                ++n;
-                buffer[index++] = servo.ID;                    // Parameter 3 = Servo Number
-                // apply calibration
-                u16 const raw_position {calibrated_to_raw_position(servo.goal_position,servo.calibration_offset)};
-                buffer[index++] = (raw_position>>8);    
-                buffer[index++] = (raw_position&0xff);                
-            }
+            position_mask |= 1<<index;
+            // apply calibration
+            positions[index] = calibrated_to_raw_position(servoState.goal_position,servoState.calibration_offset);
+            servoState.written |= SETPOINT_TORQUE|SETPOINT_POSITION;
         }
-        // compute payload length
-        buffer[3] = (L+1)*n+4;
-        // compute checksum
-        u8 chk_sum {0};
-        for(size_t chk_index=2; chk_index<index; ++chk_index) {
-            chk_sum += buffer[chk_index];
+        if(dirty&SETPOINT_SPEED)
+        {
+            speed_mask |= 1<<index;
+            speeds[index] = servoState.goal_speed;
+            servoState.written |= SETPOINT_SPEED;
         }
-        buffer[index++] = ~chk_sum;
-        // send frame to all servo    
-        uart_write_bytes(uart_port_num,buffer,index);
     }
+
+    // sync write frames
+    size_t const tx_bytes {_cycle_tx_bytes};
+    sync_write(SERVO_TORQUE_ENABLE,1,torque_disable_mask,torques);
+    sync_write(SERVO_GOAL_POSITION_L,2,position_mask,positions);
+    sync_write(SERVO_GOAL_SPEED_L,2,speed_mask,speeds);
+
+    // stats : against the torque and goal position frames of all the servos
+    size_t const all_setpoints_bytes {(8+2*torque_disable_count)+(8+3*(12-torque_disable_count))};
+    size_t const sent_bytes {_cycle_tx_bytes-tx_bytes};
+    _cycle_tx_saved_bytes += all_setpoints_bytes>sent_bytes ? all_setpoints_bytes-sent_bytes : 0;
+}
+
+// one register (1 byte, or 2 bytes sent high byte first) of the servos in the mask ; no frame if the mask is empty
+void SERVO::sync_write(u8 address, u8 length, u16 mask, u16 const values[])
+{
+    if(mask==0) return;
+    static size_t const buffer_size {4+3+12*3+1};       // Buffer size
+    u8 buffer[buffer_size] {
+        0xFF,                                           // Start of Frame
+        0xFF,                                           // Start of Frame
+        0xFE,                                           // ID (broadcast)
+        0x00,                                           // Length
+        INST_SYNC_WRITE,                                // Instruction
+        address,                                        // Parameter 1 : Register address
+        length                                          // Parameter 2 : L
+    };
+    // build frame payload
+    size_t index {7};
+    size_t n {0}; // effective servo count
+    for(auto const & servoState : state)
+    {
+        if(!(mask&(1<<(servoState.ID-1)))) continue;
+        ++n;
+        u16 const value {values[servoState.ID-1]};
+        buffer[index++] = servoState.ID;                // Parameter 3 = Servo Number
+        if(length==2) buffer[index++] = (value>>8);     // Write the data
+        buffer[index++] = (value&0xff);
+    }
+    // compute payload length
+    buffer[3] = (length+1)*n+4;
+    // compute checksum
+    u8 chk_sum {0};
+    for(size_t chk_index=2; chk_index<index; ++chk_index) {
+        chk_sum += buffer[chk_index];
+    }
+    buffer[index++] = ~chk_sum;
+    // send frame to all servo    
+    send_frame(buffer,index);
 }
 
 void SERVO::cmd_feedback_one_servo(SERVO_STATE & servoState)
@@ -820,9 +1035,7 @@ void SERVO::cmd_feedback_one_servo(SERVO_STATE & servoState)
     }
     buffer[buffer_size-1] = ~chk_sum;
     // send frame to servo
-    uart_write_bytes(uart_port_num,buffer,buffer_size);
-    // flush RX FIFO
-    uart_flush(uart_port_num);
+    send_frame(buffer,buffer_size,12,1);
 }
 
 void SERVO::ack_feedback_one_servo(SERVO_STATE & servoState)
@@ -830,8 +1043,8 @@ void SERVO::ack_feedback_one_servo(SERVO_STATE & servoState)
     // a buffer to process read ack from one servo
     static size_t const buffer_size {12};     
     u8 buffer[buffer_size] {0};
-    // copy RX fifo into local buffer
-    int const read_length = uart_read_bytes(uart_port_num,buffer,buffer_size,1);
+    // wait for the reply
+    size_t const read_length {receive_reply(buffer,buffer_size)};
     // check expected frame size
     if(read_length==buffer_size)
     {
@@ -852,21 +1065,8 @@ void SERVO::ack_feedback_one_servo(SERVO_STATE & servoState)
             if(buffer[buffer_size-1]==(u8)(~chk_sum))
             {
                 // decode parameters and update feedback local data base for this servo
-                u16 const raw_position = (u16)(buffer[5])<<8 | buffer[6];
-                u16 const speed  = (u16)(buffer[7])<<8 | buffer[8];
-                u16 const load   = (u16)(buffer[9])<<8 | buffer[10];
-
-                // apply calibration
-                servoState.present_position = raw_to_calibrated_position(raw_position,servoState.calibration_offset);
-
-                // .. to signed values
-                servoState.present_speed = (s16)speed;
-                if(servoState.present_speed&(1<<15))
-                    servoState.present_speed = -(servoState.present_speed&~(1<<15));
-
-                servoState.present_load =  (s16)load;
-                if(servoState.present_load&(1<<10))
-                    servoState.present_load = -(servoState.present_load&~(1<<10));
+                decode_feedback(servoState,buffer+5);
+                ++_cycle_feedbacks;
 
                 // stats
                 f_monitor.update(); // OK
@@ -888,40 +1088,292 @@ void SERVO::ack_feedback_one_servo(SERVO_STATE & servoState)
         // stats
         f_monitor.update(mini_pupper::frame_error_rate_monitor::TRUNCATED_ERROR);
     }
-    else if(read_length==0)
+    else
     {
         // stats
         f_monitor.update(mini_pupper::frame_error_rate_monitor::TIME_OUT_ERROR);
     }    
-    // flush RX FIFO
-    uart_flush(uart_port_num); 
+}
+
+// position, speed and load registers (6 bytes) of a read reply
+void SERVO::decode_feedback(SERVO_STATE & servoState, u8 const * data)
+{
+    u16 const raw_position = (u16)(data[0])<<8 | data[1];
+    u16 const speed  = (u16)(data[2])<<8 | data[3];
+    u16 const load   = (u16)(data[4])<<8 | data[5];
+
+    // apply calibration
+    servoState.present_position = raw_to_calibrated_position(raw_position,servoState.calibration_offset);
+
+    // .. to signed values
+    servoState.present_speed = (s16)speed;
+    if(servoState.present_speed&(1<<15))
+        servoState.present_speed = -(servoState.present_speed&~(1<<15));
+
+    s16 const previous_load {servoState.present_load};
+    servoState.present_load =  (s16)load;
+    if(servoState.present_load&(1<<10))
+        servoState.present_load = -(servoState.present_load&~(1<<10));
+    servoState.load_change = (u16)abs(servoState.present_load-previous_load);
+
+    __atomic_store_n(&servoState.feedback_time_us,esp_timer_get_time(),__ATOMIC_RELAXED);
+}
+
+void SERVO::cmd_feedback_sync_read()
+{
+    // prepare sync read frame to all the polled servos
+    static size_t const buffer_size {4+1+2+12+1};
+    u8 buffer[buffer_size] {
+        0xFF,                                       // Start of Frame
+        0xFF,                                       // Start of Frame
+        0xFE,                                       // ID (broadcast)
+        0x00,                                       // Length
+        INST_SYNC_READ,                             // Sync read instruction
+        SERVO_PRESENT_POSITION_L,                   // Parameter 1 : Register address
+        0x06                                        // Parameter 2 : 6 bytes (position, speed, load)
+    };
+    _sync_read_mask = _feedback_mask;
+    size_t index {7};
+    for(auto const & servo : state)
+    {
+        if(_sync_read_mask&(1<<(servo.ID-1))) buffer[index++] = servo.ID;   // Parameter 3.. : Servo Numbers
+    }
+    buffer[3] = index-4+1;
+    // compute checksum
+    u8 chk_sum {0};
+    for(size_t chk_index=2; chk_index<index; ++chk_index) {
+        chk_sum += buffer[chk_index];
+    }
+    buffer[index++] = ~chk_sum;
+    // send frame to servos, they reply in turn
+    size_t const count {(size_t)__builtin_popcount(_sync_read_mask)};
+    send_frame(buffer,index,count*12,count);
+}
+
+// The servos reply in turn, as for a read instruction : frames are matched by ID, so that a
+// missing reply does not shift the next ones. Each polled servo counts as one frame in f_monitor.
+void SERVO::ack_feedback_sync_read()
+{
+    static size_t const reply_size {12};
+    u16 const mask {_sync_read_mask};
+    _sync_read_mask = 0;
+    if(mask==0) return;
+    size_t const count {(size_t)__builtin_popcount(mask)};
+
+    // wait for all the replies
+    u8 buffer[12*reply_size] {0};
+    size_t const length {receive_reply(buffer,count*reply_size)};
+
+    // servos whose reply is decoded or counted as an error
+    u16 accounted {0};
+    size_t decoded {0};
+    size_t index {0};
+    while(index+4<=length)
+    {
+        // resynchronise on a reply header : 0xFF 0xFF ID 0x08, from a polled servo
+        u8 const ID {buffer[index+2]};
+        if(buffer[index]!=0xFF || buffer[index+1]!=0xFF || buffer[index+3]!=0x08 || ID<1 || ID>12
+            || !(mask&(1<<(ID-1))) || (accounted&(1<<(ID-1))))
+        {
+            ++index;
+            continue;
+        }
+        accounted |= 1<<(ID-1);
+        if(index+reply_size>length)
+        {
+            // stats
+            f_monitor.update(mini_pupper::frame_error_rate_monitor::TRUNCATED_ERROR);
+            break;
+        }
+        u8 chk_sum {0};
+        for(size_t chk_index=index+2; chk_index<index+reply_size-1; ++chk_index) {
+            chk_sum += buffer[chk_index];
+        }
+        if(buffer[index+reply_size-1]!=(u8)(~chk_sum))
+        {
+            // stats
+            f_monitor.update(mini_pupper::frame_error_rate_monitor::CHECKSUM_ERROR);
+        }
+        else if(buffer[index+4]!=0x00)
+        {
+            // stats : working condition
+            f_monitor.update(mini_pupper::frame_error_rate_monitor::SYNTAX_ERROR);
+        }
+        else
+        {
+            decode_feedback(state[ID-1],buffer+index+5);
+            ++decoded;
+            // stats
+            f_monitor.update(); // OK
+        }
+        index += reply_size;
+    }
+    // stats : no reply
+    for(size_t servoID=0; servoID<12; ++servoID)
+    {
+        if((mask&(1<<servoID)) && !(accounted&(1<<servoID)))
+        {
+            f_monitor.update(mini_pupper::frame_error_rate_monitor::TIME_OUT_ERROR);
+        }
+    }
+    _cycle_feedbacks += decoded;
+
+    // servos without sync read : read one servo per cycle
+    _sync_read_failures = decoded ? 0 : _sync_read_failures+1;
+    if(_sync_read_failures>=SYNC_READ_MAX_FAILURES)
+    {
+        _use_sync_read = false;
+        ESP_LOGW(TAG, "No reply to sync read, feedback read one servo per cycle");
+    }
+}
+
+size_t SERVO::next_feedback_servo() const
+{
+    int64_t const now_us {esp_timer_get_time()};
+    size_t next {0};
+    float next_priority {-1.0f};
+    int64_t oldest_age_us {-1};
+    for(size_t index=0; index<12; ++index)
+    {
+        if(!(_feedback_mask&(1<<index))) continue;
+        SERVO_STATE const & servoState {state[index]};
+        int64_t const age_us {now_us-servoState.feedback_time_us};
+        // fairness floor : the oldest servo beyond the maximum age first
+        if(age_us>=FEEDBACK_MAX_AGE_US || oldest_age_us>=FEEDBACK_MAX_AGE_US)
+        {
+            if(age_us>oldest_age_us)
+            {
+                oldest_age_us = age_us;
+                next = index;
+            }
+            continue;
+        }
+        // priority : age weighted by the tracking error (torque enabled) and the load change
+        float weight {1.0f};
+        if(servoState.torque_enable)
+            weight += FEEDBACK_POSITION_ERROR_WEIGHT*(float)abs((int)servoState.goal_position-(int)servoState.present_position);
+        weight += FEEDBACK_LOAD_CHANGE_WEIGHT*(float)servoState.load_change;
+        float const priority {(float)age_us*weight};
+        if(priority>next_priority)
+        {
+            next_priority = priority;
+            next = index;
+        }
+    }
+    return next;
+}
+
+void SERVO::send_frame(u8 const * buffer, size_t length, size_t reply_length, size_t reply_count)
+{
+    // drop the bytes left by a previous transaction (its UART events only wake the next reply wait up)
+    uart_flush_input(uart_port_num);
+    // send frame, and wait for the end of transmission (TX done interrupt)
+    uart_write_bytes(uart_port_num,buffer,length);
+    uart_wait_tx_done(uart_port_num,(TickType_t)((length*_byte_time_us/1000+2) / portTICK_PERIOD_MS));
+    _cycle_tx_bytes += length;
+    // arm reply time-out : reply bytes time, plus a turnaround per reply
+    if(reply_length>0)
+    {
+        esp_timer_stop(_reply_timer);
+        int64_t const time_out_us {(int64_t)reply_length*_byte_time_us+(int64_t)(reply_count+1)*REPLY_TURNAROUND_US};
+        _reply_deadline_us = esp_timer_get_time()+time_out_us;
+        __atomic_store_n(&_armed_transaction,++_transaction,__ATOMIC_RELEASE);
+        esp_timer_start_once(_reply_timer,time_out_us);
+    }
+}
+
+size_t SERVO::receive_reply(u8 * buffer, size_t length)
+{
+    size_t read_length {0};
+    bool timed_out {false};
+    for(;;)
+    {
+        // copy RX fifo into local buffer
+        size_t buffered_length {0};
+        uart_get_buffered_data_len(uart_port_num,&buffered_length);
+        if(buffered_length>0)
+        {
+            int const received_length {uart_read_bytes(uart_port_num,buffer+read_length,std::min(buffered_length,length-read_length),0)};
+            if(received_length>0) read_length += received_length;
+        }
+        if(read_length==length || timed_out) break;
+        // wait for more bytes, or the reply time-out (the wait itself times out after 10 ms)
+        QueueSetMemberHandle_t const member {xQueueSelectFromSet(_reply_events,10 / portTICK_PERIOD_MS)};
+        if(member==_uart_queue)
+        {
+            uart_event_t event;
+            xQueueReceive(_uart_queue,&event,0);
+        }
+        else if(member==_reply_time_out)
+        {
+            xSemaphoreTake(_reply_time_out,0);
+            // esp_timer_stop does not wait for a running callback : a time-out of a previous transaction is
+            // ignored, by its tag, or by the deadline when the late callback read the current tag
+            timed_out = __atomic_load_n(&_timed_out_transaction,__ATOMIC_ACQUIRE)==_transaction && esp_timer_get_time()>=_reply_deadline_us;
+        }
+        else
+            timed_out = true;
+    }
+    esp_timer_stop(_reply_timer);
+    _cycle_rx_bytes += read_length;
+    return read_length;
 }
 
 void SERVO_TASK(void * parameters)
 {
     SERVO * servo = reinterpret_cast<SERVO*>(parameters);
-    u8 servoID {0};
+    size_t servoID {0};
     for(;;)
     {
+        int64_t const cycle_start_us {esp_timer_get_time()};
         if(servo->_is_power_enabled && servo->_is_service_enabled)
         {
-            // process read ack from one servo
-            servo->ack_feedback_one_servo(servo->state[servoID]);
-            // sync write setpoint to all servo
-            servo->sync_all_goal_position();
-            // basic round robin algorithm for feedback
-            servoID = (servoID+1)%12;
-            // read one servo feedback
-            servo->cmd_feedback_one_servo(servo->state[servoID]);
+            servo->_cycle_tx_bytes = 0;
+            servo->_cycle_rx_bytes = 0;
+            servo->_cycle_tx_saved_bytes = 0;
+            servo->_cycle_feedbacks = 0;
+            // sync write the setpoints
+            servo->sync_write_setpoints();
+            if(servo->_use_sync_read)
+            {
+                // read all the polled servos feedback
+                servo->cmd_feedback_sync_read();
+                servo->ack_feedback_sync_read();
+            }
+            else
+            {
+                // the polled servo with the highest feedback priority
+                servoID = servo->next_feedback_servo();
+                // read one servo feedback
+                servo->cmd_feedback_one_servo(servo->state[servoID]);
+                servo->ack_feedback_one_servo(servo->state[servoID]);
+            }
+            // register access requested by the host, while the bus is idle
+            if(xSemaphoreTake(servo->_register_access_request,0)==pdTRUE)
+            {
+                xSemaphoreTake(servo->_register_access_mutex,portMAX_DELAY);
+                servo->process_register_access(servo->_register_access);
+                xSemaphoreGive(servo->_register_access_done);
+                xSemaphoreGive(servo->_register_access_mutex);
+            }
 
             // stats
             servo->p_monitor.update();
+            servo->b_monitor.update(servo->_cycle_tx_bytes,servo->_cycle_rx_bytes,servo->_cycle_feedbacks,servo->_byte_time_us,servo->_cycle_tx_saved_bytes);
 
         }
-        // delay 1ms
-        // - about 1KHz refresh frequency for sync write servo setpoints
-        // - about 80Hz refresh frequency for read/ack servo feedbacks
-        vTaskDelay(2 / portTICK_PERIOD_MS);
+        // the bus cycles run back to back by default, or last the period at least (runtime configuration) :
+        // whole ticks are slept (each delay ends at the next tick, before the end of the cycle), the rest of
+        // the period is yielded. The idle service sleeps one tick.
+        if(servo->_is_power_enabled && servo->_is_service_enabled)
+        {
+            int64_t const cycle_end_us {cycle_start_us+(int64_t)servo->_period_ms*1000};
+            int64_t const tick_us {(int64_t)portTICK_PERIOD_MS*1000};
+            while(cycle_end_us-esp_timer_get_time()>tick_us) vTaskDelay(1);
+            do taskYIELD(); while(esp_timer_get_time()<cycle_end_us);
+        }
+        else
+            vTaskDelay(1);
 
     }
 }
@@ -1085,6 +1537,43 @@ int SERVO::read_register_word(u8 id, u8 reg, u16 & value)
     return SERVO_STATUS_OK;
 }
 
+int SERVO::write_registers(u8 id, u8 reg, u8 const * data, u8 length)
+{
+    // send write instruction
+    u8 buffer[1+REGISTER_ACCESS_MAX_DATA] {reg};
+    memcpy(buffer+1,data,length);
+    write_frame(id,INST_WRITE,buffer,1+length);
+
+    // if broadcast, do not wait for reply
+    if(id==0XFE) return SERVO_STATUS_OK;
+
+    // wait for reply
+    return check_reply_frame_no_parameter(id);
+}
+
+int SERVO::read_registers(u8 id, u8 reg, u8 * data, u8 length)
+{
+    // abort command when broadcasting
+    if(id==0XFE) return SERVO_STATUS_FAIL;
+
+    // send read instruction
+    u8 const buffer[2] {reg,length};
+    write_frame(id,INST_READ,buffer,2);
+
+    // wait for reply
+    u8 reply_id {0};
+    u8 reply_state {0};
+    int const status = reply_frame(reply_id,reply_state,data,length);
+
+    // check reply
+    if(status!=SERVO_STATUS_OK) return SERVO_STATUS_FAIL;
+
+    // check reply
+    if(reply_id!=id || reply_state!=0) return SERVO_STATUS_FAIL;
+
+    return SERVO_STATUS_OK;
+}
+
 int SERVO::check_reply_frame_no_parameter(u8 & ID)
 {
     // wait for reply
@@ -1102,16 +1591,180 @@ int SERVO::check_reply_frame_no_parameter(u8 & ID)
     return SERVO_STATUS_OK;    
 }
 
+// servo baud rate register values, fastest first
+static struct
+{
+    int baud_rate;
+    u8 value;
+} const baud_rates[] {
+    {1000000,_1M},
+    {500000,_0_5M},
+    {250000,_250K},
+    {128000,_128K},
+    {115200,_115200},
+    {76800,_76800},
+    {57600,_57600},
+    {38400,_38400},
+    {19200,_19200},
+    {14400,_14400},
+    {9600,_9600},
+    {4800,_4800}
+};
+
+static int baud_rate_value(int baud_rate)
+{
+    for(auto const & rate : baud_rates)
+        if(rate.baud_rate==baud_rate) return rate.value;
+    return -1;
+}
+
+int SERVO::get_baud_rate() const
+{
+    return _baud_rate;
+}
+
+int SERVO::set_uart_baud_rate(int baud_rate)
+{
+    if(baud_rate_value(baud_rate)<0) return SERVO_STATUS_FAIL;
+
+    // suspend sync service
+    enable_service(false);
+
+    if(uart_set_baudrate(uart_port_num,baud_rate)!=ESP_OK) return SERVO_STATUS_FAIL;
+    _baud_rate = baud_rate;
+    _byte_time_us = 10*1000000/baud_rate;
+    // flush RX FIFO
+    uart_flush(uart_port_num);
+    return SERVO_STATUS_OK;
+}
+
+u16 SERVO::ping_all()
+{
+    // suspend sync service
+    enable_service(false);
+
+    u16 mask {0};
+    for(auto const & servoState : state)
+    {
+        write_frame(servoState.ID,INST_PING,nullptr,0);
+        u8 ID {servoState.ID};
+        if(check_reply_frame_no_parameter(ID)==SERVO_STATUS_OK) mask |= 1<<(servoState.ID-1);
+    }
+    return mask;
+}
+
+int SERVO::probe_baud_rate()
+{
+    // abort if servo not powered on
+    if(!_is_power_enabled) return 0;
+
+    // current rate first, then from the fastest
+    int const current_baud_rate {_baud_rate};
+    int best_baud_rate {0};
+    int best_count {0};
+    for(int index=-1; index<(int)(sizeof(baud_rates)/sizeof(baud_rates[0])); ++index)
+    {
+        int const baud_rate {index<0 ? current_baud_rate : baud_rates[index].baud_rate};
+        if(index>=0 && baud_rate==current_baud_rate) continue;
+        set_uart_baud_rate(baud_rate);
+        int const count {__builtin_popcount(ping_all())};
+        if(count>best_count)
+        {
+            best_count = count;
+            best_baud_rate = baud_rate;
+        }
+        if(count==12) break;
+    }
+    set_uart_baud_rate(best_count ? best_baud_rate : current_baud_rate);
+    ESP_LOGI(TAG, "Servo bus baud rate : %d (%d servos)",best_baud_rate,best_count);
+    return best_baud_rate;
+}
+
+int SERVO::check_baud_rate()
+{
+    // abort if servo not powered on
+    if(!_is_power_enabled) return 0;
+
+    if(ping_all()) return _baud_rate;
+    ESP_LOGW(TAG, "No servo reply at %d, probing the servo bus baud rate",_baud_rate);
+    int const baud_rate {probe_baud_rate()};
+    if(baud_rate) return baud_rate;
+    set_uart_baud_rate(DEFAULT_BAUD_RATE);
+    ESP_LOGE(TAG, "No servo reply, back to %d",DEFAULT_BAUD_RATE);
+    return 0;
+}
+
+int SERVO::write_baud_rate_register(u8 ID, u8 value)
+{
+    unlock_eeprom(ID);
+
+    // change baud rate register : the servo may reply at the previous or the new rate, not checked
+    write_register_byte(ID, SERVO_BAUD_RATE, value);
+    u8 reply_id {0};
+    u8 reply_state {0};
+    reply_frame(reply_id,reply_state,nullptr,0,10);
+
+    return SERVO_STATUS_OK;
+}
+
+int SERVO::set_baud_rate(int baud_rate)
+{
+    // abort if servo not powered on
+    if(!_is_power_enabled) return SERVO_STATUS_FAIL;
+
+    int const value {baud_rate_value(baud_rate)};
+    if(value<0) return SERVO_STATUS_FAIL;
+
+    // probe the current rate : all the servos shall reply
+    int const previous_baud_rate {probe_baud_rate()};
+    if(previous_baud_rate==0 || ping_all()!=0x0FFF)
+    {
+        ESP_LOGE(TAG, "Baud rate migration aborted : not all the servos reply");
+        return SERVO_STATUS_FAIL;
+    }
+    if(previous_baud_rate==baud_rate) return SERVO_STATUS_OK;
+
+    // write the new rate to the servos EEPROM, they switch at once
+    for(auto const & servoState : state)
+        write_baud_rate_register(servoState.ID,value);
+
+    // switch the UART and verify
+    set_uart_baud_rate(baud_rate);
+    vTaskDelay(10 / portTICK_PERIOD_MS);
+    u16 const migrated {ping_all()};
+    if(migrated==0x0FFF)
+    {
+        for(auto const & servoState : state)
+            lock_eeprom(servoState.ID);
+        ESP_LOGI(TAG, "Servo bus baud rate : %d -> %d",previous_baud_rate,baud_rate);
+        return SERVO_STATUS_OK;
+    }
+
+    // fall back : the migrated servos back to the previous rate
+    int const previous_value {baud_rate_value(previous_baud_rate)};
+    for(auto const & servoState : state)
+        if(migrated&(1<<(servoState.ID-1))) write_baud_rate_register(servoState.ID,previous_value);
+    set_uart_baud_rate(previous_baud_rate);
+    vTaskDelay(10 / portTICK_PERIOD_MS);
+    for(auto const & servoState : state)
+        lock_eeprom(servoState.ID);
+    ESP_LOGE(TAG, "Baud rate migration failed (servos:0x%03X), back to %d (servos:0x%03X)",
+        migrated,previous_baud_rate,ping_all());
+    return SERVO_STATUS_FAIL;
+}
+
 void SERVO::setCalibration(s16 const offset[])
 {
     for(size_t index=0;index<12;++index)
         state[index].calibration_offset = offset[index];
+    mark_setpoints_dirty();
 }
 
 void SERVO::resetCalibration()
 {
     for(size_t index=0;index<12;++index)
         state[index].calibration_offset = 0;
+    mark_setpoints_dirty();
 }
 
 u16 SERVO::raw_to_calibrated_position(u16 raw_position, s16 calibration_offset) const
@@ -22,6 +22,16 @@
  *    y. CLI > servo-scan (shall reply: "Servos on the bus:1 2 3 4 5 6 7 8 9 10 11 12")
  *    z. CLI > servo-disable
  *
+ *  Ia. Change the servo bus baud rate (optional) :
+ *  ------------------------------------------------
+ *    a. CLI > servo-enable
+ *    b. CLI > servo-setBaudRate --baud 1000000 (all the 12 servos shall reply, back to the previous rate on failure)
+ *    c. CLI > servo-disable
+ *   The rate is saved in flash and used at start-up, checked with pings at the first servo power-up : if no servo
+ *   replies, the rate is probed and saved again, or the UART goes back to the default rate. To probe by hand :
+ *    CLI > servo-enable, then CLI > servo-probeBaudRate
+ *   At 1Mbps, a bus cycle with 12 servos takes about 2.2ms : about 450Hz setpoint and feedback frequency.
+ *
  *
  *  II. Control one servo at once (test) :
  *  --------------------------------------
@@ -60,10 +70,23 @@
  *    CLI > servo-disable
  *
  *   Note about performance of Async service :
- *   - position setpoints are update using "sync write" instruction, every 2 ms. 
- *       ==> 500Hz setpoint frequency.
- *   - feedback is update using "read" instruction (one servo at a time), every 2 ms. Updating 12 servo takes about 24ms. 
- *       ==> 40Hz feedback frequency
+ *   - the bus transactions run back to back : a frame is sent as soon as the previous reply is complete,
+ *     or timed out (reply bytes time plus 100us turnaround per servo). UART RX events and TX done wake
+ *     the task up, an esp_timer one-shot times the reply out. A period (0 by default) sets a minimum bus cycle.
+ *   - position setpoints are update using "sync write" instruction, every bus cycle : only the setpoints
+ *     (torque switch, goal position, goal speed) changed since the previous cycle are written, and all of them
+ *     every 100ms (runtime configuration) so that a lost frame is healed. An idle robot leaves the bus time
+ *     to the feedback reads.
+ *   - feedback is update using "sync read" instruction : position, speed and load of all the polled servos
+ *     in one transaction, every bus cycle. A bus cycle carries about 210 bytes at 500kbps with 12 servos and
+ *     all the setpoints written (about 4.5ms), 165 bytes with no setpoint change (about 3.5ms).
+ *       ==> about 220Hz (walking) to 290Hz (idle) setpoint and feedback frequency, for every servo
+ *   - servos that do not reply to "sync read" (50 cycles in a row) are read using "read" instruction
+ *     instead (one servo per cycle), until the next power on. The bus cycle is then much shorter.
+ *       ==> about 500Hz setpoint frequency, 40Hz mean feedback frequency
+ *     The servo read is the one with the oldest feedback, weighted by its tracking error and load change :
+ *     loaded or moving joints are read more often than idle ones, each servo at 10Hz at least.
+ *   - bus utilisation and achieved rates are shown by the "top" CLI command.
  *   - R/W access to setpoints/feedback, through async API, is not bloking. Servo bus read/write access is handled by a dedicated RTOS task.
  *
  */
@@ -74,6 +97,9 @@
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <freertos/queue.h>
+#include <esp_timer.h>
 
 /* IMPORTANT : Mini Pupper Servo API requires to setup FreeRTOS frequency at 1000Hz.
  *             Use IDF ESP32 : MENUCONFIG > COMPONENTS > FREERTOS > KERNEL > 1000Hz
@@ -150,6 +176,13 @@
 #define SERVO_PRESENT_CURRENT_H 70
 
 
+// setpoint registers of the async service (SERVO_STATE dirty and written bits)
+enum {
+    SETPOINT_TORQUE = 1<<0,
+    SETPOINT_POSITION = 1<<1,
+    SETPOINT_SPEED = 1<<2,
+};
+
 struct SERVO_STATE
 {
     SERVO_STATE(u8 id) : ID(id) {}
@@ -164,6 +197,11 @@ struct SERVO_STATE
     u8 present_temperature  {0};
     u8 present_move         {0};
     s16 present_current     {0};
+    int64_t feedback_time_us {0};  // esp_timer time of the last feedback read, read by HOST_TASK on the other core : __atomic accesses only
+    u16 load_change         {0};   // |present load - previous present load|, feedback scheduler
+    // sync write of the setpoints
+    u8 dirty                {SETPOINT_TORQUE|SETPOINT_POSITION};   // changed since the last sync write
+    u8 written              {0};   // sync written once at least, written again every refresh period
     // calibration data
     s16 calibration_offset  {0}; // default offset
 };
@@ -174,6 +212,7 @@ enum {
 };
 
 void SERVO_TASK(void * parameters);
+void reply_timer_callback(void * parameters);
 
 struct SERVO
 {
@@ -219,6 +258,19 @@ struct SERVO
     void setCalibration(s16 const offset[]);
     void resetCalibration();
 
+    // servo bus baud rate (1000000, 500000, 250000, 128000, 115200... 4800)
+    // - probe_baud_rate : find the rate most servos reply at, and switch the UART to it ; return the rate, 0 if none
+    // - set_baud_rate : migrate all the 12 servos to a new rate (EEPROM), verified with pings ; back to the
+    //   previous rate on failure
+    // - set_uart_baud_rate : ESP32 UART only, e.g. the rate saved in flash at start-up
+    // - check_baud_rate : servos powered, ping at the current rate, probe on no reply, back to the default rate
+    //   if none found ; return the rate the servos reply at, 0 if none
+    int probe_baud_rate();
+    int set_baud_rate(int baud_rate);
+    int set_uart_baud_rate(int baud_rate);
+    int check_baud_rate();
+    int get_baud_rate() const;
+
     /* ASYNC API 
      *
      * A task synchronise a setpoint/feedback database and control the servo BUS trafic
@@ -236,6 +288,9 @@ struct SERVO
 
     void setPositionAsync(u8 servoID, u16 servoPosition);
     void setPosition12Async(u16 const servoPositions[]);    
+
+    void setGoalSpeedAsync(u8 servoID, u16 servoSpeed);   // not written to the servos until set
+    void setGoalSpeed12Async(u16 const servoSpeeds[]);
     
     u16  getPositionAsync(u8 servoID);
     s16  getSpeedAsync(u8 servoID);
@@ -251,9 +306,30 @@ struct SERVO
     void getSpeed12Async(s16 servoSpeeds[]);    
     void getLoad12Async(s16 servoLoads[]);    
 
+    int64_t getOldestFeedbackTimeAsync();  // esp_timer time of the oldest servo feedback among the polled servos
+    void getFeedbackAge12Async(u16 servoAges[]);      // age of each servo feedback (SERVO_AGE_UNIT_US, SERVO_AGE_NEVER_READ)
+
+    // runtime configuration of the async service
+    void setPeriodAsync(u8 period_ms);      // bus cycle period [0..20] ms, 0 : back to back
+    u8   getPeriodAsync() const;
+    void setFeedbackMaskAsync(u16 mask);    // servos polled for feedback (bit N-1 : servo ID N), not empty
+    u16  getFeedbackMaskAsync() const;
+    void setRefreshPeriodAsync(u16 period_ms);  // all the setpoints written again [0..1000] ms, 0 : every cycle
+    u16  getRefreshPeriodAsync() const;
+
+    // register access to several servos, run by the async service between two bus cycles
+    // - data holds count x length bytes, status receives a SERVO_STATUS_xxx per servo
+    // - return SERVO_STATUS_FAIL if servos are powered off, or the access did not complete in time
+    // - one caller at a time (host task)
+    static size_t const REGISTER_ACCESS_MAX_SERVOS {12};
+    static size_t const REGISTER_ACCESS_MAX_DATA {64};
+    int readRegistersAsync(u8 const IDs[], size_t count, u8 address, u8 length, u8 data[], u8 status[]);
+    int writeRegistersAsync(u8 const IDs[], size_t count, u8 address, u8 length, u8 const data[], u8 status[]);
+
     // public stats
     mini_pupper::periodic_process_monitor p_monitor;
     mini_pupper::frame_error_rate_monitor f_monitor;
+    mini_pupper::bus_load_monitor b_monitor;
 
 protected:
 
@@ -268,17 +344,85 @@ protected:
      */
 
     // internals
-    void sync_all_goal_position();
+    void sync_write_setpoints();
+    void sync_write(u8 address, u8 length, u16 mask, u16 const values[]);
+    template<typename T> void update_setpoint(SERVO_STATE & servoState, T & setpoint, T value, u8 setpoint_bit);
+    void mark_setpoints_dirty();
     void cmd_feedback_one_servo(SERVO_STATE & servoState);
     void ack_feedback_one_servo(SERVO_STATE & servoState);
+    void cmd_feedback_sync_read();
+    void ack_feedback_sync_read();
+    void decode_feedback(SERVO_STATE & servoState, u8 const * data);
+
+    // bus transactions : send a frame, then wait for the reply bytes (UART RX events) until complete or
+    // timed out (reply timer, armed once the frame is sent)
+    static int const DEFAULT_BAUD_RATE {500000};
+    static int64_t const REPLY_TURNAROUND_US {100};             // per reply, servo return delay included
+    int _baud_rate {DEFAULT_BAUD_RATE};
+    int64_t _byte_time_us {10*1000000/DEFAULT_BAUD_RATE};       // 8N1
+    void send_frame(u8 const * buffer, size_t length, size_t reply_length = 0, size_t reply_count = 0);
+    size_t receive_reply(u8 * buffer, size_t length);
+    static UBaseType_t const UART_QUEUE_LENGTH {20};
+    QueueHandle_t _uart_queue {NULL};
+    esp_timer_handle_t _reply_timer {NULL};
+    SemaphoreHandle_t _reply_time_out {NULL};
+    StaticSemaphore_t _reply_time_out_semaphore;
+    QueueSetHandle_t _reply_events {NULL};      // UART events and reply time-out
+    u32 _transaction {0};                       // reply transactions, tag of the reply time-out
+    u32 _armed_transaction {0};                 // written by the reply wait, read by the timer callback
+    u32 _timed_out_transaction {0};             // written by the timer callback
+    int64_t _reply_deadline_us {0};
+    size_t _cycle_tx_bytes {0};     // bytes sent and received during the bus cycle
+    size_t _cycle_rx_bytes {0};
+    size_t _cycle_tx_saved_bytes {0};   // sync write bytes saved during the bus cycle, against writing all the setpoints
+    size_t _cycle_feedbacks {0};    // servo feedbacks decoded during the bus cycle
+
+    // feedback scheduler (read of one servo per cycle) : the polled servo with the highest priority, its
+    // feedback age weighted by its tracking error and load change, or the oldest one beyond the fairness floor
+    static int64_t const FEEDBACK_MAX_AGE_US {100000};  // fairness floor : 10Hz
+    static constexpr float FEEDBACK_POSITION_ERROR_WEIGHT {1.0f/8.0f};  // per position step (about 0.3 deg)
+    static constexpr float FEEDBACK_LOAD_CHANGE_WEIGHT {1.0f/16.0f};    // per load step
+    size_t next_feedback_servo() const;
+
+    // feedback engine : sync read of all the polled servos every cycle, or read of one servo per cycle
+    static size_t const SYNC_READ_MAX_FAILURES {50};    // sync reads with no reply before reading one servo per cycle
+    bool _use_sync_read {true};
+    u16 _sync_read_mask {0};        // servos of the sync read in progress
+    size_t _sync_read_failures {0};
 
     // state of all servo
     SERVO_STATE state[12] {1,2,3,4,5,6,7,8,9,10,11,12}; // hard-coded ID list
 
+    // runtime configuration
+    u8 _period_ms {0};
+    u16 _feedback_mask {0x0FFF};
+    u16 _refresh_period_ms {100};
+    int64_t _refresh_time_us {0};   // last refresh of all the setpoints
+
+    // register access requested to the async service
+    struct REGISTER_ACCESS
+    {
+        bool write {false};
+        size_t count {0};
+        u8 address {0};
+        u8 length {0};
+        u8 IDs[REGISTER_ACCESS_MAX_SERVOS] {0};
+        u8 data[REGISTER_ACCESS_MAX_DATA] {0};
+        u8 status[REGISTER_ACCESS_MAX_SERVOS] {0};
+    };
+    REGISTER_ACCESS _register_access;
+    SemaphoreHandle_t _register_access_mutex {NULL};
+    SemaphoreHandle_t _register_access_request {NULL};
+    SemaphoreHandle_t _register_access_done {NULL};
+    StaticSemaphore_t _register_access_semaphores[3];
+    int run_register_access(REGISTER_ACCESS & access);
+    void process_register_access(REGISTER_ACCESS & access);
+
     // background servo bus service
     bool _is_service_enabled {false};
     TaskHandle_t _task_handle {NULL};
     friend void SERVO_TASK(void * parameters);
+    friend void reply_timer_callback(void * parameters);
 
     /* LOW LEVEL helpers
      *
@@ -294,8 +438,14 @@ protected:
     int read_register_byte(u8 id, u8 reg, u8 & value);
     int read_register_word(u8 id, u8 reg, u16 & value);
 
+    int write_registers(u8 id, u8 reg, u8 const * data, u8 length);
+    int read_registers(u8 id, u8 reg, u8 * data, u8 length);
+
     int check_reply_frame_no_parameter(u8 & ID);
 
+    u16 ping_all();                                     // mask of the servos replying (bit N-1 : servo ID N)
+    int write_baud_rate_register(u8 ID, u8 value);
+
     int uart_port_num {1};
 
     // calibration helpers
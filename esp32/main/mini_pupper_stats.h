@@ -68,6 +68,53 @@ namespace mini_pupper
     };
 
 
+    // Monitor the load of a serial bus, updated once per bus cycle
+    //  - bytes sent and received (count, and per second)
+    //  - bytes saved per second, e.g. by writing only the changed setpoints (mean)
+    //  - utilisation : time the bus carries bytes over the cycle time (mean)
+    //  - useful frames per second, e.g. servo feedbacks decoded (mean)
+    struct bus_load_monitor
+    {
+        bus_load_monitor(float alpha = 0.005f) :
+        _alpha(alpha)
+        {
+
+        }
+
+        void update(size_t tx, size_t rx, size_t frames, int64_t byte_time_us, size_t tx_saved = 0)
+        {
+            // compute delta us
+            int64_t const current_time_us { esp_timer_get_time() };
+            int64_t const delta_time_us = current_time_us-_last_time_us;
+            _last_time_us = current_time_us;
+
+            tx_bytes += tx;
+            rx_bytes += rx;
+            if(counter++==0 || delta_time_us<=0) return;
+            float const busy_time_us = (float)((tx+rx)*byte_time_us);
+            utilisation     = (1.0f-_alpha)*utilisation + _alpha*std::min(busy_time_us/(float)delta_time_us,1.0f);
+            frame_frequency = (1.0f-_alpha)*frame_frequency + _alpha*(float)frames*1000000.0f/(float)delta_time_us;
+            tx_byte_frequency = (1.0f-_alpha)*tx_byte_frequency + _alpha*(float)tx*1000000.0f/(float)delta_time_us;
+            rx_byte_frequency = (1.0f-_alpha)*rx_byte_frequency + _alpha*(float)rx*1000000.0f/(float)delta_time_us;
+            tx_saved_byte_frequency = (1.0f-_alpha)*tx_saved_byte_frequency + _alpha*(float)tx_saved*1000000.0f/(float)delta_time_us;
+        }
+
+        uint64_t counter        {0};
+        uint64_t tx_bytes       {0};
+        uint64_t rx_bytes       {0};
+        float utilisation       {0.0f};
+        float frame_frequency   {0.0f};
+        float tx_byte_frequency {0.0f};
+        float rx_byte_frequency {0.0f};
+        float tx_saved_byte_frequency {0.0f};
+
+        private:
+
+            float _alpha {0.005f};
+            int64_t _last_time_us {0};
+    };
+
+
     // Monitor a frame error rate communication
     //  - transmission count
     //  - checksum error count
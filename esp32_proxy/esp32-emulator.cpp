@@ -0,0 +1,628 @@
+/* Authors :
+ * - Hdumcke
+ * - Pat92fr
+ */
+
+/* ESP32 emulator
+ *
+ *  Opens a pseudo-terminal and behaves like the ESP32 HOST_TASK on the other end :
+ *  each valid CONTROL frame is acknowledged with servo, IMU and power supply feedback,
+ *  each CONTROL_SEQ frame (pipelined exchanges) with its sequence number too.
+ *  PROTOCOL frames negotiate the host protocol version : from version 2, the acknowledges carry
+ *  a frame counter and the times of the servo and IMU samples (emulated esp_timer clock), and
+ *  the host may select the acknowledge fields (SET_CONFIG, FEEDBACK_FIELDS).
+ *  GET_STATS, GET_CONFIG, SET_CONFIG and the servo register instructions are replied as the
+ *  firmware does, unknown instructions or bad parameters with a NACK.
+ *  esp32-proxy is pointed at the emulator with --device, so the proxy and its clients
+ *  can be tested and benchmarked without a robot.
+ *
+ *  Simulation :
+ *  - servos move toward their goal position at a limited speed when the torque is enabled,
+ *    the load is proportional to the position error, the temperature rises with the load
+ *  - the IMU reads gravity plus noise
+ *  - the battery voltage drops with the current drawn by the servos
+ *  - each servo has a register file, its ID at address 5 ; the polled servos are sync read every
+ *    servo bus cycle, back to back transactions or the period when longer, which sets the age of
+ *    the servo samples ; only the setpoints changed by the last CONTROL frame are sync written,
+ *    all of them when the refresh period is 0
+ *
+ *  Fault injection :
+ *  - a fixed latency plus a uniform random jitter before each acknowledge, frames received
+ *    meanwhile are processed (acknowledges stay in order)
+ *  - acknowledges dropped or corrupted (one bit flipped) with a given probability
+ *
+ *  Usage : esp32-emulator [--link <path>] [--latency <us>] [--jitter <us>]
+ *                         [--drop <probability>] [--corrupt <probability>] [--seed <n>]
+ *                         [--protocol <version>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <termios.h>
+#include <poll.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <random>
+#include <vector>
+
+#include "mini_pupper_host_base.h"
+#include "mini_pupper_protocol.h"
+
+static int64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+static volatile sig_atomic_t stop {0};
+
+static void handle_signal(int)
+{
+    stop = 1;
+}
+
+// Simulated robot state
+struct robot_model
+{
+    // SCS servo : 0..1023 for 300 degrees, about 0.1s per 60 degrees
+    static constexpr float SERVO_SPEED {2000.0f};   // position unit per second
+    static constexpr float SERVO_LOAD_GAIN {10.0f}; // load per position unit of error
+    static constexpr float VOLTAGE_V {7.4f};
+    static constexpr float RESISTANCE_OHM {0.2f};
+
+    float position[12];
+    float speed[12];        // position unit per second
+    parameters_control_instruction_format control;
+
+    robot_model()
+    {
+        for (auto & p : position) p = 512.0f;
+        for (auto & s : speed) s = 0.0f;
+        memset(&control, 0, sizeof(control));
+        for (auto & g : control.goal_position) g = 512;
+        memset(registers, 0, sizeof(registers));
+        for (size_t index = 0; index < 12; ++index) registers[index][SERVO_ID_ADDRESS] = (u8)(index+1);
+    }
+
+    // SCS servo register file
+    static constexpr size_t SERVO_ID_ADDRESS {5};
+    u8 registers[12][256];
+
+    void update(float dt_s)
+    {
+        float const step {SERVO_SPEED * dt_s};
+        for (size_t index = 0; index < 12; ++index) {
+            speed[index] = 0.0f;
+            if (!control.torque_enable[index]) continue;
+            float const error {(float)control.goal_position[index] - position[index]};
+            float const move {std::max(-step, std::min(step, error))};
+            position[index] += move;
+            if (dt_s > 0.0f) speed[index] = move / dt_s;
+        }
+    }
+
+    template<typename generator>
+    void get_feedback(feedback_values & values, generator & random)
+    {
+        parameters_control_acknowledge_format & feedback = values.feedback;
+        std::normal_distribution<float> accel_noise(0.0f, 0.01f);
+        std::normal_distribution<float> gyro_noise(0.0f, 0.5f);
+        float current_A {0.2f};
+        for (size_t index = 0; index < 12; ++index) {
+            feedback.present_position[index] = (u16)(position[index] + 0.5f);
+            float load {0.0f};
+            if (control.torque_enable[index]) {
+                load = SERVO_LOAD_GAIN * ((float)control.goal_position[index] - position[index]);
+                load = std::max(-1000.0f, std::min(1000.0f, load));
+            }
+            feedback.present_load[index] = (s16)load;
+            values.extra.present_speed[index] = (s16)speed[index];
+            values.extra.present_temperature[index] = (u8)(30.0f + 0.02f * std::abs(load));
+            current_A += 0.0005f * std::abs(load);
+        }
+        // the IMU is sampled as raw values, converted as IMU::read_6dof does
+        float const imu[6] {accel_noise(random), accel_noise(random), 1.0f + accel_noise(random),
+            gyro_noise(random), gyro_noise(random), gyro_noise(random)};
+        for (size_t index = 0; index < 6; ++index) {
+            float const scale {index < 3 ? FEEDBACK_ACCEL_SCALE_G : FEEDBACK_GYRO_SCALE_DPS};
+            values.raw.imu[index] = (int16_t)std::lround(std::max(-32768.0f, std::min(32767.0f, imu[index] / scale)));
+        }
+        feedback.ax = FEEDBACK_ACCEL_SCALE_G * values.raw.imu[0];
+        feedback.ay = FEEDBACK_ACCEL_SCALE_G * values.raw.imu[1];
+        feedback.az = FEEDBACK_ACCEL_SCALE_G * values.raw.imu[2];
+        feedback.gx = FEEDBACK_GYRO_SCALE_DPS * values.raw.imu[3];
+        feedback.gy = FEEDBACK_GYRO_SCALE_DPS * values.raw.imu[4];
+        feedback.gz = FEEDBACK_GYRO_SCALE_DPS * values.raw.imu[5];
+        feedback.voltage_V = VOLTAGE_V - RESISTANCE_OHM * current_A;
+        feedback.current_A = current_A;
+        values.raw.voltage_mV = (u16)(feedback.voltage_V * 1000.0f + 0.5f);
+        values.raw.current_mA = (u16)(feedback.current_A * 1000.0f + 0.5f);
+    }
+};
+
+static void usage(char const * name)
+{
+    printf("usage: %s [options]\n", name);
+    printf("  --link <path>            create a symbolic link to the pseudo-terminal (e.g. /tmp/ttyESP32)\n");
+    printf("  --latency <us>           delay before each acknowledge, default is 0\n");
+    printf("  --jitter <us>            additional uniform random delay, default is 0\n");
+    printf("  --drop <probability>     probability an acknowledge is not sent, default is 0\n");
+    printf("  --corrupt <probability>  probability an acknowledge has one bit flipped, default is 0\n");
+    printf("  --seed <n>               random seed, default is 1\n");
+    printf("  --protocol <version>     latest host protocol version supported, default is %d,\n", HOST_PROTOCOL_VERSION);
+    printf("                           1 ignores PROTOCOL frames and the other exchanges (older firmware)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    char const * link_path {nullptr};
+    int64_t latency_ns {0};
+    int64_t jitter_ns {0};
+    double drop_probability {0.0};
+    double corrupt_probability {0.0};
+    unsigned seed {1};
+    int protocol_version_supported {HOST_PROTOCOL_VERSION};
+
+    /* parse command line */
+    static struct option const long_options[] = {
+        {"link",    required_argument, 0, 'l'},
+        {"latency", required_argument, 0, 'L'},
+        {"jitter",  required_argument, 0, 'j'},
+        {"drop",    required_argument, 0, 'd'},
+        {"corrupt", required_argument, 0, 'c'},
+        {"seed",    required_argument, 0, 's'},
+        {"protocol", required_argument, 0, 'p'},
+        {"help",    no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+    for (;;) {
+        int c = getopt_long(argc, argv, "l:L:j:d:c:s:p:h", long_options, NULL);
+        if (c == -1) break;
+        switch (c) {
+        case 'l':
+            link_path = optarg;
+            break;
+        case 'L':
+            latency_ns = (int64_t)(atof(optarg) * 1000.0);
+            break;
+        case 'j':
+            jitter_ns = (int64_t)(atof(optarg) * 1000.0);
+            break;
+        case 'd':
+            drop_probability = atof(optarg);
+            break;
+        case 'c':
+            corrupt_probability = atof(optarg);
+            break;
+        case 's':
+            seed = (unsigned)atoi(optarg);
+            break;
+        case 'p':
+            protocol_version_supported = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if (latency_ns < 0 || jitter_ns < 0
+        || drop_probability < 0.0 || drop_probability > 1.0
+        || corrupt_probability < 0.0 || corrupt_probability > 1.0
+        || protocol_version_supported < HOST_PROTOCOL_VERSION_1 || protocol_version_supported > HOST_PROTOCOL_VERSION) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // open a pseudo-terminal
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd == -1 || grantpt(fd) == -1 || unlockpt(fd) == -1) {
+        perror("posix_openpt");
+        exit(EXIT_FAILURE);
+    }
+    char const * device = ptsname(fd);
+
+    // keep the slave side open and raw : the pseudo-terminal survives proxy restarts
+    int slave_fd = open(device, O_RDWR | O_NOCTTY);
+    if (slave_fd == -1) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+    struct termios options;
+    tcgetattr(slave_fd, &options);
+    cfmakeraw(&options);
+    tcsetattr(slave_fd, TCSANOW, &options);
+
+    if (link_path) {
+        unlink(link_path);
+        if (symlink(device, link_path) == -1) {
+            perror("symlink");
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf("ESP32 emulator on %s\n", link_path ? link_path : device);
+    fflush(stdout);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<double> probability(0.0, 1.0);
+    std::uniform_int_distribution<int64_t> jitter(0, jitter_ns);
+
+    robot_model robot;
+    int64_t last_update_ns {monotonic_ns()};
+
+    protocol_parser parser;
+    uint64_t acks_sent {0};
+    uint64_t acks_dropped {0};
+    uint64_t acks_corrupted {0};
+    uint64_t reads {0};
+    uint32_t nack_count {0};
+
+    // emulated ESP32 state : esp_timer counts from the emulator start-up
+    int64_t const boot_ns {monotonic_ns()};
+    auto esp_timer_us = [boot_ns](int64_t time_ns) { return (time_ns - boot_ns) / 1000; };
+    int protocol_version {HOST_PROTOCOL_VERSION_1};
+    uint32_t frame_counter {0};
+    uint32_t servo_period_ms {0};
+    uint32_t feedback_servo_mask {0x0FFF};
+    uint32_t feedback_fields {FEEDBACK_FIELDS_VERSION_1};
+    uint32_t servo_refresh_ms {100};
+    uint32_t torque_changed_mask {0x0FFF};      // servos whose setpoints changed with the last CONTROL frame
+    uint32_t position_changed_mask {0x0FFF};
+    // servo bus sync writes : torque (8 bytes plus 2 per servo) and goal position (8 bytes plus 3
+    // per servo) of the servos changed, no frame when none changed
+    auto sync_write_bytes = [&]() -> int64_t {
+        int const torque_count {__builtin_popcount(servo_refresh_ms ? torque_changed_mask : 0x0FFF)};
+        int const position_count {__builtin_popcount(servo_refresh_ms ? position_changed_mask : 0x0FFF)};
+        return (torque_count ? 8 + 2*torque_count : 0) + (position_count ? 8 + 3*position_count : 0);
+    };
+    int64_t const SYNC_WRITE_ALL_BYTES {(8 + 2*12) + (8 + 3*12)};
+    // servo bus cycle : back to back sync writes and sync read (8 bytes, plus 13 per polled servo),
+    // 20 us per byte, the period at least
+    auto servo_cycle_us = [&]() -> int64_t {
+        return std::max<int64_t>((int64_t)servo_period_ms*1000, (sync_write_bytes() + 8 + 13*__builtin_popcount(feedback_servo_mask))*20);
+    };
+    auto set_control = [&](u8 const * parameters) {
+        parameters_control_instruction_format control;
+        memcpy(&control, parameters, sizeof(control));
+        torque_changed_mask = 0;
+        position_changed_mask = 0;
+        for (int index = 0; index < 12; ++index) {
+            if (control.torque_enable[index] != robot.control.torque_enable[index]) torque_changed_mask |= 1u << index;
+            if (control.goal_position[index] != robot.control.goal_position[index]) position_changed_mask |= 1u << index;
+        }
+        robot.control = control;
+    };
+
+    // replies waiting for their latency, in order
+    struct pending_reply
+    {
+        int64_t due_ns;
+        bool is_protocol;       // PROTOCOL reply, otherwise CONTROL or CONTROL_SEQ acknowledge
+        std::vector<u8> reply;  // not empty : reply to another instruction (status, instruction, parameters)
+        int sequence;           // -1 : CONTROL acknowledge
+        bool corrupt;
+        int64_t sample_ns;      // time the feedback was sampled
+        uint32_t fields;        // acknowledge fields when the frame was received
+        feedback_values values;
+    };
+    std::deque<pending_reply> pending;
+
+    u8 rx_buffer[1024];
+    while (!stop) {
+        // send the replies due
+        int64_t const now_ns {monotonic_ns()};
+        while (!pending.empty() && pending.front().due_ns <= now_ns) {
+            pending_reply const & reply = pending.front();
+
+            // build the frame
+            u8 tx_buffer[4+protocol_parser::MAX_PAYLOAD_LENGTH] {
+                0xFF,                                       // Start of Frame
+                0xFF,                                       // Start of Frame
+                0x01,                                       // ID
+                0,                                          // Length
+                0x00,                                       // Status
+            };
+            size_t tx_payload_length {1};
+            if (!reply.reply.empty()) {
+                memcpy(tx_buffer+4, reply.reply.data(), reply.reply.size());
+                tx_payload_length = reply.reply.size();
+            }
+            else if (reply.is_protocol) {
+                tx_buffer[5] = (u8)protocol_version;
+                tx_payload_length += 1;
+            }
+            else {
+                if (reply.sequence >= 0) tx_buffer[4+tx_payload_length++] = (u8)reply.sequence;
+                feedback_values values {reply.values};
+                ++frame_counter;
+                // the polled servos are sync read every servo bus cycle, decoded at its end,
+                // the IMU is sampled at 1 kHz
+                int64_t const sample_us {esp_timer_us(reply.sample_ns)};
+                int64_t const servo_time_us {sample_us - sample_us % servo_cycle_us()};
+                if (reply.fields & (1u<<FEEDBACK_TIMING)) {
+                    values.timing.frame_counter = frame_counter;
+                    values.timing.reserved = 0;
+                    values.timing.servo_time_us = servo_time_us;
+                    values.timing.imu_time_us = sample_us - sample_us % 1000;
+                    values.timing.tx_time_us = esp_timer_us(monotonic_ns());
+                }
+                if (reply.fields & (1u<<FEEDBACK_SERVO_AGE)) {
+                    for (size_t index = 0; index < 12; ++index) {
+                        values.extra.servo_age[index] = (feedback_servo_mask & (1u<<index))
+                            ? (uint16_t)std::min<int64_t>((sample_us - servo_time_us) / SERVO_AGE_UNIT_US, SERVO_AGE_MAX) : SERVO_AGE_NEVER_READ;
+                    }
+                }
+                tx_payload_length += encode_feedback_fields(values, reply.fields, tx_buffer+4+tx_payload_length);
+            }
+            tx_payload_length += 1; // checksum
+            tx_buffer[3] = (u8)tx_payload_length;
+            size_t const tx_buffer_size {4+tx_payload_length};
+            tx_buffer[tx_buffer_size-1] = compute_checksum(tx_buffer);
+            if (reply.corrupt) {
+                std::uniform_int_distribution<size_t> byte_index(0, tx_buffer_size-1);
+                tx_buffer[byte_index(random)] ^= (u8)(1 << (random() % 8));
+            }
+
+            size_t written {0};
+            while (written < tx_buffer_size) {
+                ssize_t const result = write(fd, tx_buffer+written, tx_buffer_size-written);
+                if (result < 0) {
+                    if (errno == EINTR || errno == EAGAIN) continue;
+                    perror("write");
+                    break;
+                }
+                written += result;
+            }
+            if (!reply.is_protocol && reply.reply.empty()) ++acks_sent;
+            pending.pop_front();
+        }
+
+        // wait for frames, or the next reply due
+        struct timespec timeout {0, 100000000};
+        if (!pending.empty()) {
+            int64_t const remaining_ns {pending.front().due_ns - now_ns};
+            timeout.tv_sec = remaining_ns / 1000000000LL;
+            timeout.tv_nsec = remaining_ns % 1000000000LL;
+        }
+        struct pollfd pfd { fd, POLLIN, 0 };
+        if (ppoll(&pfd, 1, &timeout, NULL) <= 0) continue;
+        ssize_t const read_length = read(fd, rx_buffer, sizeof(rx_buffer));
+        if (read_length <= 0) {
+            if (read_length < 0 && errno != EINTR && errno != EAGAIN) {
+                perror("read");
+                break;
+            }
+            continue;
+        }
+        int64_t const rx_time_ns {monotonic_ns()};
+        ++reads;
+
+        // reply latency : the link and the ESP32 handle several frames at once, replies stay in order
+        auto queue_reply = [&](pending_reply reply) {
+            reply.due_ns = rx_time_ns + latency_ns + jitter(random);
+            if (!pending.empty()) reply.due_ns = std::max(reply.due_ns, pending.back().due_ns);
+            pending.push_back(reply);
+        };
+        auto send_reply = [&](u8 status, u8 instruction, u8 const * parameters, size_t parameter_length) {
+            pending_reply reply {};
+            reply.reply.push_back(status);
+            reply.reply.push_back(instruction);
+            reply.reply.insert(reply.reply.end(), parameters, parameters+parameter_length);
+            queue_reply(reply);
+        };
+        auto send_nack = [&](u8 status, u8 instruction) {
+            ++nack_count;
+            send_reply(status, instruction, nullptr, 0);
+        };
+        auto get_config = [&](u8 entry, uint32_t & value) {
+            switch (entry) {
+            case HOST_CONFIG_SERVO_PERIOD_MS: value = servo_period_ms; return true;
+            case HOST_CONFIG_FEEDBACK_SERVO_MASK: value = feedback_servo_mask; return true;
+            case HOST_CONFIG_FEEDBACK_FIELDS: value = feedback_fields; return true;
+            case HOST_CONFIG_SERVO_REFRESH_MS: value = servo_refresh_ms; return true;
+            default: return false;
+            }
+        };
+        auto set_config = [&](u8 entry, uint32_t value) {
+            switch (entry) {
+            case HOST_CONFIG_SERVO_PERIOD_MS:
+                if (value > 20) return false;
+                servo_period_ms = value;
+                return true;
+            case HOST_CONFIG_FEEDBACK_SERVO_MASK:
+                if (value == 0 || value > 0x0FFF) return false;
+                feedback_servo_mask = value;
+                return true;
+            case HOST_CONFIG_FEEDBACK_FIELDS:
+                if (!is_valid_feedback_fields(value)) return false;
+                feedback_fields = value;
+                return true;
+            case HOST_CONFIG_SERVO_REFRESH_MS:
+                if (value > 1000) return false;
+                servo_refresh_ms = value;
+                return true;
+            default:
+                return false;
+            }
+        };
+
+        // other exchanges : replies as HOST::dispatch does
+        auto handle_instruction = [&](u8 instruction, u8 const * parameters, size_t parameter_length) {
+            switch (instruction) {
+            case INST_GET_STATS: {
+                if (parameter_length != 0) break;
+                auto const & counter = parser.f_monitor.counter;
+                int64_t const uptime_ms {(rx_time_ns - boot_ns) / 1000000};
+                parameters_stats_format stats;
+                stats.host_frames = (uint32_t)counter[mini_pupper::frame_error_rate_monitor::ALL];
+                stats.host_checksum_errors = (uint32_t)counter[mini_pupper::frame_error_rate_monitor::CHECKSUM_ERROR];
+                stats.host_syntax_errors = (uint32_t)counter[mini_pupper::frame_error_rate_monitor::SYNTAX_ERROR];
+                stats.host_nacks = nack_count;
+                stats.host_frequency_hz = uptime_ms ? (float)reads * 1000.0f / (float)uptime_ms : 0.0f;
+                // one frame per polled servo every cycle
+                stats.servo_frames = (uint32_t)(uptime_ms * 1000 / servo_cycle_us() * __builtin_popcount(feedback_servo_mask));
+                stats.servo_checksum_errors = 0;
+                stats.servo_syntax_errors = 0;
+                stats.servo_time_out_errors = 0;
+                stats.servo_truncated_errors = 0;
+                stats.servo_frequency_hz = 1000000.0f / (float)servo_cycle_us();
+                stats.imu_frequency_hz = 1000.0f;
+                stats.uptime_ms = (uint32_t)uptime_ms;
+                stats.free_heap = 200000;
+                float const cycle_frequency_hz {1000000.0f / (float)servo_cycle_us()};
+                stats.servo_tx_bytes_per_s = (float)(sync_write_bytes() + 8) * cycle_frequency_hz;
+                stats.servo_rx_bytes_per_s = (float)(8*__builtin_popcount(feedback_servo_mask)) * cycle_frequency_hz;
+                stats.servo_tx_saved_bytes_per_s = (float)(SYNC_WRITE_ALL_BYTES - sync_write_bytes()) * cycle_frequency_hz;
+                stats.servo_bus_utilisation = (float)((sync_write_bytes() + 8 + 13*__builtin_popcount(feedback_servo_mask))*20) / (float)servo_cycle_us();
+                send_reply(HOST_STATUS_OK, instruction, reinterpret_cast<u8 const *>(&stats), sizeof(stats));
+                return;
+            }
+            case INST_GET_CONFIG:
+            case INST_SET_CONFIG: {
+                if (parameter_length != (instruction == INST_GET_CONFIG ? 1u : 5u)) break;
+                uint32_t value {0};
+                if (instruction == INST_SET_CONFIG) memcpy(&value, parameters+1, 4);
+                if ((instruction == INST_SET_CONFIG && !set_config(parameters[0], value)) || !get_config(parameters[0], value)) break;
+                u8 reply[1+4] {parameters[0]};
+                memcpy(reply+1, &value, 4);
+                send_reply(HOST_STATUS_OK, instruction, reply, sizeof(reply));
+                return;
+            }
+            case INST_READ_SERVO_REGISTERS: {
+                if (parameter_length < 2+1 || parameter_length > 2+12) break;
+                size_t const address {parameters[0]}, length {parameters[1]}, count {parameter_length-2};
+                if (length == 0 || address+length > 256 || count*(1+length) > HOST_SERVO_REGISTERS_MAX_DATA) break;
+                u8 reply[HOST_SERVO_REGISTERS_MAX_DATA] {};
+                for (size_t index = 0; index < count; ++index) {
+                    u8 const id {parameters[2+index]};
+                    u8 * servo_reply {reply + index*(1+length)};
+                    if (id < 1 || id > 12) {
+                        servo_reply[0] = 1; // no servo : time out
+                        continue;
+                    }
+                    memcpy(servo_reply+1, &robot.registers[id-1][address], length);
+                }
+                send_reply(HOST_STATUS_OK, instruction, reply, count*(1+length));
+                return;
+            }
+            case INST_WRITE_SERVO_REGISTERS: {
+                if (parameter_length < 2+2 || parameter_length > 2+HOST_SERVO_REGISTERS_MAX_DATA) break;
+                size_t const address {parameters[0]}, length {parameters[1]};
+                if (length == 0 || address+length > 256 || (parameter_length-2) % (1+length) != 0 || (parameter_length-2)/(1+length) > 12) break;
+                size_t const count {(parameter_length-2)/(1+length)};
+                u8 reply[12] {};
+                for (size_t index = 0; index < count; ++index) {
+                    u8 const * servo_data {parameters + 2 + index*(1+length)};
+                    if (servo_data[0] < 1 || servo_data[0] > 12) {
+                        reply[index] = 1;
+                        continue;
+                    }
+                    memcpy(&robot.registers[servo_data[0]-1][address], servo_data+1, length);
+                }
+                send_reply(HOST_STATUS_OK, instruction, reply, count);
+                return;
+            }
+            case INST_CONTROL:
+            case INST_CONTROL_SEQ:
+            case INST_PROTOCOL:
+                break;
+            default:
+                send_nack(HOST_STATUS_UNKNOWN_INSTRUCTION, instruction);
+                return;
+            }
+            send_nack(HOST_STATUS_BAD_PARAMETERS, instruction);
+        };
+
+        // decode received data, as HOST_TASK does : one acknowledge per CONTROL_SEQ frame,
+        // one acknowledge for all the CONTROL frames of a read
+        std::vector<int> replies;  // sequence number, -1 : CONTROL acknowledge
+        bool have_to_reply {false};
+        u8 const * rx_data {rx_buffer};
+        size_t rx_length {(size_t)read_length};
+        protocol_frame frame;
+        protocol_parser_status status;
+        while ((status = parser.parse(rx_data, rx_length, frame)) != PROTOCOL_NEED_DATA) {
+            if (status != PROTOCOL_FRAME) continue;
+            u8 const * const payload {frame.payload};
+            if (payload[0] == INST_CONTROL && frame.payload_length == sizeof(parameters_control_instruction_format)+2) {
+                set_control(&payload[1]);
+                have_to_reply = true;
+            }
+            else if (payload[0] == INST_CONTROL_SEQ && frame.payload_length == 1+sizeof(parameters_control_instruction_format)+2) {
+                set_control(&payload[2]);
+                replies.push_back(payload[1]);
+            }
+            else if (protocol_version_supported < HOST_PROTOCOL_VERSION_2) {
+                parser.f_monitor.update(mini_pupper::frame_error_rate_monitor::SYNTAX_ERROR, false);
+            }
+            else if (payload[0] == INST_PROTOCOL && frame.payload_length == 1+1+1) {
+                int const requested_version {payload[1]};
+                protocol_version = std::max(HOST_PROTOCOL_VERSION_1, std::min(protocol_version_supported, requested_version));
+                feedback_fields = protocol_version >= HOST_PROTOCOL_VERSION_2 ? FEEDBACK_FIELDS_VERSION_2 : FEEDBACK_FIELDS_VERSION_1;
+                pending_reply reply {};
+                reply.is_protocol = true;
+                queue_reply(reply);
+            }
+            else {
+                handle_instruction(payload[0], payload+1, frame.payload_length-2);
+            }
+        }
+        if (have_to_reply) replies.push_back(-1);
+        if (replies.empty()) continue;
+
+        // simulate
+        robot.update((float)(rx_time_ns - last_update_ns) * 1e-9f);
+        last_update_ns = rx_time_ns;
+
+        for (int const sequence : replies) {
+            if (probability(random) < drop_probability) {
+                ++acks_dropped;
+                ++frame_counter;
+                continue;
+            }
+            pending_reply reply {};
+            reply.sequence = sequence;
+            reply.sample_ns = rx_time_ns;
+            reply.fields = feedback_fields;
+            robot.get_feedback(reply.values, random);
+            if (probability(random) < corrupt_probability) {
+                reply.corrupt = true;
+                ++acks_corrupted;
+            }
+            queue_reply(reply);
+        }
+    }
+
+    auto const & counter = parser.f_monitor.counter;
+    printf("frames received:%llu checksum errors:%llu syntax errors:%llu\n",
+        (unsigned long long)counter[mini_pupper::frame_error_rate_monitor::ALL],
+        (unsigned long long)counter[mini_pupper::frame_error_rate_monitor::CHECKSUM_ERROR],
+        (unsigned long long)counter[mini_pupper::frame_error_rate_monitor::SYNTAX_ERROR]
+    );
+    printf("acknowledges sent:%llu dropped:%llu corrupted:%llu nacks:%lu\n",
+        (unsigned long long)acks_sent,
+        (unsigned long long)acks_dropped,
+        (unsigned long long)acks_corrupted,
+        (unsigned long)nack_count
+    );
+
+    if (link_path) unlink(link_path);
+    close(slave_fd);
+    close(fd);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,285 @@
+/* Authors :
+ * - Hdumcke
+ * - Pat92fr
+ */
+
+/* ESP32 frame parser microbenchmark
+ *
+ *  Compares the byte-at-a-time protocol_interpreter with the buffer-oriented protocol_parser
+ *  (mini_pupper_protocol.h) on the same byte stream : a mix of CONTROL, CONTROL_SEQ and
+ *  acknowledge frames of both host protocol versions, optionally with corrupted bytes.
+ *  The stream is fed in reads of a fixed size, as the UART delivers it (1024 bytes in
+ *  HOST_TASK, 256 bytes in esp32-proxy) : small reads exercise frames split across reads.
+ *
+ *  For each read size and stream, the throughput (MB/s), and the time and CPU cycles per
+ *  frame are reported. Cycles are read from the perf hardware counter, "n/a" when it is
+ *  not available (e.g. in a container). Both parsers must find the same frames and error
+ *  counts, otherwise the benchmark fails.
+ *
+ *  Usage : esp32-protocol-bench [--size <MiB>] [--noise <probability>] [--rounds <N>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <random>
+#include <vector>
+
+#include "mini_pupper_host_base.h"
+#include "mini_pupper_protocol.h"
+
+static int64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// CPU cycles of this thread, in user space
+struct cycle_counter {
+    int fd {-1};
+
+    cycle_counter() {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    ~cycle_counter() {
+        if (fd >= 0) close(fd);
+    }
+    void start() {
+        if (fd < 0) return;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    // cycles since start, -1 when not available
+    int64_t stop() {
+        if (fd < 0) return -1;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t cycles {0};
+        if (read(fd, &cycles, sizeof(cycles)) != sizeof(cycles)) return -1;
+        return (int64_t)cycles;
+    }
+};
+
+static void append_frame(std::vector<u8> & stream, std::vector<u8> const & payload)
+{
+    size_t const start {stream.size()};
+    stream.push_back(0xFF);
+    stream.push_back(0xFF);
+    stream.push_back(0x01);
+    stream.push_back((u8)(payload.size() + 1));
+    stream.insert(stream.end(), payload.begin(), payload.end());
+    stream.push_back(compute_checksum(&stream[start]));
+}
+
+// Frames as exchanged on the UART, in both directions
+static std::vector<u8> make_stream(size_t size, double noise, std::mt19937 & random)
+{
+    std::uniform_int_distribution<int> byte(0, 255);
+    std::uniform_int_distribution<int> kind(0, 3);
+    std::uniform_real_distribution<double> probability(0.0, 1.0);
+    size_t const control_length {sizeof(parameters_control_instruction_format)};
+    size_t const feedback_length {sizeof(parameters_control_acknowledge_format)};
+    size_t const timing_length {sizeof(parameters_control_acknowledge_timing_format)};
+
+    std::vector<u8> stream;
+    stream.reserve(size + 256);
+    while (stream.size() < size) {
+        std::vector<u8> payload;
+        switch (kind(random)) {
+        case 0: // CONTROL
+            payload.push_back(INST_CONTROL);
+            for (size_t index = 0; index < control_length; ++index) payload.push_back((u8)byte(random));
+            break;
+        case 1: // CONTROL_SEQ
+            payload.push_back(INST_CONTROL_SEQ);
+            payload.push_back((u8)byte(random));
+            for (size_t index = 0; index < control_length; ++index) payload.push_back((u8)byte(random));
+            break;
+        case 2: // CONTROL acknowledge, version 1
+            payload.push_back(0x00);
+            for (size_t index = 0; index < feedback_length; ++index) payload.push_back((u8)byte(random));
+            break;
+        default: // CONTROL_SEQ acknowledge, version 2
+            payload.push_back(0x00);
+            payload.push_back((u8)byte(random));
+            for (size_t index = 0; index < feedback_length + timing_length; ++index) payload.push_back((u8)byte(random));
+            break;
+        }
+        append_frame(stream, payload);
+    }
+    if (noise > 0.0) {
+        for (u8 & value : stream) {
+            if (probability(random) < noise) value = (u8)byte(random);
+        }
+    }
+    return stream;
+}
+
+struct parse_result {
+    uint64_t frames {0};
+    uint64_t digest {0};    // folds the payloads handed out, so that both parsers can be compared
+    uint64_t counter[mini_pupper::frame_error_rate_monitor::ERROR_COUT] {};
+    int64_t time_ns {0};
+    int64_t cycles {0};
+};
+
+static bool same_frames(parse_result const & a, parse_result const & b)
+{
+    return a.frames == b.frames && a.digest == b.digest
+        && memcmp(a.counter, b.counter, sizeof(a.counter)) == 0;
+}
+
+// Fold a frame into a digest : length, instruction (or status), last parameter byte
+// - payload_buffer of protocol_interpreter does not hold the checksum
+static void fold(uint64_t & digest, u8 const * payload, u8 payload_length)
+{
+    digest = digest * 31 + payload_length;
+    digest = digest * 31 + payload[0];
+    digest = digest * 31 + payload[payload_length - 2];
+}
+
+static parse_result run_interpreter(std::vector<u8> const & stream, size_t read_size, cycle_counter & cycles)
+{
+    parse_result result;
+    protocol_interpreter_handler handler;
+    int64_t const start_ns {monotonic_ns()};
+    cycles.start();
+    for (size_t offset = 0; offset < stream.size(); offset += read_size) {
+        size_t const end {std::min(stream.size(), offset + read_size)};
+        for (size_t index = offset; index < end; ++index) {
+            if (!protocol_interpreter(stream[index], handler)) continue;
+            ++result.frames;
+            fold(result.digest, handler.payload_buffer, handler.payload_length);
+        }
+    }
+    result.cycles = cycles.stop();
+    result.time_ns = monotonic_ns() - start_ns;
+    memcpy(result.counter, handler.f_monitor.counter, sizeof(result.counter));
+    return result;
+}
+
+static parse_result run_parser(std::vector<u8> const & stream, size_t read_size, cycle_counter & cycles)
+{
+    parse_result result;
+    protocol_parser parser;
+    int64_t const start_ns {monotonic_ns()};
+    cycles.start();
+    for (size_t offset = 0; offset < stream.size(); offset += read_size) {
+        u8 const * data {stream.data() + offset};
+        size_t length {std::min(stream.size() - offset, read_size)};
+        protocol_frame frame;
+        protocol_parser_status status;
+        while ((status = parser.parse(data, length, frame)) != PROTOCOL_NEED_DATA) {
+            if (status != PROTOCOL_FRAME) continue;
+            ++result.frames;
+            fold(result.digest, frame.payload, frame.payload_length);
+        }
+    }
+    result.cycles = cycles.stop();
+    result.time_ns = monotonic_ns() - start_ns;
+    memcpy(result.counter, parser.f_monitor.counter, sizeof(result.counter));
+    return result;
+}
+
+static void print_result(char const * name, size_t read_size, char const * stream_name, size_t stream_size, parse_result const & result)
+{
+    double const frames {result.frames ? (double)result.frames : 1.0};
+    printf("%-12s %6zu  %-6s %10.1f %10.1f ", name, read_size, stream_name,
+        (double)stream_size / ((double)result.time_ns * 1e-9) / 1e6,
+        (double)result.time_ns / frames);
+    if (result.cycles >= 0) printf("%10.1f", (double)result.cycles / frames);
+    else printf("%10s", "n/a");
+    printf(" %9llu %9llu %9llu\n",
+        (unsigned long long)result.frames,
+        (unsigned long long)result.counter[mini_pupper::frame_error_rate_monitor::CHECKSUM_ERROR],
+        (unsigned long long)result.counter[mini_pupper::frame_error_rate_monitor::SYNTAX_ERROR]);
+}
+
+// best (fastest) of several rounds
+static void keep_best(parse_result & best, parse_result const & result)
+{
+    if (best.time_ns == 0 || result.time_ns < best.time_ns) best = result;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t size_mib {16};
+    double noise {0.01};
+    int rounds {5};
+
+    static struct option const long_options[] = {
+        {"size",   required_argument, 0, 's'},
+        {"noise",  required_argument, 0, 'n'},
+        {"rounds", required_argument, 0, 'r'},
+        {"help",   no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+    for (;;) {
+        int c = getopt_long(argc, argv, "s:n:r:h", long_options, NULL);
+        if (c == -1) break;
+        switch (c) {
+        case 's':
+            size_mib = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            noise = atof(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        default:
+            printf("usage: %s [--size <MiB>] [--noise <probability>] [--rounds <N>]\n", argv[0]);
+            exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if (size_mib == 0 || rounds <= 0 || noise < 0.0 || noise > 1.0) {
+        fprintf(stderr, "invalid option\n");
+        exit(EXIT_FAILURE);
+    }
+
+    std::mt19937 random(1);
+    struct named_stream {
+        char const * name;
+        std::vector<u8> bytes;
+    };
+    std::vector<named_stream> streams;
+    streams.push_back({"clean", make_stream(size_mib << 20, 0.0, random)});
+    if (noise > 0.0) streams.push_back({"noisy", make_stream(size_mib << 20, noise, random)});
+
+    cycle_counter cycles;
+    bool identical {true};
+    printf("%-12s %6s  %-6s %10s %10s %10s %9s %9s %9s\n",
+        "parser", "read", "stream", "MB/s", "ns/frame", "cyc/frame", "frames", "checksum", "syntax");
+    for (size_t const read_size : {32, 256, 1024}) {
+        for (named_stream const & stream : streams) {
+            parse_result interpreter, parser;
+            for (int round = 0; round < rounds; ++round) {
+                keep_best(interpreter, run_interpreter(stream.bytes, read_size, cycles));
+                keep_best(parser, run_parser(stream.bytes, read_size, cycles));
+            }
+            print_result("interpreter", read_size, stream.name, stream.bytes.size(), interpreter);
+            print_result("parser", read_size, stream.name, stream.bytes.size(), parser);
+            printf("%-12s %6s  %-6s %9.2fx\n", "speed-up", "", "", (double)interpreter.time_ns / (double)parser.time_ns);
+            if (!same_frames(interpreter, parser)) {
+                printf("MISMATCH: the parsers do not find the same frames\n");
+                identical = false;
+            }
+        }
+    }
+    exit(identical ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,420 @@
+/* Authors :
+ * - Hdumcke
+ * - Pat92fr
+ */
+
+/* ESP32 protocol test
+ *
+ *  Acknowledge layouts (mini_pupper_host_base.h) : at each valid field mask, random feedback values
+ *  are encoded with encode_feedback_fields, then decoded with decode_control_acknowledge, with and
+ *  without sequence number. The decoded values must be those of the fields of the mask, converted
+ *  as the packed fields specify, and zero elsewhere. The layouts of protocol versions 1 and 2 are
+ *  also decoded without field mask, and the packed fields saturate out of range values.
+ *
+ *  Frame parsers (mini_pupper_protocol.h) : the byte-at-a-time protocol_interpreter and the
+ *  buffer-oriented protocol_parser are fed the same streams, in reads of several sizes : frames
+ *  of any length, syntax errors, junk, then the same streams with bytes flipped, dropped and
+ *  repeated. Both must hand out the same frames and count the same errors, and the frames of a
+ *  clean stream must be those sent.
+ *
+ *  Exits with a non-zero status on any failed check.
+ *
+ *  Usage : esp32-protocol-test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <random>
+#include <vector>
+
+#include "mini_pupper_host_base.h"
+#include "mini_pupper_protocol.h"
+
+static int checks {0};
+static int failures {0};
+
+static void check(bool ok, char const * what, int line)
+{
+    ++checks;
+    if (ok) return;
+    ++failures;
+    printf("line %d : %s FAILED\n", line, what);
+}
+#define CHECK(condition) check((condition), #condition, __LINE__)
+
+static std::mt19937 random_engine(1);
+
+static int random_int(int min, int max)
+{
+    return std::uniform_int_distribution<int>(min, max)(random_engine);
+}
+
+static float random_float()
+{
+    return std::uniform_real_distribution<float>(-1000.0f, 1000.0f)(random_engine);
+}
+
+// feedback values within the ranges of the packed fields
+static feedback_values random_values()
+{
+    feedback_values values;
+    memset(&values, 0, sizeof(values));
+    for (size_t index = 0; index < 12; ++index) {
+        values.feedback.present_position[index] = (u16)random_int(0, 1023);
+        values.feedback.present_load[index] = (s16)random_int(-1024, 1023);
+        values.extra.present_speed[index] = (s16)random_int(INT16_MIN, INT16_MAX);
+        values.extra.present_temperature[index] = (u8)random_int(0, 255);
+        values.extra.servo_age[index] = (uint16_t)random_int(0, UINT16_MAX);
+    }
+    values.feedback.ax = random_float();
+    values.feedback.ay = random_float();
+    values.feedback.az = random_float();
+    values.feedback.gx = random_float();
+    values.feedback.gy = random_float();
+    values.feedback.gz = random_float();
+    values.feedback.voltage_V = random_float();
+    values.feedback.current_A = random_float();
+    values.timing.frame_counter = (uint32_t)random_engine();
+    values.timing.servo_time_us = ((int64_t)random_engine() << 32) | random_engine();
+    values.timing.imu_time_us = ((int64_t)random_engine() << 32) | random_engine();
+    values.timing.tx_time_us = ((int64_t)random_engine() << 32) | random_engine();
+    for (auto & sample : values.raw.imu) sample = (int16_t)random_int(INT16_MIN, INT16_MAX);
+    values.raw.voltage_mV = (uint16_t)random_int(0, UINT16_MAX);
+    values.raw.current_mA = (uint16_t)random_int(0, UINT16_MAX);
+    return values;
+}
+
+// The values the host gets from a field, as the protocol specifies them
+static void expect_field(int field, feedback_values const & sent, feedback_values & expected)
+{
+    switch (field) {
+    case FEEDBACK_POSITION:
+    case FEEDBACK_POSITION_PACKED:
+        memcpy(expected.feedback.present_position, sent.feedback.present_position, sizeof(expected.feedback.present_position));
+        break;
+    case FEEDBACK_LOAD:
+    case FEEDBACK_LOAD_PACKED:
+        memcpy(expected.feedback.present_load, sent.feedback.present_load, sizeof(expected.feedback.present_load));
+        break;
+    case FEEDBACK_IMU:
+        expected.feedback.ax = sent.feedback.ax;
+        expected.feedback.ay = sent.feedback.ay;
+        expected.feedback.az = sent.feedback.az;
+        expected.feedback.gx = sent.feedback.gx;
+        expected.feedback.gy = sent.feedback.gy;
+        expected.feedback.gz = sent.feedback.gz;
+        break;
+    case FEEDBACK_POWER:
+        expected.feedback.voltage_V = sent.feedback.voltage_V;
+        expected.feedback.current_A = sent.feedback.current_A;
+        break;
+    case FEEDBACK_TIMING:
+        expected.timing = sent.timing;
+        break;
+    case FEEDBACK_SPEED:
+        memcpy(expected.extra.present_speed, sent.extra.present_speed, sizeof(expected.extra.present_speed));
+        break;
+    case FEEDBACK_TEMPERATURE:
+        memcpy(expected.extra.present_temperature, sent.extra.present_temperature, sizeof(expected.extra.present_temperature));
+        break;
+    case FEEDBACK_IMU_RAW:
+        memcpy(expected.raw.imu, sent.raw.imu, sizeof(expected.raw.imu));
+        expected.feedback.ax = sent.raw.imu[0]*FEEDBACK_ACCEL_SCALE_G;
+        expected.feedback.ay = sent.raw.imu[1]*FEEDBACK_ACCEL_SCALE_G;
+        expected.feedback.az = sent.raw.imu[2]*FEEDBACK_ACCEL_SCALE_G;
+        expected.feedback.gx = sent.raw.imu[3]*FEEDBACK_GYRO_SCALE_DPS;
+        expected.feedback.gy = sent.raw.imu[4]*FEEDBACK_GYRO_SCALE_DPS;
+        expected.feedback.gz = sent.raw.imu[5]*FEEDBACK_GYRO_SCALE_DPS;
+        break;
+    case FEEDBACK_POWER_PACKED:
+        expected.raw.voltage_mV = sent.raw.voltage_mV;
+        expected.raw.current_mA = sent.raw.current_mA;
+        expected.feedback.voltage_V = sent.raw.voltage_mV*0.001f;
+        expected.feedback.current_A = sent.raw.current_mA*0.001f;
+        break;
+    case FEEDBACK_SERVO_AGE:
+        memcpy(expected.extra.servo_age, sent.extra.servo_age, sizeof(expected.extra.servo_age));
+        break;
+    }
+}
+
+// Acknowledge payload : status, [sequence], fields, checksum (not checked by the decoder)
+static size_t encode_acknowledge(feedback_values const & values, uint32_t fields, int sequence, u8 * payload)
+{
+    size_t length {0};
+    payload[length++] = 0x00;
+    if (sequence >= 0) payload[length++] = (u8)sequence;
+    length += encode_feedback_fields(values, fields, payload + length);
+    payload[length++] = 0x00;
+    return length;
+}
+
+// encode then decode, at each valid field mask
+static void test_acknowledge_round_trip()
+{
+    int masks {0};
+    for (uint32_t fields = 1; fields <= FEEDBACK_FIELDS_ALL; ++fields) {
+        if (!is_valid_feedback_fields(fields)) {
+            CHECK(feedback_fields_size(fields) > FEEDBACK_FIELDS_MAX_SIZE);
+            continue;
+        }
+        ++masks;
+        for (int sequence : {-1, 0, 255, random_int(1, 254)}) {
+            feedback_values const sent {random_values()};
+            u8 payload[256];
+            size_t const length {encode_acknowledge(sent, fields, sequence, payload)};
+            bool ok {length <= 127};
+            control_acknowledge ack;
+            ok = ok && decode_control_acknowledge(payload, length, fields, ack);
+            ok = ok && ack.fields == fields && ack.sequence == sequence;
+            ok = ok && ack.version == ((fields & (1u << FEEDBACK_TIMING)) ? HOST_PROTOCOL_VERSION_2 : HOST_PROTOCOL_VERSION_1);
+            feedback_values expected;
+            memset(&expected, 0, sizeof(expected));
+            for (int field = 0; field < FEEDBACK_FIELD_COUNT; ++field) {
+                if (fields & (1u << field)) expect_field(field, sent, expected);
+            }
+            feedback_values const & received = ack;
+            ok = ok && !memcmp(&received, &expected, sizeof(expected));
+            // a payload of another length belongs to another mask
+            control_acknowledge other;
+            ok = ok && !decode_control_acknowledge(payload, length + 2, fields, other);
+            if (!ok) printf("fields 0x%03X, sequence %d\n", fields, sequence);
+            CHECK(ok);
+        }
+    }
+    CHECK(masks > 0);
+    printf("%d field masks\n", masks);
+
+    // versions 1 and 2 told apart by length when the field mask is not known
+    for (uint32_t const fields : {(uint32_t)FEEDBACK_FIELDS_VERSION_1, (uint32_t)FEEDBACK_FIELDS_VERSION_2}) {
+        for (int sequence : {-1, 7}) {
+            feedback_values const sent {random_values()};
+            u8 payload[256];
+            size_t const length {encode_acknowledge(sent, fields, sequence, payload)};
+            control_acknowledge ack;
+            CHECK(decode_control_acknowledge(payload, length, 0, ack));
+            CHECK(ack.fields == fields && ack.sequence == sequence);
+            CHECK(!memcmp(&ack.feedback, &sent.feedback, sizeof(sent.feedback)));
+            CHECK(fields == FEEDBACK_FIELDS_VERSION_1 || !memcmp(&ack.timing, &sent.timing, sizeof(sent.timing)));
+            payload[0] = HOST_STATUS_FAILED;
+            CHECK(!decode_control_acknowledge(payload, length, 0, ack));
+        }
+    }
+}
+
+// the packed fields saturate the values out of their range
+static void test_packed_saturation()
+{
+    feedback_values sent {random_values()};
+    sent.feedback.present_position[0] = 1024;
+    sent.feedback.present_position[5] = 65535;
+    sent.feedback.present_load[0] = -1025;
+    sent.feedback.present_load[7] = INT16_MIN;
+    sent.feedback.present_load[11] = 1024;
+    sent.feedback.present_load[3] = INT16_MAX;
+    uint32_t const fields {(1u << FEEDBACK_POSITION_PACKED) | (1u << FEEDBACK_LOAD_PACKED)};
+    u8 payload[256];
+    size_t const length {encode_acknowledge(sent, fields, -1, payload)};
+    control_acknowledge ack;
+    CHECK(decode_control_acknowledge(payload, length, fields, ack));
+    CHECK(ack.feedback.present_position[0] == 1023 && ack.feedback.present_position[5] == 1023);
+    CHECK(ack.feedback.present_load[0] == -1024 && ack.feedback.present_load[7] == -1024);
+    CHECK(ack.feedback.present_load[11] == 1023 && ack.feedback.present_load[3] == 1023);
+    CHECK(ack.feedback.present_position[1] == sent.feedback.present_position[1]);
+    CHECK(ack.feedback.present_load[1] == sent.feedback.present_load[1]);
+
+    // any value count and width
+    bool ok {true};
+    for (unsigned bits = 1; bits <= 11; ++bits) {
+        for (size_t count = 1; count <= 12; ++count) {
+            uint16_t values[12];
+            uint16_t unpacked[12];
+            u8 packed[32];
+            memset(packed, 0xA5, sizeof(packed));
+            for (size_t index = 0; index < count; ++index) values[index] = (uint16_t)random_int(0, (1 << bits) - 1);
+            pack_bits(values, count, bits, packed);
+            unpack_bits(packed, count, bits, unpacked);
+            ok = ok && !memcmp(values, unpacked, count * sizeof(uint16_t));
+            ok = ok && packed[(count * bits + 7) / 8] == 0xA5;  // nothing written past the packed bytes
+        }
+    }
+    CHECK(ok);
+}
+
+struct frame_record
+{
+    std::vector<u8> payload;    // instruction (or status) and parameters, without checksum
+};
+
+struct parse_result
+{
+    std::vector<frame_record> frames;
+    uint64_t counter[mini_pupper::frame_error_rate_monitor::ERROR_COUT] {};
+    uint64_t checksum_errors {0};   // PROTOCOL_CHECKSUM_ERROR returned
+};
+
+static void append_frame(std::vector<u8> & stream, std::vector<u8> const & payload)
+{
+    size_t const start {stream.size()};
+    stream.push_back(0xFF);
+    stream.push_back(0xFF);
+    stream.push_back(0x01);
+    stream.push_back((u8)(payload.size() + 1));
+    stream.insert(stream.end(), payload.begin(), payload.end());
+    stream.push_back(compute_checksum(&stream[start]));
+}
+
+// frames of any length, acknowledges of random field masks ; with junk and syntax errors when noisy
+static std::vector<u8> make_stream(size_t frame_count, bool junk, std::vector<frame_record> & sent)
+{
+    std::vector<u8> stream;
+    for (size_t count = 0; count < frame_count; ++count) {
+        std::vector<u8> payload;
+        if (random_int(0, 1)) {
+            uint32_t fields;
+            do fields = (uint32_t)random_int(1, FEEDBACK_FIELDS_ALL); while (!is_valid_feedback_fields(fields));
+            u8 buffer[256];
+            size_t const length {encode_acknowledge(random_values(), fields, random_int(-1, 255), buffer)};
+            payload.assign(buffer, buffer + length - 1);
+        }
+        else {
+            payload.resize(random_int(1, protocol_parser::MAX_PAYLOAD_LENGTH - 2));
+            for (u8 & value : payload) value = (u8)random_int(0, 255);
+        }
+        append_frame(stream, payload);
+        sent.push_back({payload});
+        if (!junk) continue;
+        switch (random_int(0, 5)) {
+        case 0: // junk, 0xFF often
+            for (int index = random_int(1, 20); index > 0; --index) stream.push_back(random_int(0, 1) ? 0xFF : (u8)random_int(0, 255));
+            break;
+        case 1: // bad ID
+            stream.insert(stream.end(), {0xFF, 0xFF, (u8)random_int(2, 0xFE)});
+            break;
+        case 2: // empty or too long payload
+            stream.insert(stream.end(), {0xFF, 0xFF, 0x01, (u8)(random_int(0, 1) ? random_int(0, 1) : random_int(protocol_parser::MAX_PAYLOAD_LENGTH, 255))});
+            break;
+        case 3: // repeated headers
+            stream.insert(stream.end(), {0xFF, 0xFF, 0xFF, 0xFF});
+            break;
+        default:
+            break;
+        }
+    }
+    return stream;
+}
+
+// flip, drop and repeat bytes
+static std::vector<u8> corrupt(std::vector<u8> const & stream, double probability)
+{
+    std::uniform_real_distribution<double> draw(0.0, 1.0);
+    std::vector<u8> corrupted;
+    corrupted.reserve(stream.size() + stream.size() / 8);
+    for (u8 const value : stream) {
+        if (draw(random_engine) >= probability) {
+            corrupted.push_back(value);
+            continue;
+        }
+        switch (random_int(0, 2)) {
+        case 0: corrupted.push_back((u8)random_int(0, 255)); break;
+        case 1: break;
+        default: corrupted.push_back(value); corrupted.push_back(value); break;
+        }
+    }
+    return corrupted;
+}
+
+// - read_size : 0 for random read sizes
+static std::vector<size_t> read_sizes(size_t stream_size, size_t read_size)
+{
+    std::vector<size_t> sizes;
+    for (size_t offset = 0; offset < stream_size;) {
+        size_t const size {std::min(stream_size - offset, read_size ? read_size : (size_t)random_int(1, 300))};
+        sizes.push_back(size);
+        offset += size;
+    }
+    return sizes;
+}
+
+static parse_result run_interpreter(std::vector<u8> const & stream)
+{
+    parse_result result;
+    protocol_interpreter_handler handler;
+    for (u8 const value : stream) {
+        if (!protocol_interpreter(value, handler)) continue;
+        result.frames.push_back({std::vector<u8>(handler.payload_buffer, handler.payload_buffer + handler.payload_length - 1)});
+    }
+    memcpy(result.counter, handler.f_monitor.counter, sizeof(result.counter));
+    result.checksum_errors = result.counter[mini_pupper::frame_error_rate_monitor::CHECKSUM_ERROR];
+    return result;
+}
+
+static parse_result run_parser(std::vector<u8> const & stream, std::vector<size_t> const & sizes)
+{
+    parse_result result;
+    protocol_parser parser;
+    size_t offset {0};
+    for (size_t const size : sizes) {
+        u8 const * data {stream.data() + offset};
+        size_t length {size};
+        offset += size;
+        protocol_frame frame;
+        protocol_parser_status status;
+        while ((status = parser.parse(data, length, frame)) != PROTOCOL_NEED_DATA) {
+            if (status == PROTOCOL_CHECKSUM_ERROR) {
+                ++result.checksum_errors;
+                continue;
+            }
+            result.frames.push_back({std::vector<u8>(frame.payload, frame.payload + frame.payload_length - 1)});
+        }
+    }
+    memcpy(result.counter, parser.f_monitor.counter, sizeof(result.counter));
+    return result;
+}
+
+static bool same_frames(std::vector<frame_record> const & a, std::vector<frame_record> const & b)
+{
+    if (a.size() != b.size()) return false;
+    for (size_t index = 0; index < a.size(); ++index) {
+        if (a[index].payload != b[index].payload) return false;
+    }
+    return true;
+}
+
+static void test_parsers()
+{
+    for (bool const junk : {false, true}) {
+        std::vector<frame_record> sent;
+        std::vector<u8> const clean {make_stream(2000, junk, sent)};
+        for (double const probability : {0.0, 0.0001, 0.001, 0.01, 0.1}) {
+            std::vector<u8> const stream {probability > 0.0 ? corrupt(clean, probability) : clean};
+            parse_result const reference {run_interpreter(stream)};
+            // random junk may start a frame that swallows the next ones
+            if (probability == 0.0 && !junk) {
+                CHECK(same_frames(reference.frames, sent));
+                CHECK(reference.counter[mini_pupper::frame_error_rate_monitor::CHECKSUM_ERROR] == 0);
+                CHECK(reference.counter[mini_pupper::frame_error_rate_monitor::SYNTAX_ERROR] == 0);
+            }
+            for (size_t const read_size : {1, 2, 3, 7, 64, 256, 1024, 0}) {
+                parse_result const result {run_parser(stream, read_sizes(stream.size(), read_size))};
+                bool const ok {same_frames(result.frames, reference.frames)
+                    && !memcmp(result.counter, reference.counter, sizeof(result.counter))
+                    && result.checksum_errors == reference.checksum_errors};
+                if (!ok) printf("junk %d, corruption %g, read size %zu : %zu/%zu frames\n",
+                    junk, probability, read_size, result.frames.size(), reference.frames.size());
+                CHECK(ok);
+            }
+        }
+    }
+}
+
+int main()
+{
+    test_acknowledge_round_trip();
+    test_packed_saturation();
+    test_parsers();
+    printf("%d checks, %d failed\n", checks, failures);
+    exit(failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,474 @@
+/* Authors :
+ * - Hdumcke
+ * - Pat92fr
+ */
+
+/* esp32-proxy socket benchmark
+ *
+ *  Sweep mode (default) :
+ *   Connects N clients to a running esp32-proxy and let each of them issue
+ *   INST_GETPOS requests back-to-back for a fixed duration.
+ *   The number of clients is swept from 1 to --max-clients (powers of two),
+ *   and for each step the aggregated throughput and round-trip latency
+ *   percentiles are reported.
+ *
+ *  Mix mode (one or more --client) :
+ *   Runs groups of simulated clients together for a fixed duration, each group
+ *   with its own request pattern :
+ *
+ *    writer:<count>:<rate_hz>            INST_SETPOS_GETALL at a fixed rate (gait controller)
+ *    reader:<count>:<rate_hz>            INST_GETALL at a fixed rate
+ *    debug:<count>:<rate_hz>:<burst>     bursts of <burst> back-to-back small requests
+ *                                        (GETPOS, GETLOAD, GETIMU, GETPOWER, GETSCHED, GETSTATS)
+ *    subscriber:<count>:<decimation>     INST_SUBSCRIBE, then receives INST_FEEDBACK pushes
+ *    flood:<count>                       INST_GETPOS back-to-back
+ *
+ *   For each group the throughput, the request latency percentiles, the late periods
+ *   of fixed-rate clients, and the staleness of the feedback received (age of the ESP32
+ *   acknowledge, from its proxy timestamp to its reception by the client) are reported.
+ *   The proxy link statistics (INST_GETSTATS) are printed at the end, so runs against
+ *   the robot and against esp32-emulator can be compared.
+ *
+ *   Typical robot mix :
+ *    esp32-proxy-bench --client writer:1:500 --client reader:4:100 --client debug:2:2:32
+ *
+ *  Usage : esp32-proxy-bench [--duration <seconds>] [--max-clients <N>] [--client <spec>]...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "esp32-proxy.h"
+#include "mini_pupper_types.h"
+
+static int64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_until_ns(int64_t deadline_ns)
+{
+    struct timespec ts;
+    ts.tv_sec = deadline_ns / 1000000000LL;
+    ts.tv_nsec = deadline_ns % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static int connect_proxy()
+{
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    struct sockaddr_un name;
+    memset(&name, 0, sizeof(name));
+    name.sun_family = AF_UNIX;
+    strncpy(name.sun_path, SOCKET_NAME, sizeof(name.sun_path) - 1);
+    if (connect(fd, (const struct sockaddr *) &name, sizeof(name)) == -1) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Send a request and wait for the reply with the same instruction
+static bool request(int fd, u8 const * r_buffer, u8 * s_buffer, size_t s_size)
+{
+    if (send(fd, r_buffer, r_buffer[0], MSG_NOSIGNAL) != r_buffer[0]) return false;
+    ssize_t length = recv(fd, s_buffer, s_size, 0);
+    return length >= 2 && s_buffer[0] == length && s_buffer[1] == r_buffer[1];
+}
+
+enum client_kind
+{
+    WRITER,
+    READER,
+    DEBUG,
+    SUBSCRIBER,
+    FLOOD
+};
+
+// One group of simulated clients (--client)
+struct client_spec
+{
+    std::string name;
+    client_kind kind {FLOOD};
+    int count {1};
+    double rate_hz {0.0};   // writer, reader, debug
+    int parameter {0};      // debug : burst size, subscriber : decimation
+};
+
+// Result of one benchmark client
+struct client_result
+{
+    std::vector<int64_t> latency_ns;
+    std::vector<int64_t> staleness_ns;
+    uint64_t late_periods {0};
+    bool failed {false};
+};
+
+static void record_staleness(u8 const * s_buffer, client_result * result)
+{
+    feedback_packet packet;
+    memcpy(&packet, &s_buffer[2], sizeof(feedback_packet));
+    if (packet.generation == 0) return; // no ESP32 feedback yet
+    result->staleness_ns.push_back(monotonic_ns() - packet.timestamp_ns);
+}
+
+static void client_task(client_spec const * spec, std::atomic<bool> const * start, std::atomic<bool> const * stop, client_result * result)
+{
+    int fd = connect_proxy();
+    if (fd == -1) {
+        result->failed = true;
+        return;
+    }
+    result->latency_ns.reserve(1<<16);
+
+    u8 r_buffer[256];
+    u8 s_buffer[256];
+
+    // subscribers wait for pushes : wake up periodically to check the end of the run
+    if (spec->kind == SUBSCRIBER) {
+        struct timeval timeout {0, 100000};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        u16 const decimation = (u16)spec->parameter;
+        r_buffer[0] = 2 + sizeof(u16);
+        r_buffer[1] = INST_SUBSCRIBE;
+        memcpy(&r_buffer[2], &decimation, sizeof(u16));
+        if (!request(fd, r_buffer, s_buffer, sizeof(s_buffer))) {
+            result->failed = true;
+            close(fd);
+            return;
+        }
+    }
+
+    while (!start->load()) std::this_thread::yield();
+
+    int64_t const period_ns = spec->rate_hz > 0.0 ? (int64_t)(1e9 / spec->rate_hz) : 0;
+    int64_t deadline_ns = monotonic_ns();
+    u8 const debug_instructions[] {INST_GETPOS, INST_GETLOAD, INST_GETIMU, INST_GETPOWER, INST_GETSCHED, INST_GETSTATS};
+    size_t debug_index {0};
+    uint64_t tick {0};
+
+    while (!stop->load()) {
+        // fixed-rate clients : wait for the next period, skip the periods already missed
+        if (period_ns > 0) {
+            sleep_until_ns(deadline_ns);
+            deadline_ns += period_ns;
+            int64_t const now_ns = monotonic_ns();
+            if (now_ns > deadline_ns) {
+                int64_t const missed = (now_ns - deadline_ns) / period_ns + 1;
+                result->late_periods += missed;
+                deadline_ns += missed * period_ns;
+            }
+        }
+
+        switch (spec->kind) {
+        case WRITER:
+            {
+                // slow sine wave around the neutral position
+                parameters_control_instruction_format control;
+                for (size_t index = 0; index < 12; ++index) {
+                    control.torque_enable[index] = 1;
+                    control.goal_position[index] = (u16)(512.0 + 100.0 * sin((double)tick * 0.01));
+                }
+                r_buffer[0] = 2 + sizeof(parameters_control_instruction_format);
+                r_buffer[1] = INST_SETPOS_GETALL;
+                memcpy(&r_buffer[2], &control, sizeof(parameters_control_instruction_format));
+                int64_t const t0 = monotonic_ns();
+                if (!request(fd, r_buffer, s_buffer, sizeof(s_buffer))) {
+                    result->failed = true;
+                    break;
+                }
+                result->latency_ns.push_back(monotonic_ns() - t0);
+                record_staleness(s_buffer, result);
+            }
+            break;
+
+        case READER:
+            {
+                r_buffer[0] = 2;
+                r_buffer[1] = INST_GETALL;
+                int64_t const t0 = monotonic_ns();
+                if (!request(fd, r_buffer, s_buffer, sizeof(s_buffer))) {
+                    result->failed = true;
+                    break;
+                }
+                result->latency_ns.push_back(monotonic_ns() - t0);
+                record_staleness(s_buffer, result);
+            }
+            break;
+
+        case DEBUG:
+        case FLOOD:
+            {
+                int const burst = spec->kind == DEBUG ? spec->parameter : 1;
+                for (int index = 0; index < burst && !result->failed; ++index) {
+                    r_buffer[0] = 2;
+                    r_buffer[1] = spec->kind == DEBUG ? debug_instructions[debug_index++ % sizeof(debug_instructions)] : INST_GETPOS;
+                    int64_t const t0 = monotonic_ns();
+                    if (!request(fd, r_buffer, s_buffer, sizeof(s_buffer))) {
+                        result->failed = true;
+                        break;
+                    }
+                    result->latency_ns.push_back(monotonic_ns() - t0);
+                }
+            }
+            break;
+
+        case SUBSCRIBER:
+            {
+                ssize_t length = recv(fd, s_buffer, sizeof(s_buffer), 0);
+                if (length == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) break;
+                if (length != 2 + (ssize_t)sizeof(feedback_packet) || s_buffer[1] != INST_FEEDBACK) {
+                    result->failed = true;
+                    break;
+                }
+                record_staleness(s_buffer, result);
+            }
+            break;
+        }
+        if (result->failed) break;
+        ++tick;
+    }
+    close(fd);
+}
+
+static double percentile_us(std::vector<int64_t> const & sorted, double p)
+{
+    if (sorted.empty()) return 0.0;
+    size_t index = (size_t)(p * (double)(sorted.size() - 1) + 0.5);
+    return (double)sorted[index] / 1000.0;
+}
+
+// Parse <kind>[:<count>[:<rate_hz|decimation>[:<burst>]]]
+static bool parse_client_spec(char const * text, client_spec & spec)
+{
+    spec.name = text;
+    std::string kind = spec.name.substr(0, spec.name.find(':'));
+    std::vector<double> values;
+    for (size_t position = spec.name.find(':'); position != std::string::npos; position = spec.name.find(':', position + 1)) {
+        values.push_back(atof(spec.name.c_str() + position + 1));
+    }
+    if (values.size() > 3) return false;
+    if (values.size() > 0) spec.count = (int)values[0];
+    if (kind == "writer" || kind == "reader" || kind == "debug") {
+        spec.kind = kind == "writer" ? WRITER : kind == "reader" ? READER : DEBUG;
+        spec.rate_hz = values.size() > 1 ? values[1] : (kind == "writer" ? 500.0 : kind == "reader" ? 100.0 : 1.0);
+        spec.parameter = values.size() > 2 ? (int)values[2] : 32;
+        if (spec.rate_hz <= 0.0 || spec.parameter < 1) return false;
+    }
+    else if (kind == "subscriber") {
+        spec.kind = SUBSCRIBER;
+        spec.parameter = values.size() > 1 ? (int)values[1] : 1;
+        if (spec.parameter < 1 || spec.parameter > 0xFFFF) return false;
+    }
+    else if (kind == "flood") {
+        spec.kind = FLOOD;
+    }
+    else {
+        return false;
+    }
+    return spec.count >= 1;
+}
+
+// Run all clients of all groups together, return the elapsed time
+static int64_t run_clients(std::vector<client_spec> const & specs, double duration_s, std::vector<std::vector<client_result>> & results)
+{
+    std::atomic<bool> start {false};
+    std::atomic<bool> stop {false};
+    std::vector<std::thread> threads;
+    results.assign(specs.size(), std::vector<client_result>());
+    for (size_t group = 0; group < specs.size(); ++group) {
+        results[group].resize(specs[group].count);
+    }
+    for (size_t group = 0; group < specs.size(); ++group) {
+        for (int index = 0; index < specs[group].count; ++index) {
+            threads.push_back(std::thread(client_task, &specs[group], &start, &stop, &results[group][index]));
+        }
+    }
+
+    int64_t const t0 = monotonic_ns();
+    start = true;
+    usleep((useconds_t)(duration_s * 1000000.0));
+    stop = true;
+    for (auto & thread : threads) thread.join();
+    int64_t const elapsed_ns = monotonic_ns() - t0;
+
+    for (auto const & group : results) {
+        for (auto const & result : group) {
+            if (result.failed) {
+                printf("client failure, is esp32-proxy running?\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    return elapsed_ns;
+}
+
+static void print_link_stats()
+{
+    int fd = connect_proxy();
+    if (fd == -1) return;
+    u8 const r_buffer[2] {2, INST_GETSTATS};
+    u8 s_buffer[256];
+    if (request(fd, r_buffer, s_buffer, sizeof(s_buffer)) && s_buffer[0] == 2 + sizeof(link_stats_summary)) {
+        link_stats_summary summary;
+        memcpy(&summary, &s_buffer[2], sizeof(link_stats_summary));
+        printf("link: frames %llu checksum errors %llu syntax errors %llu time-outs %llu rtt(us) p50 %.1f p99 %.1f p999 %.1f max %.1f\n",
+            (unsigned long long)summary.frames_sent,
+            (unsigned long long)summary.checksum_errors,
+            (unsigned long long)summary.syntax_errors,
+            (unsigned long long)summary.timeouts,
+            summary.rtt_p50_ns / 1000.0,
+            summary.rtt_p99_ns / 1000.0,
+            summary.rtt_p999_ns / 1000.0,
+            summary.rtt_max_ns / 1000.0
+        );
+    }
+    close(fd);
+}
+
+static void run_sweep(double duration_s, int max_clients)
+{
+    printf("%8s %12s %10s %10s %10s %10s\n", "clients", "req/s", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+    for (int client_count = 1; client_count <= max_clients; client_count *= 2) {
+        std::vector<client_spec> specs(1);
+        specs[0].kind = FLOOD;
+        specs[0].count = client_count;
+        std::vector<std::vector<client_result>> results;
+        int64_t const elapsed_ns = run_clients(specs, duration_s, results);
+
+        std::vector<int64_t> latency_ns;
+        for (auto & result : results[0]) {
+            latency_ns.insert(latency_ns.end(), result.latency_ns.begin(), result.latency_ns.end());
+        }
+        std::sort(latency_ns.begin(), latency_ns.end());
+
+        printf("%8d %12.0f %10.1f %10.1f %10.1f %10.1f\n",
+            client_count,
+            (double)latency_ns.size() * 1e9 / (double)elapsed_ns,
+            percentile_us(latency_ns, 0.50),
+            percentile_us(latency_ns, 0.99),
+            percentile_us(latency_ns, 0.999),
+            latency_ns.empty() ? 0.0 : (double)latency_ns.back() / 1000.0
+        );
+    }
+}
+
+static void run_mix(std::vector<client_spec> const & specs, double duration_s)
+{
+    std::vector<std::vector<client_result>> results;
+    int64_t const elapsed_ns = run_clients(specs, duration_s, results);
+
+    printf("%-24s %10s %10s %10s %10s %10s %8s %12s %12s %12s\n",
+        "clients", "req/s", "p50(us)", "p99(us)", "p999(us)", "max(us)", "late", "stale50(us)", "stale99(us)", "stalemax(us)");
+    for (size_t group = 0; group < specs.size(); ++group) {
+        std::vector<int64_t> latency_ns;
+        std::vector<int64_t> staleness_ns;
+        uint64_t late_periods {0};
+        for (auto & result : results[group]) {
+            latency_ns.insert(latency_ns.end(), result.latency_ns.begin(), result.latency_ns.end());
+            staleness_ns.insert(staleness_ns.end(), result.staleness_ns.begin(), result.staleness_ns.end());
+            late_periods += result.late_periods;
+        }
+        std::sort(latency_ns.begin(), latency_ns.end());
+        std::sort(staleness_ns.begin(), staleness_ns.end());
+
+        // subscribers have no request : their throughput is the count of pushes received
+        size_t const events = specs[group].kind == SUBSCRIBER ? staleness_ns.size() : latency_ns.size();
+        printf("%-24s %10.0f %10.1f %10.1f %10.1f %10.1f %8llu %12.1f %12.1f %12.1f\n",
+            specs[group].name.c_str(),
+            (double)events * 1e9 / (double)elapsed_ns,
+            percentile_us(latency_ns, 0.50),
+            percentile_us(latency_ns, 0.99),
+            percentile_us(latency_ns, 0.999),
+            latency_ns.empty() ? 0.0 : (double)latency_ns.back() / 1000.0,
+            (unsigned long long)late_periods,
+            percentile_us(staleness_ns, 0.50),
+            percentile_us(staleness_ns, 0.99),
+            staleness_ns.empty() ? 0.0 : (double)staleness_ns.back() / 1000.0
+        );
+    }
+}
+
+static void usage(char const * name)
+{
+    printf("usage: %s [options]\n", name);
+    printf("  --duration <seconds>   duration of each run, default is 2\n");
+    printf("  --max-clients <N>      sweep mode : maximum number of GETPOS clients, default is 64\n");
+    printf("  --client <spec>        mix mode : add a group of clients (repeatable)\n");
+    printf("                           writer:<count>:<rate_hz>          SETPOS_GETALL at a fixed rate\n");
+    printf("                           reader:<count>:<rate_hz>          GETALL at a fixed rate\n");
+    printf("                           debug:<count>:<rate_hz>:<burst>   bursts of small requests\n");
+    printf("                           subscriber:<count>:<decimation>   feedback pushes\n");
+    printf("                           flood:<count>                     GETPOS back-to-back\n");
+}
+
+int main(int argc, char *argv[])
+{
+    double duration_s {2.0};
+    int max_clients {64};
+    std::vector<client_spec> specs;
+
+    static struct option const long_options[] = {
+        {"duration",    required_argument, 0, 'd'},
+        {"max-clients", required_argument, 0, 'n'},
+        {"client",      required_argument, 0, 'c'},
+        {"help",        no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+    for (;;) {
+        int c = getopt_long(argc, argv, "d:n:c:h", long_options, NULL);
+        if (c == -1) break;
+        switch (c) {
+        case 'd':
+            duration_s = atof(optarg);
+            break;
+        case 'n':
+            max_clients = atoi(optarg);
+            break;
+        case 'c':
+            {
+                client_spec spec;
+                if (!parse_client_spec(optarg, spec)) {
+                    printf("invalid client : %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                specs.push_back(spec);
+            }
+            break;
+        default:
+            usage(argv[0]);
+            exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if (duration_s <= 0.0 || max_clients < 1) {
+        printf("invalid arguments\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (specs.empty()) run_sweep(duration_s, max_clients);
+    else               run_mix(specs, duration_s);
+    print_link_stats();
+
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,162 @@
+/* Authors :
+ * - Hdumcke
+ * - Pat92fr
+ */
+
+#include "esp32-proxy-client.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+
+esp32_proxy_client::esp32_proxy_client()
+{
+}
+
+esp32_proxy_client::~esp32_proxy_client()
+{
+    close();
+}
+
+bool esp32_proxy_client::open()
+{
+    if(_control_block) return true;
+
+    int fd = shm_open(ESP32_PROXY_SHM_NAME, O_RDWR | O_CLOEXEC, 0);
+    if(fd == -1) return false;
+
+    // check size before mapping
+    struct stat st;
+    if(fstat(fd, &st) == -1 || (size_t)st.st_size != sizeof(setpoint_and_feedback_data))
+    {
+        ::close(fd);
+        return false;
+    }
+
+    void * address = mmap(NULL, sizeof(setpoint_and_feedback_data), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(address == MAP_FAILED) return false;
+
+    // check segment header
+    setpoint_and_feedback_data * control_block = reinterpret_cast<setpoint_and_feedback_data*>(address);
+    if( control_block->header.magic.load(std::memory_order_acquire) != ESP32_PROXY_SHM_MAGIC ||
+        control_block->header.version != ESP32_PROXY_SHM_VERSION ||
+        control_block->header.size != sizeof(setpoint_and_feedback_data) )
+    {
+        munmap(address, sizeof(setpoint_and_feedback_data));
+        return false;
+    }
+
+    _control_block = control_block;
+    return true;
+}
+
+void esp32_proxy_client::close()
+{
+    if(!_control_block) return;
+    release_lease();
+    if(_legacy_slot>=0) release_legacy_slot(_control_block, _legacy_slot);
+    _legacy_slot = -1;
+    munmap(_control_block, sizeof(setpoint_and_feedback_data));
+    _control_block = nullptr;
+}
+
+bool esp32_proxy_client::is_open() const
+{
+    return _control_block != nullptr;
+}
+
+void esp32_proxy_client::get_feedback(feedback_snapshot & snapshot) const
+{
+    _control_block->feedback.read(snapshot);
+}
+
+bool esp32_proxy_client::wait_feedback(feedback_snapshot & snapshot, uint64_t last_generation, int timeout_ms)
+{
+    // absolute deadline
+    int64_t const deadline_ns {timeout_ms<0 ? 0 : monotonic_time_ns() + (int64_t)timeout_ms*1000000LL};
+
+    _control_block->feedback_waiters.fetch_add(1);
+    bool fresh {false};
+    for(;;)
+    {
+        // read event counter before the snapshot, so that a generation published meanwhile wakes us up
+        uint32_t const event {_control_block->feedback_event.load()};
+        _control_block->feedback.read(snapshot);
+        if(snapshot.generation != last_generation)
+        {
+            fresh = true;
+            break;
+        }
+
+        // futex time-out is relative
+        struct timespec timeout;
+        struct timespec * timeout_ptr {NULL};
+        if(timeout_ms>=0)
+        {
+            int64_t const remaining_ns {deadline_ns - monotonic_time_ns()};
+            if(remaining_ns<=0) break;
+            timeout.tv_sec = remaining_ns / 1000000000LL;
+            timeout.tv_nsec = remaining_ns % 1000000000LL;
+            timeout_ptr = &timeout;
+        }
+        futex(&_control_block->feedback_event, FUTEX_WAIT, event, timeout_ptr);
+    }
+    _control_block->feedback_waiters.fetch_sub(1);
+    return fresh;
+}
+
+bool esp32_proxy_client::set_setpoint(parameters_control_instruction_format const & control)
+{
+    if(_lease_slot<0)
+    {
+        if(_legacy_slot<0) _legacy_slot = acquire_legacy_slot(_control_block);
+        if(_legacy_slot<0) return false;
+        _control_block->legacy_slots[_legacy_slot].setpoint.write(control);
+        _legacy_setpoint = control;
+        return true;
+    }
+    if(write_setpoint_slot(_control_block, _lease_slot, _lease_owner, control)) return true;
+    // the lease expired and its slot was taken over
+    _lease_slot = acquire_setpoint_slot(_control_block, _lease_priority, _lease_ms, _lease_owner);
+    return _lease_slot>=0 && write_setpoint_slot(_control_block, _lease_slot, _lease_owner, control);
+}
+
+void esp32_proxy_client::get_setpoint(parameters_control_instruction_format & control) const
+{
+    if(_legacy_slot>=0) control = _legacy_setpoint;
+    else _control_block->control.read(control);
+}
+
+link_stats const & esp32_proxy_client::get_link_stats() const
+{
+    return _control_block->link;
+}
+
+bool esp32_proxy_client::acquire_lease(uint8_t priority, uint16_t lease_ms)
+{
+    release_lease();
+    if(lease_ms==0) return false;
+    _lease_priority = priority;
+    _lease_ms = lease_ms;
+    _lease_slot = acquire_setpoint_slot(_control_block, priority, lease_ms, _lease_owner);
+    return _lease_slot>=0;
+}
+
+void esp32_proxy_client::release_lease()
+{
+    if(_lease_slot<0) return;
+    release_setpoint_slot(_control_block, _lease_slot, _lease_owner);
+    _lease_slot = -1;
+}
+
+int esp32_proxy_client::push_trajectory(trajectory_point const * points, size_t count, bool replace)
+{
+    if(_lease_slot<0) return 0;
+    int const queued { ::push_trajectory(_control_block, _lease_slot, _lease_owner, points, count, replace) };
+    if(queued>=0) return queued;
+    // the lease expired and its slot was taken over
+    _lease_slot = acquire_setpoint_slot(_control_block, _lease_priority, _lease_ms, _lease_owner);
+    return _lease_slot>=0 ? ::push_trajectory(_control_block, _lease_slot, _lease_owner, points, count, replace) : 0;
+}
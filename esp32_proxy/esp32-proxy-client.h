@@ -0,0 +1,80 @@
+/* Authors :
+ * - Hdumcke
+ * - Pat92fr
+ */
+#ifndef _esp32_proxy_client_H
+#define _esp32_proxy_client_H
+
+#include "esp32-proxy-control.h"
+
+/* Shared-memory client API
+ *
+ *  Maps the esp32-proxy control block (/dev/shm/esp32-proxy) into the calling process.
+ *  Feedback is read and setpoints are written in place, without any socket round trip.
+ *  The socket protocol (esp32-proxy.h) remains available for remote or legacy clients.
+ *  The segment is re-created when esp32-proxy restarts : clients have to open() it again.
+ *
+ *  Typical control loop :
+ *
+ *      esp32_proxy_client proxy;
+ *      if(!proxy.open()) exit(EXIT_FAILURE);
+ *      feedback_snapshot snapshot;
+ *      for(;;)
+ *      {
+ *          proxy.wait_feedback(snapshot, snapshot.generation, 100); // wake-up on each ESP32 acknowledge
+ *          ... compute setpoints from snapshot.feedback ...
+ *          proxy.set_setpoint(control);
+ *      }
+ */
+struct esp32_proxy_client
+{
+    esp32_proxy_client();
+    ~esp32_proxy_client();
+
+    // map the shared-memory segment, return false if esp32-proxy is not running or has another version
+    bool open();
+    void close();
+    bool is_open() const;
+
+    // copy the last feedback generation (never blocks)
+    void get_feedback(feedback_snapshot & snapshot) const;
+
+    // wait for a feedback generation newer than last_generation
+    // - return false on time-out (timeout_ms<0 waits forever)
+    bool wait_feedback(feedback_snapshot & snapshot, uint64_t last_generation, int timeout_ms = -1);
+
+    // setpoints sent to the ESP32 with the next CONTROL frame
+    // - with a lease, they go to the staging slot of this client, else to its legacy slot
+    //   (see esp32-proxy-control.h)
+    // - return false if the lease was lost and could not be acquired again, or if all legacy
+    //   slots are owned (setpoints dropped)
+    bool set_setpoint(parameters_control_instruction_format const & control);
+    // legacy setpoints : the last ones written without lease by this client, else the ones of the socket clients
+    void get_setpoint(parameters_control_instruction_format & control) const;
+
+    // setpoint lease : the highest priority live lease drives the ESP32
+    // - it stays live while set_setpoint is called more often than lease_ms
+    // - return false if all staging slots are owned by live leases
+    bool acquire_lease(uint8_t priority, uint16_t lease_ms);
+    void release_lease();
+
+    // queue future setpoints (requires a lease), sorted by target time (CLOCK_MONOTONIC)
+    // - replace discards the points already queued
+    // - return the count of points queued (the queue holds trajectory_queue::CAPACITY points)
+    int push_trajectory(trajectory_point const * points, size_t count, bool replace = false);
+
+    // live host serial link statistics (counters and round-trip time histogram)
+    link_stats const & get_link_stats() const;
+
+private:
+
+    setpoint_and_feedback_data * _control_block {nullptr};
+    int _legacy_slot {-1};
+    parameters_control_instruction_format _legacy_setpoint;
+    int _lease_slot {-1};
+    uint32_t _lease_owner {0};
+    uint8_t _lease_priority {0};
+    uint16_t _lease_ms {0};
+};
+
+#endif //_esp32_proxy_client_H
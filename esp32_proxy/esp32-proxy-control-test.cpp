@@ -0,0 +1,324 @@
+/* Authors :
+ * - Hdumcke
+ * - Pat92fr
+ */
+
+/* setpoint arbiter test
+ *
+ *  Runs the setpoint arbiter of the ESP32 task (esp32-proxy-control.h) against a control block
+ *  in process memory, with the CONTROL frame times given by the test :
+ *   - lease arbitration : priority, then the latest write, expiry, hold pose, legacy setpoints
+ *   - trajectories : interpolation at and between points, end of trajectory, replace
+ *   - queue entries : capacity, no reuse of the entries the ESP32 task may read, corrupt head
+ *
+ *  Exits with a non-zero status on any failed check.
+ *
+ *  Usage : esp32-proxy-control-test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include "esp32-proxy-control.h"
+
+static int checks {0};
+static int failures {0};
+
+static void check(bool ok, char const * what, int line)
+{
+    ++checks;
+    if (ok) return;
+    ++failures;
+    printf("line %d : %s FAILED\n", line, what);
+}
+#define CHECK(condition) check((condition), #condition, __LINE__)
+
+static int64_t const ms {1000000};
+
+static parameters_control_instruction_format pose(u16 position, u8 torque)
+{
+    parameters_control_instruction_format control;
+    for (auto & goal_position : control.goal_position) goal_position = position;
+    for (auto & torque_enable : control.torque_enable) torque_enable = torque;
+    return control;
+}
+
+static bool is_pose(parameters_control_instruction_format const & control, u16 position, u8 torque)
+{
+    parameters_control_instruction_format const expected {pose(position, torque)};
+    return !memcmp(&control, &expected, sizeof(control));
+}
+
+// select the setpoints of a CONTROL frame, false if it takes more than a second
+static bool select_in_time(setpoint_arbiter & arbiter, setpoint_and_feedback_data * control_block, int64_t now_ns, parameters_control_instruction_format & control)
+{
+    std::atomic<bool> done {false};
+    std::thread frame([&]() {
+        arbiter.select(control_block, nullptr, now_ns, control);
+        done.store(true);
+    });
+    int64_t const start_ns {monotonic_time_ns()};
+    while (!done.load() && monotonic_time_ns()-start_ns < 1000*ms) sched_yield();
+    if (!done.load()) {
+        // the frame may never end : give up the test
+        frame.detach();
+        printf("CONTROL frame selection stuck\n");
+        fflush(stdout);
+        _exit(EXIT_FAILURE);
+    }
+    frame.join();
+    return true;
+}
+
+// a control block as esp32-proxy sets it up : neutral legacy setpoints, torque enabled
+static std::unique_ptr<setpoint_and_feedback_data> new_control_block()
+{
+    std::unique_ptr<setpoint_and_feedback_data> control_block {new setpoint_and_feedback_data()};
+    control_block->control.write(pose(512, 1));
+    return control_block;
+}
+
+static void test_arbitration()
+{
+    auto control_block = new_control_block();
+    setpoint_arbiter arbiter;
+    parameters_control_instruction_format control;
+    u16 present_position[12];
+    for (size_t index = 0; index < 12; ++index) present_position[index] = 400 + index;
+
+    int64_t const t0 {monotonic_time_ns()};
+    arbiter.select(control_block.get(), nullptr, t0, control);
+    CHECK(is_pose(control, 512, 1));
+    CHECK(control_block->setpoint_source.load() == SETPOINT_SOURCE_LEGACY);
+
+    // acquired leases are not selected before their first write
+    uint32_t low_owner {0};
+    uint32_t high_owner {0};
+    int const low {acquire_setpoint_slot(control_block.get(), 1, 1000, low_owner)};
+    int const high {acquire_setpoint_slot(control_block.get(), 2, 100, high_owner)};
+    CHECK(low >= 0 && high >= 0 && low != high);
+    arbiter.select(control_block.get(), present_position, t0, control);
+    CHECK(is_pose(control, 512, 1));
+    CHECK(control_block->setpoint_source.load() == SETPOINT_SOURCE_LEGACY);
+
+    // the highest priority wins, whatever the write order
+    CHECK(write_setpoint_slot(control_block.get(), low, low_owner, pose(100, 1)));
+    arbiter.select(control_block.get(), present_position, t0, control);
+    CHECK(is_pose(control, 100, 1));
+    CHECK(control_block->setpoint_source.load() == low);
+    CHECK(write_setpoint_slot(control_block.get(), high, high_owner, pose(200, 1)));
+    CHECK(write_setpoint_slot(control_block.get(), low, low_owner, pose(101, 1)));
+    arbiter.select(control_block.get(), present_position, t0, control);
+    CHECK(is_pose(control, 200, 1));
+    CHECK(control_block->setpoint_source.load() == high);
+
+    // same priority : the latest write wins
+    uint32_t peer_owner {0};
+    int const peer {acquire_setpoint_slot(control_block.get(), 2, 100, peer_owner)};
+    CHECK(peer >= 0);
+    CHECK(write_setpoint_slot(control_block.get(), peer, peer_owner, pose(300, 1)));
+    arbiter.select(control_block.get(), present_position, t0, control);
+    CHECK(is_pose(control, 300, 1));
+    CHECK(control_block->setpoint_source.load() == peer);
+
+    // a released lease, or a lost one, stages nothing
+    release_setpoint_slot(control_block.get(), peer, peer_owner);
+    CHECK(!write_setpoint_slot(control_block.get(), peer, peer_owner, pose(301, 1)));
+    arbiter.select(control_block.get(), present_position, t0, control);
+    CHECK(is_pose(control, 200, 1));
+
+    // an expired lease gives way to the next live lease
+    arbiter.select(control_block.get(), present_position, t0+200*ms, control);
+    CHECK(is_pose(control, 101, 1));
+    CHECK(control_block->setpoint_source.load() == low);
+
+    // no live lease : the present pose holds, not the legacy setpoints written before
+    control_block->control.write(pose(600, 1));
+    arbiter.select(control_block.get(), present_position, t0+2000*ms, control);
+    CHECK(!memcmp(control.goal_position, present_position, sizeof(present_position)));
+    CHECK(!memcmp(control.torque_enable, pose(0, 1).torque_enable, sizeof(control.torque_enable)));
+    CHECK(control_block->setpoint_source.load() == SETPOINT_SOURCE_HOLD);
+    arbiter.select(control_block.get(), present_position, t0+2010*ms, control);
+    CHECK(!memcmp(control.goal_position, present_position, sizeof(present_position)));
+    CHECK(control_block->setpoint_source.load() == SETPOINT_SOURCE_HOLD);
+
+    // until a client without lease writes setpoints
+    control_block->control.write(pose(700, 0));
+    arbiter.select(control_block.get(), present_position, t0+2020*ms, control);
+    CHECK(is_pose(control, 700, 0));
+    CHECK(control_block->setpoint_source.load() == SETPOINT_SOURCE_LEGACY);
+
+    // the legacy setpoints written last, by esp32-proxy or in a legacy slot
+    int const legacy {acquire_legacy_slot(control_block.get())};
+    CHECK(legacy >= 0);
+    control_block->legacy_slots[legacy].setpoint.write(pose(710, 1));
+    arbiter.select(control_block.get(), present_position, t0+2030*ms, control);
+    CHECK(is_pose(control, 710, 1));
+    control_block->control.write(pose(720, 1));
+    arbiter.select(control_block.get(), present_position, t0+2040*ms, control);
+    CHECK(is_pose(control, 720, 1));
+    release_legacy_slot(control_block.get(), legacy);
+}
+
+static void test_trajectory()
+{
+    auto control_block = new_control_block();
+    setpoint_arbiter arbiter;
+    parameters_control_instruction_format control;
+
+    uint32_t owner {0};
+    int const slot {acquire_setpoint_slot(control_block.get(), 1, 2000, owner)};
+    CHECK(slot >= 0);
+    CHECK(write_setpoint_slot(control_block.get(), slot, owner, pose(100, 1)));
+
+    int64_t const t0 {monotonic_time_ns()};
+    trajectory_point const points[] {
+        {t0+100*ms, pose(200, 1)},
+        {t0+200*ms, pose(400, 0)},
+    };
+    CHECK(push_trajectory(control_block.get(), slot, owner, points, 2, false) == 2);
+
+    // from the staged setpoints, each point reached at its target time, torque switches as the next point
+    arbiter.select(control_block.get(), nullptr, t0, control);
+    CHECK(is_pose(control, 100, 1));
+    CHECK(control_block->setpoint_source.load() == slot);
+    arbiter.select(control_block.get(), nullptr, t0+50*ms, control);
+    CHECK(is_pose(control, 150, 1));
+    arbiter.select(control_block.get(), nullptr, t0+100*ms, control);
+    CHECK(is_pose(control, 200, 0));
+    arbiter.select(control_block.get(), nullptr, t0+150*ms, control);
+    CHECK(is_pose(control, 300, 0));
+    arbiter.select(control_block.get(), nullptr, t0+200*ms, control);
+    CHECK(is_pose(control, 400, 0));
+
+    // end of the trajectory : the last point holds
+    arbiter.select(control_block.get(), nullptr, t0+300*ms, control);
+    CHECK(is_pose(control, 400, 0));
+    CHECK(control_block->setpoint_source.load() == slot);
+
+    // replace after the end : the motion continues from the last point
+    trajectory_point const after_end[] {{t0+500*ms, pose(600, 1)}};
+    CHECK(push_trajectory(control_block.get(), slot, owner, after_end, 1, true) == 1);
+    arbiter.select(control_block.get(), nullptr, t0+400*ms, control);
+    CHECK(is_pose(control, 500, 1));
+    arbiter.select(control_block.get(), nullptr, t0+500*ms, control);
+    CHECK(is_pose(control, 600, 1));
+    arbiter.select(control_block.get(), nullptr, t0+600*ms, control);
+    CHECK(is_pose(control, 600, 1));
+
+    // replace in the middle : the queued points are discarded, from the present setpoints
+    trajectory_point const queued[] {
+        {t0+800*ms, pose(800, 1)},
+        {t0+900*ms, pose(1000, 1)},
+    };
+    CHECK(push_trajectory(control_block.get(), slot, owner, queued, 2, false) == 2);
+    arbiter.select(control_block.get(), nullptr, t0+700*ms, control);
+    CHECK(is_pose(control, 700, 1));
+    trajectory_point const replacement[] {{t0+1000*ms, pose(100, 1)}};
+    CHECK(push_trajectory(control_block.get(), slot, owner, replacement, 1, true) == 1);
+    arbiter.select(control_block.get(), nullptr, t0+800*ms, control);
+    CHECK(is_pose(control, 500, 1));
+    arbiter.select(control_block.get(), nullptr, t0+1000*ms, control);
+    CHECK(is_pose(control, 100, 1));
+
+    // points not after the last queued point are dropped
+    trajectory_point const late[] {{t0+900*ms, pose(900, 1)}};
+    CHECK(push_trajectory(control_block.get(), slot, owner, late, 1, false) == 0);
+
+    // an empty replace after the end : the last point holds
+    CHECK(push_trajectory(control_block.get(), slot, owner, nullptr, 0, true) == 0);
+    arbiter.select(control_block.get(), nullptr, t0+1100*ms, control);
+    CHECK(is_pose(control, 100, 1));
+
+    // immediate setpoints cancel the queued trajectory
+    trajectory_point const cancelled[] {{t0+1300*ms, pose(300, 1)}};
+    CHECK(push_trajectory(control_block.get(), slot, owner, cancelled, 1, false) == 1);
+    CHECK(write_setpoint_slot(control_block.get(), slot, owner, pose(250, 0)));
+    arbiter.select(control_block.get(), nullptr, t0+1200*ms, control);
+    CHECK(is_pose(control, 250, 0));
+
+    // the lease stays live until the last queued point, plus its duration
+    int64_t const t1 {monotonic_time_ns()};
+    trajectory_point const far[] {{t1+5000*ms, pose(900, 1)}};
+    CHECK(push_trajectory(control_block.get(), slot, owner, far, 1, false) == 1);
+    arbiter.select(control_block.get(), nullptr, t1+6500*ms, control);
+    CHECK(control_block->setpoint_source.load() == slot);
+    arbiter.select(control_block.get(), nullptr, t1+7500*ms, control);
+    CHECK(control_block->setpoint_source.load() == SETPOINT_SOURCE_HOLD);
+}
+
+static void test_queue_entries()
+{
+    uint32_t const capacity {trajectory_queue::CAPACITY};
+    auto control_block = new_control_block();
+    setpoint_arbiter arbiter;
+    parameters_control_instruction_format control;
+
+    uint32_t owner {0};
+    int const slot {acquire_setpoint_slot(control_block.get(), 1, 10000, owner)};
+    CHECK(slot >= 0);
+    CHECK(write_setpoint_slot(control_block.get(), slot, owner, pose(0, 1)));
+    trajectory_queue & queue = control_block->setpoint_slots[slot].trajectory;
+
+    // one entry is kept for the last point consumed : CAPACITY-1 points at most
+    int64_t const t0 {monotonic_time_ns()};
+    std::unique_ptr<trajectory_point[]> points {new trajectory_point[3*capacity]};
+    for (uint32_t index = 0; index < 3*capacity; ++index) points[index] = {t0+(index+1)*ms, pose((u16)(index+1), 1)};
+    CHECK(push_trajectory(control_block.get(), slot, owner, &points[0], capacity+10, false) == (int)capacity-1);
+    CHECK(push_trajectory(control_block.get(), slot, owner, &points[capacity+10], 1, false) == 0);
+
+    // the entries of the points consumed are reused, never the entries from the last consumed on
+    std::unique_ptr<trajectory_point[]> entries {new trajectory_point[capacity]};
+    memcpy(entries.get(), queue.points, capacity*sizeof(trajectory_point));
+    arbiter.select(control_block.get(), nullptr, t0+10*ms+ms/2, control);
+    CHECK(queue.tail.load() == 10);
+    CHECK(push_trajectory(control_block.get(), slot, owner, &points[capacity-1], 20, false) == 10);
+    bool kept {true};
+    for (uint64_t index = 9; index < capacity-1; ++index) kept = kept && !memcmp(&queue.points[index], &entries[index], sizeof(trajectory_point));
+    CHECK(kept);
+
+    // the end of the trajectory holds its last point : its entry is not reused by the next push
+    arbiter.select(control_block.get(), nullptr, t0+1000*ms, control);
+    CHECK(is_pose(control, capacity+9, 1));
+    uint64_t const head {queue.head.load()};
+    trajectory_point const last {queue.points[(head-1)%capacity]};
+    int64_t const t1 {t0+1000*ms};
+    for (uint32_t index = 0; index < capacity; ++index) points[index] = {t1+(index+1)*ms, pose(1000, 1)};
+    CHECK(push_trajectory(control_block.get(), slot, owner, &points[0], capacity, false) == (int)capacity-1);
+    CHECK(!memcmp(&queue.points[(head-1)%capacity], &last, sizeof(last)));
+
+    // flushed entries are reused once the ESP32 task moved past them, not before, selected slot or not
+    uint32_t other_owner {0};
+    int const other {acquire_setpoint_slot(control_block.get(), 2, 10000, other_owner)};
+    CHECK(other >= 0);
+    CHECK(write_setpoint_slot(control_block.get(), other, other_owner, pose(30, 1)));
+    CHECK(write_setpoint_slot(control_block.get(), slot, owner, pose(20, 1)));
+    CHECK(push_trajectory(control_block.get(), slot, owner, &points[0], 1, false) == 0);
+    arbiter.select(control_block.get(), nullptr, t1, control);
+    CHECK(is_pose(control, 30, 1));
+    for (uint32_t index = 0; index < capacity; ++index) points[index] = {t1+(index+1)*ms, pose(2000, 1)};
+    CHECK(push_trajectory(control_block.get(), slot, owner, &points[0], capacity, false) == (int)capacity-1);
+    release_setpoint_slot(control_block.get(), other, other_owner);
+
+    // a corrupt head written by a client, all the points due : the frame is still built at once
+    queue.head.store(UINT64_MAX);
+    CHECK(select_in_time(arbiter, control_block.get(), t1+5000*ms, control));
+    queue.head.store(queue.tail.load()+1000000000000ULL);
+    CHECK(select_in_time(arbiter, control_block.get(), t1+5001*ms, control));
+}
+
+int main()
+{
+    test_arbitration();
+    test_trajectory();
+    test_queue_entries();
+    printf("%d checks, %d failed\n", checks, failures);
+    exit(failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,584 @@
+/* Authors :
+ * - Hdumcke
+ * - Pat92fr
+ */
+#ifndef _esp32_proxy_control_H
+#define _esp32_proxy_control_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <atomic>
+
+#include "esp32-proxy.h"
+#include "esp32-proxy-stats.h"
+#include "mini_pupper_host_base.h"
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "seqlock requires lock-free atomics (shared between processes)");
+
+// CLOCK_MONOTONIC time in nanoseconds
+inline int64_t monotonic_time_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+/* Sequence lock
+ *
+ *  One writer, any number of readers : readers never block the writer.
+ *  The writer makes the sequence odd while it updates the data, and even again when done.
+ *  A reader retries until it copied the data between two identical even sequence values.
+ *
+ *  Each seqlock has a single writer : esp32-proxy for the feedback, the scheduler statistics and
+ *  the setpoints of socket clients, the owner for a staging slot (see below). A writer that died
+ *  in the middle of a write leaves the sequence odd, the next owner of the slot makes it even
+ *  again. The ESP32 task reads the seqlocks written by clients with try_read : a client stalled
+ *  in the middle of a write never stalls the control loop.
+ *
+ *  The object lives in shared memory, so it must only contain PoD data and lock-free atomics.
+ */
+#define SEQLOCK_READ_ATTEMPTS 64
+
+template<typename T>
+struct seqlock
+{
+    void write(T const & value)
+    {
+        // odd while writing, whatever a previous writer left
+        uint32_t const sequence {(_sequence.load(std::memory_order_relaxed)+1) | 1};
+        _sequence.store(sequence, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(&_data, &value, sizeof(T));
+        _sequence.store(sequence+1, std::memory_order_release);
+    }
+
+    // wait for a consistent copy : only for the seqlocks written by esp32-proxy
+    void read(T & value) const
+    {
+        while(!try_read(value, SEQLOCK_READ_ATTEMPTS));
+    }
+
+    // return false when no consistent copy was made in this many attempts (writer stalled)
+    bool try_read(T & value, unsigned attempts = SEQLOCK_READ_ATTEMPTS) const
+    {
+        for(; attempts>0; --attempts)
+        {
+            uint32_t const sequence_before {_sequence.load(std::memory_order_acquire)};
+            if(sequence_before & 1) continue; // writer in progress
+            memcpy(&value, &_data, sizeof(T));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            uint32_t const sequence_after {_sequence.load(std::memory_order_relaxed)};
+            if(sequence_before==sequence_after) return true;
+        }
+        return false;
+    }
+
+    // even between writes, incremented by 2 on each write
+    uint32_t sequence() const
+    {
+        return _sequence.load(std::memory_order_acquire);
+    }
+
+private:
+
+    std::atomic<uint32_t> _sequence {0};
+    T _data;
+};
+
+// One generation of ESP32 feedback (one decoded CONTROL acknowledge)
+struct feedback_snapshot
+{
+    uint64_t generation {0};    // incremented for each decoded acknowledge, 0 means no feedback yet
+    int64_t timestamp_ns {0};   // CLOCK_MONOTONIC time the acknowledge was decoded
+    parameters_control_acknowledge_format feedback;
+    feedback_timing timing {};  // ESP32 sample times (host protocol version 2)
+    uint32_t fields {0};        // acknowledge fields (FEEDBACK_xxx bits) of this generation
+    parameters_feedback_extra_format extra {};
+};
+
+/* Setpoint leases
+ *
+ *  A client that acquires a lease gets its own staging slot : its setpoints never mix with
+ *  the setpoints of other clients. Before each CONTROL frame, the ESP32 task picks the
+ *  live slot with the highest priority (the most recently written on a tie).
+ *  A slot is live while its owner writes it more often than its lease duration.
+ *  When the last live slot expires, the ESP32 task holds the present pose until a lease
+ *  is written again or a legacy client (no lease) writes the shared setpoints.
+ *  Legacy setpoints (control) have the lowest priority and never expire.
+ *
+ *  Each staged setpoint carries the owner id : a slot taken over by another client after
+ *  its lease expired is never fed by its previous owner. Readers take no lock. A slot that can
+ *  not be read (owner stalled in the middle of a write) keeps its previous setpoints for
+ *  SETPOINT_STALL_FRAMES CONTROL frames, then it is skipped as if it expired.
+ *
+ *  Trajectories : the owner of a slot may also queue future setpoints, each with a target
+ *  time (CLOCK_MONOTONIC). While the queue is not empty, the ESP32 task interpolates the
+ *  setpoints of each CONTROL frame toward the next point, so that every point is reached at
+ *  its target time. The last point then holds, until the owner stages setpoints or queues
+ *  another trajectory : the last entry consumed is never reused before.
+ *  A lease stays live until the last queued point, plus its duration.
+ *  The queue is single producer (the slot owner), single consumer (the ESP32 task) : the producer
+ *  reuses an entry only once the consumer moved its tail past it, flushed points included, and
+ *  the ESP32 task moves the tail of every slot past the flushed points on each CONTROL frame.
+ *
+ *  Legacy setpoints : socket clients without lease write the setpoints of esp32-proxy (control),
+ *  a shared-memory client without lease stages its setpoints in a legacy slot of its own. The
+ *  ESP32 task takes the legacy setpoints written last. A legacy slot is released when its client
+ *  closes, and taken over once the process of its owner died.
+ */
+#define ESP32_PROXY_SETPOINT_SLOTS 16
+#define SETPOINT_STALL_FRAMES 10
+
+// setpoint_and_feedback_data::setpoint_source values, other values are a slot index
+#define SETPOINT_SOURCE_LEGACY (-1)
+#define SETPOINT_SOURCE_HOLD (-2)
+
+struct staged_setpoint
+{
+    uint32_t owner {0};         // owner id when written
+    uint32_t reserved {0};
+    parameters_control_instruction_format control;
+};
+
+struct trajectory_point
+{
+    int64_t target_ns;          // CLOCK_MONOTONIC time the setpoints must be reached
+    parameters_control_instruction_format control;
+};
+
+struct trajectory_queue
+{
+    static uint32_t const CAPACITY {64};
+
+    std::atomic<uint64_t> head {0};         // points pushed (producer)
+    std::atomic<uint64_t> tail {0};         // points consumed (consumer)
+    std::atomic<uint64_t> flush_index {0};  // points before this index are discarded (producer)
+    std::atomic<int64_t> end_ns {0};        // target time of the last pushed point (producer)
+    trajectory_point points[CAPACITY];
+};
+
+struct setpoint_slot
+{
+    std::atomic<uint32_t> owner {0};        // 0 : free
+    std::atomic<uint32_t> priority {0};
+    std::atomic<int64_t> lease_ns {0};
+    std::atomic<int64_t> heartbeat_ns {0};  // CLOCK_MONOTONIC time of the acquisition or of the last write
+    seqlock<staged_setpoint> setpoint;
+    trajectory_queue trajectory;
+
+    bool is_expired(int64_t now_ns) const
+    {
+        int64_t const heartbeat { heartbeat_ns.load(std::memory_order_acquire) };
+        int64_t const trajectory_end { trajectory.end_ns.load(std::memory_order_relaxed) };
+        return now_ns-(heartbeat>trajectory_end ? heartbeat : trajectory_end) > lease_ns.load(std::memory_order_relaxed);
+    }
+};
+
+struct legacy_slot
+{
+    std::atomic<int32_t> pid {0};           // process of the owner, 0 : free
+    seqlock<parameters_control_instruction_format> setpoint;
+};
+
+/* ESP32 requests
+ *
+ *  Exchanges other than CONTROL (INST_GET_STATS, INST_SET_CONFIG, ...) go through a one-entry
+ *  mailbox : the server posts a request (PENDING), the ESP32 task sends it once no CONTROL frame
+ *  is in flight, and posts the reply (DONE) before it signals the feedback eventfd. The server
+ *  forwards the reply to its client and posts the next request (IDLE).
+ */
+#define ESP32_REQUEST_IDLE 0
+#define ESP32_REQUEST_PENDING 1
+#define ESP32_REQUEST_DONE 2
+// instruction and parameters, or status, instruction and parameters : a payload without checksum
+#define ESP32_REQUEST_MAX_LENGTH 126
+
+struct esp32_request
+{
+    std::atomic<uint32_t> state {ESP32_REQUEST_IDLE};
+    uint8_t request_length {0};     // instruction, parameters
+    uint8_t reply_length {0};       // status, instruction, parameters ; 0 : no reply in time
+    uint8_t request[ESP32_REQUEST_MAX_LENGTH];
+    uint8_t reply[ESP32_REQUEST_MAX_LENGTH];
+};
+
+/* Shared-memory segment
+ *
+ *  The control block is a named POSIX shared-memory segment (/dev/shm/esp32-proxy),
+ *  created by esp32-proxy at start-up. Local clients map it through esp32-proxy-client.h.
+ *  Like the socket, it is created under the umask : other users need esp32-proxy --group.
+ *  The header is checked by clients : any layout change must bump ESP32_PROXY_SHM_VERSION.
+ */
+#define ESP32_PROXY_SHM_NAME "/esp32-proxy"
+#define ESP32_PROXY_SHM_MAGIC 0x50505545 // "EUPP"
+#define ESP32_PROXY_SHM_VERSION 10
+
+struct shared_memory_header
+{
+    std::atomic<uint32_t> magic {0};  // written last by the server, once the segment is ready
+    uint32_t version {ESP32_PROXY_SHM_VERSION};
+    uint32_t size {0};                // size of the whole segment
+    int32_t server_pid {0};
+};
+
+// Setpoint and feedback data format for client-server communication (shared-memory)
+struct setpoint_and_feedback_data
+{
+    shared_memory_header header;
+    seqlock<parameters_control_instruction_format> control;
+    seqlock<feedback_snapshot> feedback;
+    // feedback event : incremented after each new feedback generation (futex word)
+    std::atomic<uint32_t> feedback_event {0};
+    std::atomic<uint32_t> feedback_waiters {0};
+    // count of socket clients subscribed to feedback push
+    std::atomic<uint32_t> feedback_subscribers {0};
+    // ESP32 control loop timing
+    seqlock<scheduler_stats> scheduler;
+    // host serial link statistics
+    link_stats link;
+    // setpoint leases
+    setpoint_slot setpoint_slots[ESP32_PROXY_SETPOINT_SLOTS];
+    std::atomic<uint32_t> last_lease_owner {0};
+    std::atomic<int32_t> setpoint_source {SETPOINT_SOURCE_LEGACY};  // setpoints of the last CONTROL frame
+    // legacy setpoints of shared-memory clients
+    legacy_slot legacy_slots[ESP32_PROXY_SETPOINT_SLOTS];
+    // requests forwarded to the ESP32
+    esp32_request request;
+};
+
+inline long futex(std::atomic<uint32_t> * word, int op, uint32_t value, struct timespec const * timeout)
+{
+    return syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), op, value, timeout, NULL, 0);
+}
+
+// Publish a new feedback generation and wake up clients waiting for it
+inline void publish_feedback(setpoint_and_feedback_data * control_block, feedback_snapshot const & snapshot)
+{
+    control_block->feedback.write(snapshot);
+    control_block->feedback_event.fetch_add(1);
+    if(control_block->feedback_waiters.load()>0)
+    {
+        futex(&control_block->feedback_event, FUTEX_WAKE, INT32_MAX, NULL);
+    }
+}
+
+// Acquire a setpoint lease, return the slot index or -1 if all slots are owned by live leases
+// - owner is set to the id that must be passed to write_setpoint_slot and release_setpoint_slot
+inline int acquire_setpoint_slot(setpoint_and_feedback_data * control_block, uint32_t priority, uint32_t lease_ms, uint32_t & owner)
+{
+    do owner = control_block->last_lease_owner.fetch_add(1)+1; while(owner==0);
+    int64_t const now_ns { monotonic_time_ns() };
+    for(int index=0; index<ESP32_PROXY_SETPOINT_SLOTS; ++index)
+    {
+        setpoint_slot & slot = control_block->setpoint_slots[index];
+        uint32_t previous_owner { slot.owner.load() };
+        int64_t heartbeat_ns { slot.heartbeat_ns.load() };
+        // free slots, and slots of owners that stopped writing (dead client)
+        if(previous_owner!=0 && !slot.is_expired(now_ns)) continue;
+        // refresh the heartbeat first : the slot can not be seen expired once owned
+        if(!slot.heartbeat_ns.compare_exchange_strong(heartbeat_ns, now_ns)) continue;
+        if(!slot.owner.compare_exchange_strong(previous_owner, owner)) continue;
+        slot.priority.store(priority);
+        slot.lease_ns.store((int64_t)lease_ms*1000000LL);
+        slot.trajectory.end_ns.store(0);
+        slot.trajectory.flush_index.store(slot.trajectory.head.load(), std::memory_order_release);
+        return index;
+    }
+    return -1;
+}
+
+// Stage setpoints in an owned slot, return false if the lease was lost
+inline bool write_setpoint_slot(setpoint_and_feedback_data * control_block, int index, uint32_t owner, parameters_control_instruction_format const & control)
+{
+    setpoint_slot & slot = control_block->setpoint_slots[index];
+    if(slot.owner.load()!=owner) return false;
+    staged_setpoint staged;
+    staged.owner = owner;
+    staged.control = control;
+    slot.setpoint.write(staged);
+    // immediate setpoints cancel the queued trajectory
+    slot.trajectory.end_ns.store(0, std::memory_order_relaxed);
+    slot.trajectory.flush_index.store(slot.trajectory.head.load(std::memory_order_relaxed), std::memory_order_release);
+    slot.heartbeat_ns.store(monotonic_time_ns(), std::memory_order_release);
+    return true;
+}
+
+// Queue trajectory points in an owned slot, return the count of points queued (-1 if the lease was lost)
+// - points must be sorted by target time, the points that do not fit in the queue are dropped
+// - replace discards the points already queued, the motion continues from the present setpoints
+inline int push_trajectory(setpoint_and_feedback_data * control_block, int index, uint32_t owner, trajectory_point const * points, size_t count, bool replace)
+{
+    setpoint_slot & slot = control_block->setpoint_slots[index];
+    if(slot.owner.load()!=owner) return -1;
+    trajectory_queue & queue = slot.trajectory;
+    uint64_t head { queue.head.load(std::memory_order_relaxed) };
+    // the entries from the tail on may be read by the ESP32 task, until it acknowledged the flush,
+    // and the last entry consumed holds the end of the previous trajectory
+    uint64_t const tail { queue.tail.load(std::memory_order_acquire) };
+    staged_setpoint staged;
+    if(!slot.setpoint.try_read(staged)) staged.owner = 0;
+    if(replace)
+    {
+        // a trajectory followed to its end : its last point becomes the staged setpoint
+        if(tail>=head && head>queue.flush_index.load(std::memory_order_relaxed))
+        {
+            staged.owner = owner;
+            staged.control = queue.points[(head-1)%trajectory_queue::CAPACITY].control;
+            slot.setpoint.write(staged);
+        }
+        queue.flush_index.store(head, std::memory_order_release);
+    }
+    int64_t end_ns { replace ? 0 : queue.end_ns.load(std::memory_order_relaxed) };
+    int queued {0};
+    for(size_t point=0; point<count; ++point)
+    {
+        if(head-tail>=trajectory_queue::CAPACITY-1) break;  // full
+        if(points[point].target_ns<=end_ns) continue;       // not after the last queued point
+        queue.points[head%trajectory_queue::CAPACITY] = points[point];
+        end_ns = points[point].target_ns;
+        ++head;
+        ++queued;
+    }
+    queue.end_ns.store(end_ns, std::memory_order_relaxed);
+    queue.head.store(head, std::memory_order_release);
+
+    // a slot is selected once its owner staged setpoints : stage the last point if none yet
+    if(staged.owner!=owner && queued>0)
+    {
+        staged.owner = owner;
+        staged.control = queue.points[(head-1)%trajectory_queue::CAPACITY].control;
+        slot.setpoint.write(staged);
+    }
+    slot.heartbeat_ns.store(monotonic_time_ns(), std::memory_order_release);
+    return queued;
+}
+
+inline void release_setpoint_slot(setpoint_and_feedback_data * control_block, int index, uint32_t owner)
+{
+    control_block->setpoint_slots[index].owner.compare_exchange_strong(owner, 0);
+}
+
+// Acquire a legacy slot for the calling process, return the slot index or -1 if all are owned
+inline int acquire_legacy_slot(setpoint_and_feedback_data * control_block)
+{
+    int32_t const pid { (int32_t)getpid() };
+    for(int index=0; index<ESP32_PROXY_SETPOINT_SLOTS; ++index)
+    {
+        legacy_slot & slot = control_block->legacy_slots[index];
+        int32_t previous_pid { slot.pid.load() };
+        // free slots, and slots of processes that died
+        if(previous_pid!=0 && (kill(previous_pid, 0)==0 || errno!=ESRCH)) continue;
+        if(slot.pid.compare_exchange_strong(previous_pid, pid)) return index;
+    }
+    return -1;
+}
+
+inline void release_legacy_slot(setpoint_and_feedback_data * control_block, int index)
+{
+    control_block->legacy_slots[index].pid.store(0);
+}
+
+// Changes each time legacy setpoints are written
+inline uint32_t legacy_setpoints_sequence(setpoint_and_feedback_data const * control_block)
+{
+    uint32_t sequence { control_block->control.sequence() };
+    for(auto const & slot : control_block->legacy_slots) sequence += slot.setpoint.sequence();
+    return sequence;
+}
+
+/* Setpoint arbiter (ESP32 task)
+ *
+ *  Selects the setpoints of the next CONTROL frame : the best live lease, else the hold pose
+ *  after a lease expired, else the legacy setpoints written last.
+ *  The seqlocks written by clients are only read with try_read.
+ */
+struct setpoint_arbiter
+{
+    // - present_position : last servo feedback, the hold pose (nullptr if none yet)
+    void select(setpoint_and_feedback_data * control_block, u16 const * present_position, parameters_control_instruction_format & control)
+    {
+        select(control_block, present_position, monotonic_time_ns(), control);
+    }
+
+    // - now_ns : CLOCK_MONOTONIC time of the CONTROL frame
+    void select(setpoint_and_feedback_data * control_block, u16 const * present_position, int64_t now_ns, parameters_control_instruction_format & control)
+    {
+        int best_index {-1};
+        uint32_t best_priority {0};
+        int64_t best_heartbeat_ns {0};
+        staged_setpoint staged;
+        for(int index=0; index<ESP32_PROXY_SETPOINT_SLOTS; ++index)
+        {
+            setpoint_slot & slot = control_block->setpoint_slots[index];
+            acknowledge_flush(slot.trajectory);
+            uint32_t const owner { slot.owner.load(std::memory_order_acquire) };
+            if(owner==0 || slot.is_expired(now_ns)) continue;
+            uint32_t const priority { slot.priority.load(std::memory_order_relaxed) };
+            int64_t const heartbeat_ns { slot.heartbeat_ns.load(std::memory_order_relaxed) };
+            if(best_index>=0 && (priority<best_priority || (priority==best_priority && heartbeat_ns<=best_heartbeat_ns))) continue;
+            if(slot.setpoint.try_read(staged))
+            {
+                _staged[index] = staged;
+                _stalls[index] = 0;
+            }
+            else
+            {
+                // owner stalled in the middle of a write : its previous setpoints for a while
+                if(++_stalls[index]>SETPOINT_STALL_FRAMES) continue;
+                staged = _staged[index];
+            }
+            if(staged.owner!=owner) continue; // acquired, not written yet
+            best_index = index;
+            best_priority = priority;
+            best_heartbeat_ns = heartbeat_ns;
+            control = staged.control;
+        }
+
+        int32_t source { best_index };
+        if(best_index>=0)
+        {
+            follow_trajectory(control_block->setpoint_slots[best_index], now_ns, control);
+        }
+        else
+        {
+            // a lease just expired : hold the present pose
+            if(_source>=0)
+            {
+                if(present_position) memcpy(_hold.goal_position, present_position, sizeof(_hold.goal_position));
+                else                 memcpy(_hold.goal_position, _last.goal_position, sizeof(_hold.goal_position));
+                memcpy(_hold.torque_enable, _last.torque_enable, sizeof(_hold.torque_enable));
+                update_legacy(control_block);
+                _source = SETPOINT_SOURCE_HOLD;
+            }
+            // hold until a legacy client writes new setpoints
+            if(!update_legacy(control_block) && _source==SETPOINT_SOURCE_HOLD)
+            {
+                control = _hold;
+                source = SETPOINT_SOURCE_HOLD;
+            }
+            else
+            {
+                control = _legacy;
+                source = SETPOINT_SOURCE_LEGACY;
+            }
+        }
+        _source = source;
+        _last = control;
+        _last_ns = now_ns;
+        control_block->setpoint_source.store(source, std::memory_order_relaxed);
+    }
+
+private:
+
+    // Follow the legacy setpoints written last, by esp32-proxy or in a legacy slot
+    // - return true when legacy setpoints were written since the last call
+    bool update_legacy(setpoint_and_feedback_data * control_block)
+    {
+        bool written {false};
+        for(int index=0; index<=ESP32_PROXY_SETPOINT_SLOTS; ++index)
+        {
+            seqlock<parameters_control_instruction_format> const & setpoint { index==0 ? control_block->control : control_block->legacy_slots[index-1].setpoint };
+            uint32_t const sequence { setpoint.sequence() };
+            if(sequence==_legacy_sequences[index]) continue;
+            parameters_control_instruction_format legacy;
+            if(!setpoint.try_read(legacy)) continue; // writer stalled : next frame
+            _legacy = legacy;
+            _legacy_sequences[index] = sequence;
+            written = true;
+        }
+        return written;
+    }
+
+    // Move the tail of a queue past the flushed points : the producer may reuse their entries
+    static void acknowledge_flush(trajectory_queue & queue)
+    {
+        uint64_t const flush_index { queue.flush_index.load(std::memory_order_acquire) };
+        if(queue.tail.load(std::memory_order_relaxed)<flush_index) queue.tail.store(flush_index, std::memory_order_release);
+    }
+
+    // Interpolate the setpoints of a slot with a queued trajectory
+    void follow_trajectory(setpoint_slot & slot, int64_t now_ns, parameters_control_instruction_format & control)
+    {
+        trajectory_queue & queue = slot.trajectory;
+        uint64_t const head { queue.head.load(std::memory_order_acquire) };
+        uint64_t tail { queue.tail.load(std::memory_order_relaxed) };
+        uint64_t const flush_index { queue.flush_index.load(std::memory_order_acquire) };
+        if(tail<flush_index) tail = flush_index;
+        if(tail>=head)
+        {
+            queue.tail.store(tail, std::memory_order_release);
+            // end of the trajectory : its last point, else the staged setpoints
+            if(head>flush_index) control = queue.points[(head-1)%trajectory_queue::CAPACITY].control;
+            return;
+        }
+        // head is written by the client : never walk more points than the queue holds
+        if(head-tail>trajectory_queue::CAPACITY) tail = head-trajectory_queue::CAPACITY;
+
+        // start from the setpoints of the previous CONTROL frame, or from the last point reached
+        parameters_control_instruction_format from { _last_ns>0 ? _last : control };
+        int64_t from_ns { _last_ns>0 ? _last_ns : now_ns };
+        while(tail<head && queue.points[tail%trajectory_queue::CAPACITY].target_ns<=now_ns)
+        {
+            from = queue.points[tail%trajectory_queue::CAPACITY].control;
+            from_ns = queue.points[tail%trajectory_queue::CAPACITY].target_ns;
+            ++tail;
+        }
+
+        if(tail<head)
+        {
+            // linear interpolation toward the next point, torque switches as the next point
+            trajectory_point const & next = queue.points[tail%trajectory_queue::CAPACITY];
+            int64_t const span_ns { next.target_ns-from_ns };
+            double const ratio { span_ns>0 ? (double)(now_ns-from_ns)/(double)span_ns : 1.0 };
+            for(size_t index=0; index<12; ++index)
+            {
+                double const goal_position { from.goal_position[index] + ratio*((double)next.control.goal_position[index]-(double)from.goal_position[index]) };
+                control.goal_position[index] = (u16)(goal_position+0.5);
+            }
+            memcpy(control.torque_enable, next.control.torque_enable, sizeof(control.torque_enable));
+        }
+        else
+        {
+            // end of the trajectory : the last point holds
+            control = from;
+        }
+        queue.tail.store(tail, std::memory_order_release);
+    }
+
+    int32_t _source {SETPOINT_SOURCE_LEGACY};
+    // last setpoints read in each slot, and the CONTROL frames they could not be read since
+    staged_setpoint _staged[ESP32_PROXY_SETPOINT_SLOTS] {};
+    uint32_t _stalls[ESP32_PROXY_SETPOINT_SLOTS] {};
+    // legacy setpoints written last, and the sequence of the esp32-proxy setpoints and of each legacy slot
+    parameters_control_instruction_format _legacy {};
+    uint32_t _legacy_sequences[1+ESP32_PROXY_SETPOINT_SLOTS] {};
+    parameters_control_instruction_format _hold;
+    parameters_control_instruction_format _last;
+    int64_t _last_ns {0};
+};
+
+// Summarize the link statistics
+inline void get_link_stats_summary(link_stats const & link, link_stats_summary & summary)
+{
+    using mini_pupper::frame_error_rate_monitor;
+    summary.frames_sent = link.frames_sent.load(std::memory_order_relaxed);
+    summary.frames_received = link.rx_counter[frame_error_rate_monitor::ALL].load(std::memory_order_relaxed);
+    summary.checksum_errors = link.rx_counter[frame_error_rate_monitor::CHECKSUM_ERROR].load(std::memory_order_relaxed);
+    summary.syntax_errors = link.rx_counter[frame_error_rate_monitor::SYNTAX_ERROR].load(std::memory_order_relaxed);
+    summary.timeouts = link.rx_counter[frame_error_rate_monitor::TIME_OUT_ERROR].load(std::memory_order_relaxed);
+    summary.rtt_count = link.rtt.count.load(std::memory_order_relaxed);
+    summary.rtt_min_ns = link.rtt.min_ns.load(std::memory_order_relaxed);
+    summary.rtt_mean_ns = summary.rtt_count ? link.rtt.sum_ns.load(std::memory_order_relaxed)/summary.rtt_count : 0;
+    summary.rtt_p50_ns = link.rtt.percentile(0.50);
+    summary.rtt_p99_ns = link.rtt.percentile(0.99);
+    summary.rtt_p999_ns = link.rtt.percentile(0.999);
+    summary.rtt_max_ns = link.rtt.max_ns.load(std::memory_order_relaxed);
+}
+
+#endif //_esp32_proxy_control_H
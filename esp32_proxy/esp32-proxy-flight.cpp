@@ -0,0 +1,184 @@
+/* Authors :
+ * - Hdumcke
+ * - Pat92fr
+ */
+
+/* esp32-proxy flight recorder decoder
+ *
+ *  Converts the flight recorder ring file of esp32-proxy into CSV, oldest record first :
+ *  one row per record, one column per field, so that it loads directly into a dataframe
+ *  (and converts to Parquet). Fields that do not apply to a record are left empty.
+ *
+ *  Columns :
+ *   record, timestamp_ns (CLOCK_MONOTONIC), realtime_ns (CLOCK_REALTIME), cycle, event, length,
+ *   sequence                                                   (pipelined tx_control, rx_ack, rx_late_ack)
+ *   torque_enable_0..11, goal_position_0..11                  (tx_control)
+ *   fields                                                     (rx_ack, rx_late_ack : acknowledge fields, hexadecimal)
+ *   present_position_0..11, present_load_0..11,
+ *   ax, ay, az, gx, gy, gz, voltage_V, current_A,
+ *   frame_counter, servo_time_us, imu_time_us, esp32_tx_time_us,
+ *   present_speed_0..11, present_temperature_0..11, servo_age_us_0..11
+ *                                              (rx_ack, rx_late_ack, when the field is in the mask ;
+ *                                               servo_age_us empty for a servo never read)
+ *   frame                                                      (--raw : hexadecimal frame)
+ *
+ *  The file may be decoded while esp32-proxy is recording.
+ *
+ *  Usage : esp32-proxy-flight [--raw] [<file>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <string>
+#include <vector>
+
+#include "esp32-proxy-recorder.h"
+
+static char const * event_name(uint8_t event)
+{
+    switch (event) {
+    case FLIGHT_TX_CONTROL:        return "tx_control";
+    case FLIGHT_RX_ACK:            return "rx_ack";
+    case FLIGHT_RX_LATE_ACK:       return "rx_late_ack";
+    case FLIGHT_RX_BAD_STATUS:     return "rx_bad_status";
+    case FLIGHT_RX_CHECKSUM_ERROR: return "rx_checksum_error";
+    case FLIGHT_TIME_OUT:          return "time_out";
+    case FLIGHT_TX_REQUEST:        return "tx_request";
+    case FLIGHT_RX_REPLY:          return "rx_reply";
+    default:                       return "unknown";
+    }
+}
+
+static void print_header(bool raw)
+{
+    printf("record,timestamp_ns,realtime_ns,cycle,event,length,sequence");
+    for (int index = 0; index < 12; ++index) printf(",torque_enable_%d", index);
+    for (int index = 0; index < 12; ++index) printf(",goal_position_%d", index);
+    printf(",fields");
+    for (int index = 0; index < 12; ++index) printf(",present_position_%d", index);
+    for (int index = 0; index < 12; ++index) printf(",present_load_%d", index);
+    printf(",ax,ay,az,gx,gy,gz,voltage_V,current_A");
+    printf(",frame_counter,servo_time_us,imu_time_us,esp32_tx_time_us");
+    for (int index = 0; index < 12; ++index) printf(",present_speed_%d", index);
+    for (int index = 0; index < 12; ++index) printf(",present_temperature_%d", index);
+    for (int index = 0; index < 12; ++index) printf(",servo_age_us_%d", index);
+    if (raw) printf(",frame");
+    printf("\n");
+}
+
+// - fields : the acknowledge fields in use
+static void print_record(uint64_t index, flight_record const & record, int64_t realtime_offset_ns, uint32_t fields, bool raw)
+{
+    printf("%llu,%lld,%lld,%llu,%s,%u",
+        (unsigned long long)index,
+        (long long)record.timestamp_ns,
+        (long long)(record.timestamp_ns + realtime_offset_ns),
+        (unsigned long long)record.cycle,
+        event_name(record.event),
+        record.length
+    );
+
+    parameters_control_instruction_format control;
+    control_acknowledge ack;
+    int sequence {-1};
+    bool const is_control {decode_flight_control(record, control, sequence)};
+    bool const is_acknowledge {decode_flight_acknowledge(record, fields, ack)};
+    if (is_acknowledge) sequence = ack.sequence;
+    auto has_field = [&](feedback_field field) { return is_acknowledge && (ack.fields & (1u << field)); };
+    parameters_control_acknowledge_format const & feedback {ack.feedback};
+    if (sequence >= 0) printf(",%d", sequence);
+    else printf(",");
+
+    if (is_control) {
+        for (int index = 0; index < 12; ++index) printf(",%u", control.torque_enable[index]);
+        for (int index = 0; index < 12; ++index) printf(",%u", control.goal_position[index]);
+    }
+    else {
+        printf("%s", std::string(24, ',').c_str());
+    }
+
+    if (is_acknowledge) printf(",%x", ack.fields);
+    else printf(",");
+
+    if (has_field(FEEDBACK_POSITION) || has_field(FEEDBACK_POSITION_PACKED)) for (int index = 0; index < 12; ++index) printf(",%u", feedback.present_position[index]);
+    else printf("%s", std::string(12, ',').c_str());
+    if (has_field(FEEDBACK_LOAD) || has_field(FEEDBACK_LOAD_PACKED)) for (int index = 0; index < 12; ++index) printf(",%d", feedback.present_load[index]);
+    else printf("%s", std::string(12, ',').c_str());
+    if (has_field(FEEDBACK_IMU) || has_field(FEEDBACK_IMU_RAW)) printf(",%g,%g,%g,%g,%g,%g", feedback.ax, feedback.ay, feedback.az, feedback.gx, feedback.gy, feedback.gz);
+    else printf("%s", std::string(6, ',').c_str());
+    if (has_field(FEEDBACK_POWER) || has_field(FEEDBACK_POWER_PACKED)) printf(",%g,%g", feedback.voltage_V, feedback.current_A);
+    else printf(",,");
+
+    if (has_field(FEEDBACK_TIMING)) {
+        printf(",%u,%lld,%lld,%lld",
+            ack.timing.frame_counter,
+            (long long)ack.timing.servo_time_us,
+            (long long)ack.timing.imu_time_us,
+            (long long)ack.timing.tx_time_us
+        );
+    }
+    else {
+        printf(",,,,");
+    }
+
+    if (has_field(FEEDBACK_SPEED)) for (int index = 0; index < 12; ++index) printf(",%d", ack.extra.present_speed[index]);
+    else printf("%s", std::string(12, ',').c_str());
+    if (has_field(FEEDBACK_TEMPERATURE)) for (int index = 0; index < 12; ++index) printf(",%u", ack.extra.present_temperature[index]);
+    else printf("%s", std::string(12, ',').c_str());
+    if (has_field(FEEDBACK_SERVO_AGE)) {
+        for (int index = 0; index < 12; ++index) {
+            if (ack.extra.servo_age[index] == SERVO_AGE_NEVER_READ) printf(",");
+            else printf(",%u", ack.extra.servo_age[index] * SERVO_AGE_UNIT_US);
+        }
+    }
+    else printf("%s", std::string(12, ',').c_str());
+
+    if (raw) {
+        printf(",");
+        for (size_t index = 0; index < record.length && index < sizeof(record.frame); ++index) printf("%02x", record.frame[index]);
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    bool raw {false};
+
+    static struct option const long_options[] = {
+        {"raw",  no_argument, 0, 'r'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    for (;;) {
+        int c = getopt_long(argc, argv, "rh", long_options, NULL);
+        if (c == -1) break;
+        switch (c) {
+        case 'r':
+            raw = true;
+            break;
+        default:
+            printf("usage: %s [--raw] [<file>]\n", argv[0]);
+            exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    char const * path = optind < argc ? argv[optind] : ESP32_PROXY_RECORDER_PATH;
+
+    std::vector<flight_record> records;
+    uint64_t first_index {0};
+    int64_t realtime_offset_ns {0};
+    if (!load_flight_recording(path, records, first_index, realtime_offset_ns)) {
+        exit(EXIT_FAILURE);
+    }
+
+    print_header(raw);
+    flight_feedback_fields fields;
+    for (size_t index = 0; index < records.size(); ++index) {
+        fields.update(records[index]);
+        print_record(first_index + index, records[index], realtime_offset_ns, fields.fields, raw);
+    }
+
+    exit(EXIT_SUCCESS);
+}
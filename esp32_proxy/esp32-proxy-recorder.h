@@ -0,0 +1,275 @@
+/* Authors :
+ * - Hdumcke
+ * - Pat92fr
+ */
+#ifndef _esp32_proxy_recorder_H
+#define _esp32_proxy_recorder_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "mini_pupper_host_base.h"
+
+/* Flight recorder
+ *
+ *  Every frame exchanged with the ESP32 is written into a fixed-size ring of records,
+ *  in a file mapped in memory : recording a frame is a memcpy, without any system call.
+ *  The kernel writes the dirty pages back to the file in the background, and the file
+ *  survives a crash of the proxy. The previous recording is kept as <path>.1 at start-up.
+ *  The default file is on tmpfs (/dev/shm) : the ring is rewritten at the control rate, which
+ *  would wear the SD card out. A recording that must survive a reboot is made on persistent
+ *  storage with esp32-proxy --recorder <path>, for the time of a test.
+ *
+ *  The file is decoded offline by esp32-proxy-flight, and replayed by esp32-proxy --replay.
+ *
+ *  File layout :
+ *   flight_recorder_header (128 bytes)
+ *   flight_record[capacity] (256 bytes each)
+ *  Record <n> (n counts from 0 since start-up) is stored at index n % capacity.
+ *  The last <capacity> records are available, up to header.write_index (excluded).
+ */
+#define ESP32_PROXY_RECORDER_MAGIC 0x52465045 // "EPFR"
+#define ESP32_PROXY_RECORDER_VERSION 2
+#define ESP32_PROXY_RECORDER_PATH "/dev/shm/esp32-proxy.flight"
+
+enum flight_event : uint8_t
+{
+    FLIGHT_TX_CONTROL = 1,      // CONTROL frame sent
+    FLIGHT_RX_ACK,              // acknowledge received in time
+    FLIGHT_RX_LATE_ACK,         // acknowledge received after its exchange timed out
+    FLIGHT_RX_BAD_STATUS,       // frame with a valid checksum, but a bad status or length
+    FLIGHT_RX_CHECKSUM_ERROR,   // frame with a bad checksum
+    FLIGHT_TIME_OUT,            // no acknowledge in time (no frame)
+    FLIGHT_TX_REQUEST,          // other frame sent (e.g. PROTOCOL)
+    FLIGHT_RX_REPLY             // reply to another frame
+};
+
+struct flight_record
+{
+    int64_t timestamp_ns;       // CLOCK_MONOTONIC
+    uint64_t cycle;             // CONTROL frames sent so far, relates acknowledges to their CONTROL frame
+    uint8_t event;              // flight_event
+    uint8_t reserved;
+    uint16_t length;            // frame length in bytes
+    uint32_t reserved2;
+    uint8_t frame[232];         // raw frame, header and checksum included
+};
+static_assert(sizeof(flight_record)==256, "flight record layout is part of the file format");
+
+struct flight_recorder_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t capacity;                  // number of records in the ring
+    int64_t realtime_offset_ns;         // CLOCK_REALTIME - CLOCK_MONOTONIC at start-up
+    std::atomic<uint64_t> write_index;  // number of records written since start-up
+    uint8_t reserved[96];
+};
+static_assert(sizeof(flight_recorder_header)==128, "flight recorder header layout is part of the file format");
+
+// Ring file writer (one writer : the ESP32 task)
+struct flight_recorder
+{
+    // create the ring file and map it, return false on failure
+    bool open(char const * path, uint32_t capacity)
+    {
+        close();
+        if(capacity==0) return false;
+
+        // keep the previous recording
+        rename(path, (std::string(path)+".1").c_str());
+
+        int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(fd<0)
+        {
+            perror("flight recorder");
+            return false;
+        }
+        _size = sizeof(flight_recorder_header) + (size_t)capacity*sizeof(flight_record);
+        // allocate the blocks now : no page fault on a full disk later (SIGBUS)
+        int const result = posix_fallocate(fd, 0, _size);
+        if(result)
+        {
+            fprintf(stderr, "flight recorder: %s\n", strerror(result));
+            ::close(fd);
+            return false;
+        }
+        void * address = mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+        ::close(fd);
+        if(address==MAP_FAILED)
+        {
+            perror("flight recorder");
+            return false;
+        }
+        _header = reinterpret_cast<flight_recorder_header*>(address);
+        _records = reinterpret_cast<flight_record*>(reinterpret_cast<uint8_t*>(address)+sizeof(flight_recorder_header));
+
+        struct timespec monotonic, realtime;
+        clock_gettime(CLOCK_MONOTONIC, &monotonic);
+        clock_gettime(CLOCK_REALTIME, &realtime);
+        _header->magic = ESP32_PROXY_RECORDER_MAGIC;
+        _header->version = ESP32_PROXY_RECORDER_VERSION;
+        _header->record_size = sizeof(flight_record);
+        _header->capacity = capacity;
+        _header->realtime_offset_ns = (int64_t)(realtime.tv_sec-monotonic.tv_sec)*1000000000LL + (realtime.tv_nsec-monotonic.tv_nsec);
+        _header->write_index.store(0, std::memory_order_release);
+        _write_index = 0;
+        return true;
+    }
+
+    void close()
+    {
+        if(_header) munmap(_header, _size);
+        _header = nullptr;
+        _records = nullptr;
+    }
+
+    bool is_open() const
+    {
+        return _header!=nullptr;
+    }
+
+    // hot path : copy one frame into the ring
+    void record(flight_event event, int64_t timestamp_ns, uint64_t cycle, uint8_t const * frame, size_t length)
+    {
+        if(!_header) return;
+        flight_record & r = _records[_write_index % _header->capacity];
+        if(length>sizeof(r.frame)) length = sizeof(r.frame);
+        r.timestamp_ns = timestamp_ns;
+        r.cycle = cycle;
+        r.event = event;
+        r.length = (uint16_t)length;
+        if(length) memcpy(r.frame, frame, length);
+        _header->write_index.store(++_write_index, std::memory_order_release);
+    }
+
+private:
+
+    flight_recorder_header * _header {nullptr};
+    flight_record * _records {nullptr};
+    size_t _size {0};
+    uint64_t _write_index {0};
+};
+
+// Load the records of a ring file, oldest first
+// - the file may be written by a running proxy : records overwritten while loading are dropped
+// - first_index is the index of the first loaded record since the start-up of the recording proxy
+inline bool load_flight_recording(char const * path, std::vector<flight_record> & records, uint64_t & first_index, int64_t & realtime_offset_ns)
+{
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if(fd<0)
+    {
+        perror(path);
+        return false;
+    }
+    struct stat file_stat;
+    if(fstat(fd, &file_stat)<0 || (size_t)file_stat.st_size<sizeof(flight_recorder_header))
+    {
+        fprintf(stderr, "%s: not a flight recorder file\n", path);
+        ::close(fd);
+        return false;
+    }
+    size_t const size = file_stat.st_size;
+    void * address = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(address==MAP_FAILED)
+    {
+        perror(path);
+        return false;
+    }
+    flight_recorder_header const * header = reinterpret_cast<flight_recorder_header const *>(address);
+    if(header->magic!=ESP32_PROXY_RECORDER_MAGIC || header->version!=ESP32_PROXY_RECORDER_VERSION
+        || header->record_size!=sizeof(flight_record) || header->capacity==0
+        || size<sizeof(flight_recorder_header)+(size_t)header->capacity*sizeof(flight_record))
+    {
+        fprintf(stderr, "%s: not a flight recorder file, or another version\n", path);
+        munmap(address, size);
+        return false;
+    }
+    uint32_t const capacity = header->capacity;
+    flight_record const * ring = reinterpret_cast<flight_record const *>(reinterpret_cast<uint8_t const *>(address)+sizeof(flight_recorder_header));
+
+    // copy the ring, then drop the records the proxy may have overwritten during the copy
+    uint64_t const end = header->write_index.load(std::memory_order_acquire);
+    std::vector<flight_record> copy(ring, ring+capacity);
+    uint64_t const end_after_copy = header->write_index.load(std::memory_order_acquire);
+    uint64_t begin = end>capacity ? end-capacity : 0;
+    if(end_after_copy>capacity && end_after_copy-capacity>begin) begin = end_after_copy-capacity;
+
+    records.clear();
+    for(uint64_t index=begin; index<end; ++index) records.push_back(copy[index%capacity]);
+    first_index = begin;
+    realtime_offset_ns = header->realtime_offset_ns;
+    munmap(address, size);
+    return true;
+}
+
+// Decode the setpoints of a recorded CONTROL or CONTROL_SEQ frame
+// - sequence is the sequence number of a CONTROL_SEQ frame, -1 for a CONTROL frame
+inline bool decode_flight_control(flight_record const & record, parameters_control_instruction_format & control, int & sequence)
+{
+    // header (4 bytes), instruction, [sequence], parameters, checksum
+    if(record.event!=FLIGHT_TX_CONTROL) return false;
+    if(record.length==4+1+sizeof(parameters_control_instruction_format)+1 && record.frame[4]==INST_CONTROL)
+    {
+        sequence = -1;
+        memcpy(&control, record.frame+5, sizeof(control));
+        return true;
+    }
+    if(record.length==4+2+sizeof(parameters_control_instruction_format)+1 && record.frame[4]==INST_CONTROL_SEQ)
+    {
+        sequence = record.frame[5];
+        memcpy(&control, record.frame+6, sizeof(control));
+        return true;
+    }
+    return false;
+}
+
+// Acknowledge fields in use along a recording, followed from the replies of the ESP32
+// - a PROTOCOL reply selects the fields of the protocol version (0)
+// - a SET_CONFIG or GET_CONFIG reply of the FEEDBACK_FIELDS entry selects its mask
+struct flight_feedback_fields
+{
+    uint32_t fields {0};
+
+    void update(flight_record const & record)
+    {
+        if(record.event!=FLIGHT_RX_REPLY || record.length<4+1 || record.length!=4+record.frame[3]) return;
+        u8 const * payload {record.frame+4};
+        u8 const payload_length {record.frame[3]};
+        if(payload[0]!=HOST_STATUS_OK) return;
+        if(payload_length==1+1+1)
+        {
+            fields = 0;
+        }
+        else if(payload_length==1+1+1+4+1 && (payload[1]==INST_SET_CONFIG || payload[1]==INST_GET_CONFIG)
+            && payload[2]==HOST_CONFIG_FEEDBACK_FIELDS)
+        {
+            memcpy(&fields, payload+3, 4);
+        }
+    }
+};
+
+// Decode a recorded acknowledge (in time or late), of any protocol version
+// - fields : the acknowledge fields in use (flight_feedback_fields), an acknowledge of the
+//   protocol version layout is decoded too (the ESP32 restarted)
+inline bool decode_flight_acknowledge(flight_record const & record, uint32_t fields, control_acknowledge & ack)
+{
+    // header (4 bytes), payload
+    if(record.event!=FLIGHT_RX_ACK && record.event!=FLIGHT_RX_LATE_ACK) return false;
+    if(record.length<4+1 || record.length!=4+record.frame[3]) return false;
+    return decode_control_acknowledge(record.frame+4, record.frame[3], fields, ack)
+        || (fields!=0 && decode_control_acknowledge(record.frame+4, record.frame[3], 0, ack));
+}
+
+#endif //_esp32_proxy_recorder_H
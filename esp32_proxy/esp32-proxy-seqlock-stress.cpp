@@ -0,0 +1,141 @@
+/* Authors :
+ * - Hdumcke
+ * - Pat92fr
+ */
+
+/* seqlock stress test
+ *
+ *  One writer thread writes generations back-to-back into a seqlock (esp32-proxy-control.h),
+ *  each generation fills the whole payload with a pattern derived from its number.
+ *  N reader threads read the seqlock back-to-back and check that every field of each copy
+ *  belongs to the same generation, and that the generations they see never go backward.
+ *  The payload is larger than a cache line, so that a torn read can not go unnoticed.
+ *
+ *  Exits with a non-zero status on any torn read.
+ *
+ *  Usage : esp32-proxy-seqlock-stress [--duration <seconds>] [--readers <N>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "esp32-proxy-control.h"
+
+// seqlock payload : about the size of a feedback snapshot
+struct stress_payload
+{
+    uint64_t generation;
+    uint32_t words[62];
+};
+
+static uint32_t pattern(uint64_t generation, size_t index)
+{
+    return (uint32_t)(generation*2654435761ULL) ^ (uint32_t)(index*40503U);
+}
+
+struct reader_result
+{
+    uint64_t reads {0};
+    uint64_t torn {0};
+    uint64_t backward {0};
+};
+
+int main(int argc, char *argv[])
+{
+    int duration_s {5};
+    int reader_count {3};
+
+    static struct option const long_options[] = {
+        {"duration", required_argument, 0, 'd'},
+        {"readers",  required_argument, 0, 'r'},
+        {"help",     no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+    for (;;) {
+        int c = getopt_long(argc, argv, "d:r:h", long_options, NULL);
+        if (c == -1) break;
+        switch (c) {
+        case 'd':
+            duration_s = atoi(optarg);
+            break;
+        case 'r':
+            reader_count = atoi(optarg);
+            break;
+        default:
+            printf("usage: %s [--duration <seconds>] [--readers <N>]\n", argv[0]);
+            exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if (duration_s < 1 || reader_count < 1) {
+        printf("usage: %s [--duration <seconds>] [--readers <N>]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    seqlock<stress_payload> lock;
+    {
+        stress_payload payload;
+        payload.generation = 0;
+        for (size_t index = 0; index < 62; ++index) payload.words[index] = pattern(0, index);
+        lock.write(payload);
+    }
+
+    std::atomic<bool> stop {false};
+    std::atomic<uint64_t> writes {0};
+
+    std::thread writer([&]() {
+        stress_payload payload;
+        uint64_t generation {0};
+        while (!stop.load(std::memory_order_relaxed)) {
+            payload.generation = ++generation;
+            for (size_t index = 0; index < 62; ++index) payload.words[index] = pattern(generation, index);
+            lock.write(payload);
+        }
+        writes.store(generation);
+    });
+
+    std::vector<reader_result> results(reader_count);
+    std::vector<std::thread> readers;
+    for (int reader = 0; reader < reader_count; ++reader) {
+        readers.emplace_back([&, reader]() {
+            reader_result & result = results[reader];
+            stress_payload payload;
+            uint64_t last_generation {0};
+            while (!stop.load(std::memory_order_relaxed)) {
+                lock.read(payload);
+                ++result.reads;
+                for (size_t index = 0; index < 62; ++index) {
+                    if (payload.words[index] != pattern(payload.generation, index)) {
+                        ++result.torn;
+                        break;
+                    }
+                }
+                if (payload.generation < last_generation) ++result.backward;
+                last_generation = payload.generation;
+            }
+        });
+    }
+
+    struct timespec const ts {duration_s, 0};
+    nanosleep(&ts, NULL);
+    stop.store(true);
+    writer.join();
+    for (auto & thread : readers) thread.join();
+
+    uint64_t reads {0};
+    uint64_t torn {0};
+    uint64_t backward {0};
+    for (auto const & result : results) {
+        reads += result.reads;
+        torn += result.torn;
+        backward += result.backward;
+    }
+    printf("%d s, 1 writer, %d readers : %llu writes, %llu reads, %llu torn, %llu backward\n",
+        duration_s, reader_count, (unsigned long long)writes.load(), (unsigned long long)reads,
+        (unsigned long long)torn, (unsigned long long)backward);
+    exit(torn == 0 && backward == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,173 @@
+/* Authors :
+ * - Hdumcke
+ * - Pat92fr
+ */
+
+/* esp32-proxy link statistics dump
+ *
+ *  Maps the esp32-proxy control block and prints the serial link counters,
+ *  error rates and the CONTROL->ACK round-trip time percentiles.
+ *  With host protocol version 2, the acknowledges lost on the way, the end-to-end delay of the
+ *  servo feedback (sample -> decoded) and the transport delay (sent -> decoded) are printed too.
+ *  With --histogram, the non-empty buckets of the round-trip time histogram are printed too.
+ *  With --esp32, the statistics of the ESP32 (host link, servo bus and its load, IMU) are requested
+ *  through the proxy socket and printed too, the servo bus load when the firmware reports it.
+ *
+ *  Usage : esp32-proxy-stats [--histogram] [--esp32]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "esp32-proxy-client.h"
+
+static double rate(uint64_t count, uint64_t total)
+{
+    return total ? 100.0 * (double)count / (double)total : 0.0;
+}
+
+static void print_latency(char const * name, latency_histogram const & histogram)
+{
+    uint64_t const count = histogram.count.load(std::memory_order_relaxed);
+    if (count == 0) return;
+    printf("%-17s: min %.1f mean %.1f p50 %.1f p99 %.1f p999 %.1f max %.1f\n",
+        name,
+        histogram.min_ns.load(std::memory_order_relaxed) / 1000.0,
+        (double)histogram.sum_ns.load(std::memory_order_relaxed) / (double)count / 1000.0,
+        histogram.percentile(0.50) / 1000.0,
+        histogram.percentile(0.99) / 1000.0,
+        histogram.percentile(0.999) / 1000.0,
+        histogram.max_ns.load(std::memory_order_relaxed) / 1000.0
+    );
+}
+
+// Request the ESP32 statistics (INST_GET_STATS) through the proxy socket
+// - has_bus_load : the reply carries the servo bus load (not sent by older firmwares)
+static bool get_esp32_stats(parameters_stats_format & stats, bool & has_bus_load)
+{
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) return false;
+    struct sockaddr_un name;
+    memset(&name, 0, sizeof(name));
+    name.sun_family = AF_UNIX;
+    strncpy(name.sun_path, SOCKET_NAME, sizeof(name.sun_path) - 1);
+    u8 const request[3] {3, INST_ESP32, INST_GET_STATS};
+    u8 reply[256];
+    ssize_t length {-1};
+    if (connect(fd, (struct sockaddr const *)&name, sizeof(name)) == 0
+        && send(fd, request, sizeof(request), MSG_NOSIGNAL) == sizeof(request)) {
+        length = recv(fd, reply, sizeof(reply), 0);
+    }
+    close(fd);
+    // [length, INST_ESP32, status, instruction, stats]
+    size_t const bus_load_offset {offsetof(parameters_stats_format, servo_tx_bytes_per_s)};
+    if ((length != (ssize_t)(4 + sizeof(stats)) && length != (ssize_t)(4 + bus_load_offset))
+        || reply[1] != INST_ESP32 || reply[2] != HOST_STATUS_OK || reply[3] != INST_GET_STATS) return false;
+    memset(&stats, 0, sizeof(stats));
+    memcpy(&stats, &reply[4], length - 4);
+    has_bus_load = length == (ssize_t)(4 + sizeof(stats));
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    bool print_histogram {false};
+    bool print_esp32 {false};
+
+    static struct option const long_options[] = {
+        {"histogram", no_argument, 0, 'H'},
+        {"esp32",     no_argument, 0, 'e'},
+        {"help",      no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    for (;;) {
+        int c = getopt_long(argc, argv, "Heh", long_options, NULL);
+        if (c == -1) break;
+        switch (c) {
+        case 'H':
+            print_histogram = true;
+            break;
+        case 'e':
+            print_esp32 = true;
+            break;
+        default:
+            printf("usage: %s [--histogram] [--esp32]\n", argv[0]);
+            exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    esp32_proxy_client proxy;
+    if (!proxy.open()) {
+        printf("cannot open the control block, is esp32-proxy running?\n");
+        exit(EXIT_FAILURE);
+    }
+
+    link_stats const & link = proxy.get_link_stats();
+    link_stats_summary summary;
+    get_link_stats_summary(link, summary);
+
+    printf("frames sent      : %llu\n", (unsigned long long)summary.frames_sent);
+    printf("frames received  : %llu\n", (unsigned long long)summary.frames_received);
+    printf("checksum errors  : %llu (%.3f%%)\n", (unsigned long long)summary.checksum_errors, rate(summary.checksum_errors, summary.frames_received));
+    printf("syntax errors    : %llu (%.3f%%)\n", (unsigned long long)summary.syntax_errors, rate(summary.syntax_errors, summary.frames_received));
+    printf("time-outs        : %llu (%.3f%%)\n", (unsigned long long)summary.timeouts, rate(summary.timeouts, summary.frames_sent));
+    printf("rtt samples      : %llu\n", (unsigned long long)summary.rtt_count);
+    printf("rtt (us)         : min %.1f mean %.1f p50 %.1f p99 %.1f p999 %.1f max %.1f\n",
+        summary.rtt_min_ns / 1000.0,
+        summary.rtt_mean_ns / 1000.0,
+        summary.rtt_p50_ns / 1000.0,
+        summary.rtt_p99_ns / 1000.0,
+        summary.rtt_p999_ns / 1000.0,
+        summary.rtt_max_ns / 1000.0
+    );
+
+    feedback_snapshot snapshot;
+    proxy.get_feedback(snapshot);
+    printf("protocol version : %u\n", snapshot.timing.protocol_version);
+    if (snapshot.timing.protocol_version >= HOST_PROTOCOL_VERSION_2) {
+        printf("acks lost        : %llu\n", (unsigned long long)link.acks_lost.load(std::memory_order_relaxed));
+        printf("clock uncertainty: %.1f us\n", snapshot.timing.clock_uncertainty_ns / 1000.0);
+        print_latency("feedback age (us)", link.feedback_age);
+        print_latency("transport (us)", link.transport_delay);
+    }
+
+    if (print_esp32) {
+        parameters_stats_format stats;
+        bool has_bus_load {false};
+        if (!get_esp32_stats(stats, has_bus_load)) {
+            printf("esp32            : no reply\n");
+        }
+        else {
+            printf("esp32 uptime     : %.3f s, free heap %u bytes\n", stats.uptime_ms / 1000.0, stats.free_heap);
+            printf("esp32 host link  : %u frames, %u checksum errors, %u syntax errors, %u nacks, %.1f Hz\n",
+                stats.host_frames, stats.host_checksum_errors, stats.host_syntax_errors, stats.host_nacks, stats.host_frequency_hz);
+            printf("esp32 servo bus  : %u frames, %u checksum errors, %u syntax errors, %u time-outs, %u truncated, %.1f Hz\n",
+                stats.servo_frames, stats.servo_checksum_errors, stats.servo_syntax_errors,
+                stats.servo_time_out_errors, stats.servo_truncated_errors, stats.servo_frequency_hz);
+            if (has_bus_load) {
+                printf("esp32 servo load : tx %.0f B/s (%.0f B/s with all the setpoints written), rx %.0f B/s, %.1f%% busy\n",
+                    stats.servo_tx_bytes_per_s, stats.servo_tx_bytes_per_s + stats.servo_tx_saved_bytes_per_s,
+                    stats.servo_rx_bytes_per_s, stats.servo_bus_utilisation * 100.0f);
+            }
+            printf("esp32 imu        : %.1f Hz\n", stats.imu_frequency_hz);
+        }
+    }
+
+    if (print_histogram) {
+        printf("%12s %12s\n", "rtt(us)", "count");
+        for (int index = 0; index < latency_histogram::BUCKET_COUNT; ++index) {
+            uint64_t const count = link.rtt.bucket[index].load(std::memory_order_relaxed);
+            if (count == 0) continue;
+            printf("%12.1f %12llu\n", latency_histogram::bucket_value(index) / 1000.0, (unsigned long long)count);
+        }
+    }
+
+    proxy.close();
+    exit(EXIT_SUCCESS);
+}
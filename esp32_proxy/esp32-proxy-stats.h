@@ -0,0 +1,120 @@
+/* Authors :
+ * - Hdumcke
+ * - Pat92fr
+ */
+#ifndef _esp32_proxy_stats_H
+#define _esp32_proxy_stats_H
+
+#include <stdint.h>
+#include <atomic>
+
+#include "mini_pupper_stats.h"
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "link statistics require lock-free 64-bit atomics (shared between processes)");
+
+/* Latency histogram (HDR-style log buckets)
+ *
+ *  Values below 16ns have their own bucket. Above, each power of two is split into
+ *  16 linear sub-buckets, so any recorded value is known within 1/16 (6%).
+ *  Values are clamped to about 18 minutes.
+ *
+ *  One writer (the ESP32 task), any number of readers. Counters are relaxed atomics :
+ *  a reader may see a histogram one sample ahead of its total count, never a torn counter.
+ */
+struct latency_histogram
+{
+    static int const SUB_BUCKET_BITS {4};
+    static int const SUB_BUCKET_COUNT {1<<SUB_BUCKET_BITS};
+    static int const MAX_VALUE_BITS {40};
+    static int const BUCKET_COUNT {SUB_BUCKET_COUNT + (MAX_VALUE_BITS-SUB_BUCKET_BITS)*SUB_BUCKET_COUNT};
+
+    static int bucket_index(uint64_t value_ns)
+    {
+        if(value_ns>=(1ULL<<MAX_VALUE_BITS)) value_ns = (1ULL<<MAX_VALUE_BITS)-1;
+        if(value_ns<(uint64_t)SUB_BUCKET_COUNT) return (int)value_ns;
+        int const msb {63-__builtin_clzll(value_ns)};
+        int const shift {msb-SUB_BUCKET_BITS};
+        int const mantissa {(int)((value_ns>>shift)&(SUB_BUCKET_COUNT-1))};
+        return SUB_BUCKET_COUNT + shift*SUB_BUCKET_COUNT + mantissa;
+    }
+
+    // middle of the value range of a bucket
+    static uint64_t bucket_value(int index)
+    {
+        if(index<SUB_BUCKET_COUNT) return index;
+        int const shift {(index-SUB_BUCKET_COUNT)/SUB_BUCKET_COUNT};
+        int const mantissa {(index-SUB_BUCKET_COUNT)%SUB_BUCKET_COUNT};
+        uint64_t const lower {(uint64_t)(SUB_BUCKET_COUNT+mantissa)<<shift};
+        return lower + ((1ULL<<shift)>>1);
+    }
+
+    void record(int64_t value_ns)
+    {
+        if(value_ns<0) value_ns = 0;
+        uint64_t const value {(uint64_t)value_ns};
+        increment(bucket[bucket_index(value)]);
+        increment(count);
+        sum_ns.store(sum_ns.load(std::memory_order_relaxed)+value, std::memory_order_relaxed);
+        if(value>max_ns.load(std::memory_order_relaxed)) max_ns.store(value, std::memory_order_relaxed);
+        if(value<min_ns.load(std::memory_order_relaxed) || count.load(std::memory_order_relaxed)==1) min_ns.store(value, std::memory_order_relaxed);
+    }
+
+    // value below which a fraction p of the samples fall (0 if empty)
+    uint64_t percentile(double p) const
+    {
+        uint64_t total {0};
+        for(auto const & b : bucket) total += b.load(std::memory_order_relaxed);
+        if(total==0) return 0;
+        uint64_t const rank {(uint64_t)(p*(double)total+0.5)};
+        uint64_t cumulated {0};
+        for(int index=0; index<BUCKET_COUNT; ++index)
+        {
+            cumulated += bucket[index].load(std::memory_order_relaxed);
+            if(cumulated>=rank && cumulated>0) return bucket_value(index);
+        }
+        return max_ns.load(std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> count {0};
+    std::atomic<uint64_t> sum_ns {0};
+    std::atomic<uint64_t> min_ns {0};
+    std::atomic<uint64_t> max_ns {0};
+    std::atomic<uint64_t> bucket[BUCKET_COUNT] {};
+
+private:
+
+    static void increment(std::atomic<uint64_t> & counter)
+    {
+        counter.store(counter.load(std::memory_order_relaxed)+1, std::memory_order_relaxed);
+    }
+};
+
+// Statistics of the host serial link (proxy side)
+struct link_stats
+{
+    // CONTROL frames sent to the ESP32
+    std::atomic<uint64_t> frames_sent {0};
+    // RX frames, mirrored from the protocol interpreter frame_error_rate_monitor :
+    //  ALL (decoded or rejected frames), CHECKSUM_ERROR, SYNTAX_ERROR (header, ID, length, status),
+    //  TIME_OUT_ERROR (no acknowledge in time), TRUNCATED_ERROR
+    std::atomic<uint64_t> rx_counter[mini_pupper::frame_error_rate_monitor::ERROR_COUT] {};
+    // CONTROL -> ACK round-trip time
+    latency_histogram rtt;
+    // host protocol version 2 :
+    //  acknowledges sent by the ESP32 and never decoded (frame counter gaps)
+    std::atomic<uint64_t> acks_lost {0};
+    //  age of the oldest servo feedback sample when its acknowledge is decoded (end-to-end delay)
+    latency_histogram feedback_age;
+    //  ESP32 acknowledge sent -> decoded (transport delay)
+    latency_histogram transport_delay;
+
+    void update_rx_counters(mini_pupper::frame_error_rate_monitor const & f_monitor)
+    {
+        for(int index=0; index<mini_pupper::frame_error_rate_monitor::ERROR_COUT; ++index)
+        {
+            rx_counter[index].store(f_monitor.counter[index], std::memory_order_relaxed);
+        }
+    }
+};
+
+#endif //_esp32_proxy_stats_H
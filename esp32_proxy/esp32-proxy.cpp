@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -12,7 +13,21 @@
 #include <fcntl.h>
 #include <termios.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <sched.h>
+#include <getopt.h>
+#include <grp.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <new>
 #include "esp32-proxy.h"
+#include "esp32-proxy-control.h"
+#include "esp32-proxy-recorder.h"
 
 #include "mini_pupper_host_base.h"
 #include "mini_pupper_protocol.h"
@@ -20,47 +35,229 @@
 static bool const print_debug     {false};
 static bool const print_debug_max {false};
 
+// UART device connected to the ESP32 (command line)
 static char const * filename {"/dev/ttyAMA1"};
 
 static char const * version = PROJECT_VER;
 
-// Setpoint and feedback data format for client-server communication (PoD)
-struct setpoint_and_feedback_data
+static int const MAX_EPOLL_EVENTS {64};
+// Replies queued while the socket of a client is full, the client is closed beyond
+static size_t const MAX_PENDING_PACKETS {64};
+
+// The ESP32 replies a CONTROL acknowledge in less than 2ms
+static int64_t const ack_timeout_ms {10};
+// Other exchanges may wait for the servo bus (servo register access)
+static int64_t const request_timeout_ms {100};
+
+// Real-time options of the ESP32 control loop (command line)
+static int control_rate_hz {0};         // 0 : free-running, next frame sent as soon as the acknowledge is decoded
+static int sched_fifo_priority {0};     // 0 : default scheduling policy
+static int cpu_affinity {-1};           // -1 : no CPU pinning
+static bool lock_memory {false};
+
+// Pipelined exchanges (command line) : CONTROL_SEQ frames kept in flight, 1 : stop-and-wait CONTROL exchanges
+static int pipeline_depth {1};
+static int const MAX_PIPELINE_DEPTH {4};
+// Pipelining is given up when the ESP32 echoes no sequence number (older firmware) for this many frames
+static uint64_t const pipeline_probe_frames {32};
+
+// Host protocol version requested to the ESP32 (command line), 1 : no negotiation
+static int requested_protocol_version {HOST_PROTOCOL_VERSION};
+// PROTOCOL frames sent before assuming an older firmware, one per second
+static int const protocol_max_attempts {3};
+
+// Acknowledge fields requested to the ESP32 (command line), 0 : fields of the protocol version
+static uint32_t requested_feedback_fields {0};
+
+// Flight recorder of the ESP32 link (command line)
+static char const * recorder_filename {ESP32_PROXY_RECORDER_PATH};
+static uint32_t recorder_capacity {32768};  // records (256 bytes each), 0 : no recording
+
+// Group allowed to use the socket and the shared-memory segment (command line), nullptr : owner only
+static char const * group_name {nullptr};
+
+// Replay of a flight recording instead of the ESP32 link (command line)
+enum replay_mode_type
 {
-    parameters_control_instruction_format control;
-    parameters_control_acknowledge_format feedback;
+    REPLAY_REALTIME,    // acknowledges at their recorded timing
+    REPLAY_FAST,        // acknowledges as fast as possible
+    REPLAY_LOCKSTEP     // next acknowledge once the clients wrote new setpoints
+};
+static char const * replay_filename {nullptr};
+static replay_mode_type replay_mode {REPLAY_REALTIME};
+static int64_t const replay_lockstep_timeout_ms {1000};
+
+// Apply real-time options to the calling process
+static void setup_realtime()
+{
+    if(lock_memory)
+    {
+        if(mlockall(MCL_CURRENT | MCL_FUTURE)) perror("mlockall");
+    }
+    if(cpu_affinity>=0)
+    {
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(cpu_affinity, &cpu_set);
+        if(sched_setaffinity(0, sizeof(cpu_set), &cpu_set)) perror("sched_setaffinity");
+    }
+    if(sched_fifo_priority>0)
+    {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = sched_fifo_priority;
+        if(sched_setscheduler(0, SCHED_FIFO, &param)) perror("sched_setscheduler");
+    }
+}
+
+/* ESP32 clock (esp_timer) to CLOCK_MONOTONIC
+ *
+ *  An acknowledge is sent by the ESP32 after its CONTROL frame was sent, and before it is
+ *  decoded : the offset between both clocks lies within [host tx - ESP32 tx, host rx - ESP32 tx].
+ *  The tightest bounds of the last two windows are kept (both clocks drift), and the offset is
+ *  the middle of these bounds.
+ */
+struct esp32_clock
+{
+    static int64_t const WINDOW_NS {1000000000LL};
+
+    // - host_tx_ns : 0 when the CONTROL frame of the acknowledge is not known (late acknowledge)
+    void update(int64_t host_tx_ns, int64_t host_rx_ns, int64_t esp32_tx_us)
+    {
+        int64_t const esp32_tx_ns { esp32_tx_us*1000 };
+        int64_t const upper { host_rx_ns-esp32_tx_ns };
+        int64_t const lower { host_tx_ns>0 ? host_tx_ns-esp32_tx_ns : INT64_MIN };
+
+        // the ESP32 restarted (or the bounds are not consistent anymore) : start again
+        if(upper<lower_bound() || lower>upper_bound()) reset();
+
+        if(host_rx_ns-_window_start_ns>=WINDOW_NS)
+        {
+            _previous = _current;
+            _current = bounds();
+            _window_start_ns = host_rx_ns;
+        }
+        if(lower>_current.lower) _current.lower = lower;
+        if(upper<_current.upper) _current.upper = upper;
+    }
+
+    void reset()
+    {
+        _current = bounds();
+        _previous = bounds();
+        _window_start_ns = 0;
+    }
+
+    bool is_valid() const
+    {
+        return lower_bound()!=INT64_MIN && upper_bound()!=INT64_MAX;
+    }
+
+    int64_t to_monotonic_ns(int64_t esp32_time_us) const
+    {
+        return esp32_time_us*1000 + lower_bound()/2 + upper_bound()/2;
+    }
+
+    int64_t uncertainty_ns() const
+    {
+        return (upper_bound()-lower_bound())/2;
+    }
+
+private:
+
+    struct bounds
+    {
+        int64_t lower {INT64_MIN};
+        int64_t upper {INT64_MAX};
+    };
+
+    int64_t lower_bound() const { return _current.lower>_previous.lower ? _current.lower : _previous.lower; }
+    int64_t upper_bound() const { return _current.upper<_previous.upper ? _current.upper : _previous.upper; }
+
+    bounds _current;
+    bounds _previous;
+    int64_t _window_start_ns {0};
 };
 
+// Write a whole frame to the non-blocking UART device
+static bool write_frame(int fd, u8 const * buffer, size_t size)
+{
+    size_t written {0};
+    while(written<size)
+    {
+        ssize_t const result = write(fd, buffer+written, size-written);
+        if(result<0)
+        {
+            if(errno==EINTR) continue;
+            if(errno!=EAGAIN && errno!=EWOULDBLOCK) return false;
+            struct pollfd pfd { fd, POLLOUT, 0 };
+            if(poll(&pfd, 1, 100)<0 && errno!=EINTR) return false;
+            continue;
+        }
+        written += result;
+    }
+    return true;
+}
+
+// Tell whether a frame is the reply to a request (instruction, parameters)
+// - a reply is status, instruction and parameters : a NACK has no parameters, the parameters of
+//   the known instructions have an exact length, so that a late CONTROL acknowledge is never
+//   taken for the reply
+// - payload_length : status, instruction, parameters and checksum
+static bool is_request_reply(u8 const * request, size_t request_length, u8 const * payload, size_t payload_length, uint32_t feedback_fields)
+{
+    if(payload_length<1+1+1 || payload[1]!=request[0]) return false;
+    size_t const reply_length { payload_length-1 };
+    if(payload[0]!=HOST_STATUS_OK) return reply_length==1+1;
+    size_t const address_length { request_length>=3 ? (size_t)request[2] : 0 };
+    switch(request[0])
+    {
+    case INST_GET_STATS:
+        // older firmwares reply the statistics without the servo bus load
+        return reply_length==1+1+sizeof(parameters_stats_format)
+            || reply_length==1+1+offsetof(parameters_stats_format, servo_tx_bytes_per_s);
+    case INST_GET_CONFIG:
+    case INST_SET_CONFIG:
+        // entry, value
+        return reply_length==1+1+1+4 && request_length>=2 && payload[2]==request[1];
+    case INST_READ_SERVO_REGISTERS:
+        // status and registers of each servo
+        return request_length>=3 && reply_length==1+1+(request_length-3)*(1+address_length);
+    case INST_WRITE_SERVO_REGISTERS:
+        // status of each servo
+        return request_length>=3 && reply_length==1+1+(request_length-3)/(1+address_length);
+    default:
+        // instruction unknown to the proxy : anything but an acknowledge
+        control_acknowledge ack;
+        return !decode_control_acknowledge(payload, payload_length, feedback_fields, ack);
+    }
+}
+
 // Task handling communication with ESP32
 // - parameter (input/output) : the client/server shared-memory buffer
-void esp32_protocol(setpoint_and_feedback_data * control_block)
+// - parameter (input) : an eventfd signaled on each new feedback generation when the server has subscribers
+void esp32_protocol(setpoint_and_feedback_data * control_block, int feedback_event_fd)
 {
     // Check control block once
     if(control_block==NULL) exit(EXIT_FAILURE);
     
-    // Initialize all control/goal_position to neutral
-    u16 const neutral_pos {512};
-    for(auto & goal_position : control_block->control.goal_position)
-    {
-        goal_position = neutral_pos;
-    }
+    // Local copy of the setpoints sent to the ESP32, selected among the leases and legacy setpoints
+    parameters_control_instruction_format control;
+    setpoint_arbiter arbiter;
 
-    // Initialize all control/torque_switch to enable
-    for(auto & torque_enable : control_block->control.torque_enable)
-    {
-        torque_enable = 1;
-    }
+    // Local copy of the last feedback generation received from the ESP32
+    feedback_snapshot snapshot;
 
     // reference : https://www.pololu.com/docs/0J73/15.5
 
     // Open serial device
     int fd = open(
-        filename,           // UART device
-        O_RDWR | O_NOCTTY   // Read-Write access + Not the terminal of this process
+        filename,                       // UART device
+        O_RDWR | O_NOCTTY | O_NONBLOCK  // Read-Write access + Not the terminal of this process + Non-blocking I/O
     );
     if (fd < 0)
     {
-        printf("%s: failed to open UART device\n", __func__);
+        printf("%s: failed to open UART device %s\n", __func__, filename);
         exit(EXIT_FAILURE);
     }
 
@@ -93,9 +290,8 @@ void esp32_protocol(setpoint_and_feedback_data * control_block)
     options.c_oflag &= ~(ONLCR | OCRNL);
     options.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
 
-    // Set up timeouts: Calls to read() will return as soon as there is
-    // at least one byte available or when 100 ms has passed.
-    options.c_cc[VTIME] = 1;
+    // No tty timeouts: reads are non-blocking and driven by poll().
+    options.c_cc[VTIME] = 0;
     options.c_cc[VMIN] = 0;
 
     // Set baud rate
@@ -110,51 +306,283 @@ void esp32_protocol(setpoint_and_feedback_data * control_block)
         exit(EXIT_FAILURE);
     }
 
-    // control-loop
-    for (;;)
+    // Flight recorder : mapped before the real-time options, so that its pages are resident
+    flight_recorder recorder;
+    if(recorder_capacity>0 && !recorder.open(recorder_filename, recorder_capacity))
     {
-        // heart-beat
-        if (print_debug_max)
+        printf("%s: flight recorder disabled\n", __func__);
+    }
+    uint64_t tx_count {0};
+
+    // Apply real-time options to the ESP32 task only
+    setup_realtime();
+
+    // Fixed-rate mode : a periodic timer with absolute deadlines paces the CONTROL frames
+    int64_t const period_ns { control_rate_hz>0 ? 1000000000LL/control_rate_hz : 0 };
+    int64_t period_deadline_ns {0};
+    int timer_fd {-1};
+    if(period_ns>0)
+    {
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if(timer_fd<0)
         {
-            printf(".");
+            printf("%s: failed to create timer\n", __func__);
+            close(fd);
+            exit(EXIT_FAILURE);
         }
-
-        // Flush away any bytes previously read or written.
-        int result = tcflush(fd, TCIOFLUSH);
-        if (result)
+        period_deadline_ns = monotonic_time_ns() + period_ns;
+        struct itimerspec timer_spec;
+        timer_spec.it_interval.tv_sec = period_ns / 1000000000LL;
+        timer_spec.it_interval.tv_nsec = period_ns % 1000000000LL;
+        timer_spec.it_value.tv_sec = period_deadline_ns / 1000000000LL;
+        timer_spec.it_value.tv_nsec = period_deadline_ns % 1000000000LL;
+        if(timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer_spec, NULL))
         {
-            printf("%s: failed to flush\r\n", __func__);
+            printf("%s: failed to start timer\n", __func__);
             close(fd);
             exit(EXIT_FAILURE);
         }
+    }
+    scheduler_stats sched_stats;
+    memset(&sched_stats, 0, sizeof(sched_stats));
+    sched_stats.rate_hz = control_rate_hz;
+    sched_stats.pipeline_depth = 1;
+    control_block->scheduler.write(sched_stats);
+
+    // Decoder of the ESP32 byte stream (resynchronises on the 0xFF 0xFF header)
+    protocol_parser parser;
+
+    // Bytes received but not yet decoded, kept from one exchange to the next
+    size_t const rx_buffer_size { 256 };
+    u8 rx_buffer[rx_buffer_size] {0};
+    u8 const * rx_data {rx_buffer};
+    size_t rx_length {0};
+
+    // Pipelined mode : CONTROL_SEQ frames sent and not acknowledged yet, oldest first
+    struct in_flight_frame
+    {
+        u8 sequence;
+        int64_t tx_time_ns;
+    };
+    in_flight_frame in_flight[MAX_PIPELINE_DEPTH];
+    size_t in_flight_count {0};
+
+    // Position of a sequence number in the frames in flight, -1 if not in flight
+    auto find_in_flight = [&](int sequence) -> int
+    {
+        for(size_t index=0; index<in_flight_count; ++index)
+        {
+            if(in_flight[index].sequence==sequence) return (int)index;
+        }
+        return -1;
+    };
+
+    // Last decoded acknowledge
+    control_acknowledge ack;
+    int ack_sequence {-1};
+
+    // Host protocol version in use, negotiated with PROTOCOL frames sent before CONTROL frames
+    int protocol_version {HOST_PROTOCOL_VERSION_1};
+    int protocol_attempts {requested_protocol_version>HOST_PROTOCOL_VERSION_1 ? 0 : protocol_max_attempts};
+    int64_t protocol_retry_ns {0};
+
+    // Acknowledge fields in use, negotiated with a SET_CONFIG request once the protocol version 2 is in use
+    // - 0 : fields of the protocol version
+    uint32_t feedback_fields {0};
+    int feedback_fields_attempts {0};
+    int64_t feedback_fields_retry_ns {0};
+
+    // ESP32 timing (host protocol version 2)
+    esp32_clock clock;
+    uint32_t last_frame_counter {0};
+
+    // Instruction of the request sent to the ESP32 and not replied yet, -1 if none, the request and its reply
+    int request_instruction {-1};
+    u8 const * request_sent {nullptr};
+    size_t request_sent_length {0};
+    u8 request_reply[ESP32_REQUEST_MAX_LENGTH];
+    size_t request_reply_length {0};
+
+    // Decode the buffered bytes up to the next valid CONTROL or CONTROL_SEQ acknowledge (copied into ack and snapshot)
+    // - return false when all the buffered bytes are decoded
+    // - every complete frame is recorded, a valid acknowledge as ack_event
+    // - a CONTROL_SEQ acknowledge whose frame is not in flight anymore is recorded as a late acknowledge
+    // - a reply to a PROTOCOL frame sets the protocol version in use, and the fields of this version
+    // - a reply to a request is kept in request_reply
+    // - an acknowledge of the protocol version layout while other fields are in use tells the ESP32
+    //   restarted : the fields are negotiated again
+    auto decode_acknowledge = [&](flight_event ack_event) -> bool
+    {
+        protocol_frame rx_frame;
+        protocol_parser_status status;
+        while((status=parser.parse(rx_data,rx_length,rx_frame))!=PROTOCOL_NEED_DATA)
+        {
+            u8 const * const payload {rx_frame.payload};
+            u8 const payload_length {rx_frame.payload_length};
+
+            // record the frame as received
+            u8 frame[4+protocol_parser::MAX_PAYLOAD_LENGTH] { 0xFF, 0xFF, 0x01, payload_length };
+            memcpy(frame+4, payload, payload_length);
+            size_t const frame_length { (size_t)4+payload_length };
+            if(status==PROTOCOL_CHECKSUM_ERROR)
+            {
+                recorder.record(FLIGHT_RX_CHECKSUM_ERROR, monotonic_time_ns(), tx_count, frame, frame_length);
+                continue;
+            }
 
-        /*
-         * Encode a CONTROL frame
-         */
+            // reply to a request : status, instruction, parameters
+            // - requests are sent with no CONTROL frame in flight, only a late acknowledge may come meanwhile
+            if(request_instruction>=0 && is_request_reply(request_sent, request_sent_length, payload, payload_length, feedback_fields))
+            {
+                recorder.record(FLIGHT_RX_REPLY, monotonic_time_ns(), tx_count, frame, frame_length);
+                request_reply_length = payload_length-1;
+                memcpy(request_reply, payload, request_reply_length);
+                request_instruction = -1;
+                continue;
+            }
+
+            // reply to a PROTOCOL frame : status, version
+            if(payload[0]==0x00 && payload_length==1+1+1 && payload[1]>=HOST_PROTOCOL_VERSION_1 && payload[1]<=HOST_PROTOCOL_VERSION)
+            {
+                recorder.record(FLIGHT_RX_REPLY, monotonic_time_ns(), tx_count, frame, frame_length);
+                protocol_version = payload[1];
+                protocol_attempts = protocol_max_attempts;
+                feedback_fields = 0;
+                feedback_fields_attempts = 0;
+                printf("esp32_protocol: host protocol version %d\n", protocol_version);
+                fflush(stdout);
+                continue;
+            }
+
+            // waiting for a valid status and parameters length (with or without sequence number, fields in use)
+            bool rx_payload_check { decode_control_acknowledge(payload, payload_length, feedback_fields, ack) };
+            if(!rx_payload_check && feedback_fields!=0 && decode_control_acknowledge(payload, payload_length, 0, ack))
+            {
+                printf("esp32_protocol: acknowledge fields reset by the ESP32\n");
+                fflush(stdout);
+                feedback_fields = 0;
+                feedback_fields_attempts = 0;
+                rx_payload_check = true;
+            }
+            ack_sequence = rx_payload_check ? ack.sequence : -1;
+            flight_event const event { rx_payload_check && ack_sequence>=0 && find_in_flight(ack_sequence)<0 ? FLIGHT_RX_LATE_ACK : ack_event };
+            recorder.record(rx_payload_check ? event : FLIGHT_RX_BAD_STATUS, monotonic_time_ns(), tx_count, frame, frame_length);
+            if(!rx_payload_check)
+            {
+                // log
+                if (print_debug)
+                {
+                    printf("RX frame error : bad status [%d] or length [%d]!\n",payload[0],payload_length);
+                }
+                parser.f_monitor.update(mini_pupper::frame_error_rate_monitor::SYNTAX_ERROR, false);
+                continue;
+            }
+            snapshot.feedback = ack.feedback;
+            snapshot.fields = ack.fields;
+            snapshot.extra = ack.extra;
+            return true;
+        }
+        return false;
+    };
+
+    // Convert the ESP32 times of the last decoded acknowledge, decoded at snapshot.timestamp_ns
+    // - host_tx_ns : time its CONTROL frame was sent, 0 if not known (late acknowledge)
+    auto update_timing = [&](int64_t host_tx_ns)
+    {
+        feedback_timing & timing = snapshot.timing;
+        memset(&timing, 0, sizeof(timing));
+        timing.protocol_version = ack.version;
+        if(ack.version<HOST_PROTOCOL_VERSION_2)
+        {
+            // the ESP32 restarted with version 1 : negotiate again (unless the fields in use have no timing)
+            if(protocol_version>=HOST_PROTOCOL_VERSION_2 && feedback_fields==0)
+            {
+                protocol_version = HOST_PROTOCOL_VERSION_1;
+                protocol_attempts = 0;
+            }
+            return;
+        }
+        protocol_version = ack.version;
+
+        // acknowledges lost on the way
+        timing.frame_counter = ack.timing.frame_counter;
+        uint32_t const frame_gap { ack.timing.frame_counter-last_frame_counter };
+        if(last_frame_counter!=0 && frame_gap>1 && frame_gap<0x10000)
+        {
+            control_block->link.acks_lost.store(control_block->link.acks_lost.load(std::memory_order_relaxed)+frame_gap-1, std::memory_order_relaxed);
+        }
+        last_frame_counter = ack.timing.frame_counter;
+
+        clock.update(host_tx_ns, snapshot.timestamp_ns, ack.timing.tx_time_us);
+        if(!clock.is_valid()) return;
+        timing.esp32_tx_time_ns = clock.to_monotonic_ns(ack.timing.tx_time_us);
+        timing.clock_uncertainty_ns = clock.uncertainty_ns();
+        control_block->link.transport_delay.record(snapshot.timestamp_ns-timing.esp32_tx_time_ns);
+        if(ack.timing.servo_time_us>0)
+        {
+            timing.servo_time_ns = clock.to_monotonic_ns(ack.timing.servo_time_us);
+            control_block->link.feedback_age.record(snapshot.timestamp_ns-timing.servo_time_ns);
+        }
+        if(ack.timing.imu_time_us>0) timing.imu_time_ns = clock.to_monotonic_ns(ack.timing.imu_time_us);
+    };
+
+    // Publish the decoded feedback as a new generation
+    auto publish = [&]()
+    {
+        ++snapshot.generation;
+        snapshot.timing.generation = snapshot.generation;
+        publish_feedback(control_block, snapshot);
+        if(control_block->feedback_subscribers.load(std::memory_order_relaxed)>0)
+        {
+            eventfd_write(feedback_event_fd, 1);
+        }
+    };
+
+    // Encode and send a CONTROL frame, or a CONTROL_SEQ frame when sequence>=0, return the time it was sent
+    auto send_control = [&](int sequence) -> int64_t
+    {
+        // Request the host protocol version first, until the ESP32 replies
+        if(protocol_version<requested_protocol_version && protocol_attempts<protocol_max_attempts && monotonic_time_ns()>=protocol_retry_ns)
+        {
+            u8 request[4+1+1+1] { 0xFF, 0xFF, 0x01, 1+1+1, INST_PROTOCOL, (u8)requested_protocol_version };
+            request[sizeof(request)-1] = compute_checksum(request);
+            if(!write_frame(fd, request, sizeof(request)))
+            {
+                printf("failed to write to port");
+                close(fd);
+                exit(EXIT_FAILURE);
+            }
+            recorder.record(FLIGHT_TX_REQUEST, monotonic_time_ns(), tx_count, request, sizeof(request));
+            ++protocol_attempts;
+            protocol_retry_ns = monotonic_time_ns() + 1000000000LL;
+        }
+
+        size_t const sequence_length { sequence>=0 ? (size_t)1 : (size_t)0 };
 
         // Compute the size of the payload (parameters length + 2)
-        size_t const tx_payload_length { sizeof(parameters_control_instruction_format) + 2 };
+        size_t const tx_payload_length { sequence_length + sizeof(parameters_control_instruction_format) + 2 };
 
         // Compute the size of the frame
         size_t const tx_buffer_size { tx_payload_length + 4 };
 
         // Build the frame
-        u8 tx_buffer[tx_buffer_size]
+        u8 tx_buffer[4 + 1 + 1 + sizeof(parameters_control_instruction_format) + 1]
         {
-            0xFF,               // header
-            0xFF,               // header
-            0x01,               // default ID
-            tx_payload_length,  // length
-            INST_CONTROL        // instruction
+            0xFF,                                                   // header
+            0xFF,                                                   // header
+            0x01,                                                   // default ID
+            (u8)tx_payload_length,                                  // length
+            (u8)(sequence>=0 ? INST_CONTROL_SEQ : INST_CONTROL),    // instruction
+            (u8)sequence                                            // sequence number (CONTROL_SEQ only)
         };
-        memcpy(tx_buffer+5,&control_block->control,sizeof(parameters_control_instruction_format));
+        arbiter.select(control_block, snapshot.generation>0 ? snapshot.feedback.present_position : nullptr, control);
+        memcpy(tx_buffer+5+sequence_length,&control,sizeof(parameters_control_instruction_format));
 
         // Checksum
         tx_buffer[tx_buffer_size-1] = compute_checksum(tx_buffer);
 
         // Send
-        result = write(fd, (char *)tx_buffer, tx_buffer_size);
-        if(result != (ssize_t)tx_buffer_size)
+        if(!write_frame(fd, tx_buffer, tx_buffer_size))
         {
             printf("failed to write to port");
             close(fd);
@@ -162,141 +590,1148 @@ void esp32_protocol(setpoint_and_feedback_data * control_block)
         }
         if (print_debug_max)
         {
-    	    printf("uart writen:%d\n",result);
-    	}
-
-        /*
-        result = tcdrain(fd);
-        if(result)
+            printf("uart writen:%lu\n",tx_buffer_size);
+        }
+        int64_t const tx_time_ns { monotonic_time_ns() };
+        recorder.record(FLIGHT_TX_CONTROL, tx_time_ns, ++tx_count, tx_buffer, tx_buffer_size);
+        control_block->link.frames_sent.store(control_block->link.frames_sent.load(std::memory_order_relaxed)+1, std::memory_order_relaxed);
+        return tx_time_ns;
+    };
+
+    // Fixed-rate mode : account the expirations of the periodic timer
+    auto account_period = [&](uint64_t expirations)
+    {
+        int64_t const jitter_ns { monotonic_time_ns() - (period_deadline_ns + (int64_t)(expirations-1)*period_ns) };
+        period_deadline_ns += (int64_t)expirations*period_ns;
+        sched_stats.overruns += expirations-1;
+        sched_stats.jitter_last_ns = jitter_ns;
+        sched_stats.jitter_mean_ns = sched_stats.cycles==0 ? jitter_ns : (sched_stats.jitter_mean_ns*63 + jitter_ns)/64;
+        if(jitter_ns>sched_stats.jitter_max_ns) sched_stats.jitter_max_ns = jitter_ns;
+    };
+
+    // An exchange not acknowledged in time
+    auto time_out = [&]()
+    {
+        parser.f_monitor.update(mini_pupper::frame_error_rate_monitor::TIME_OUT_ERROR);
+        recorder.record(FLIGHT_TIME_OUT, monotonic_time_ns(), tx_count, NULL, 0);
+        if(timer_fd>=0) ++sched_stats.deadline_misses;
+    };
+
+    // Send a request (instruction, parameters) and wait for its reply, with no CONTROL frame in flight
+    // - return true when replied, the reply is in request_reply
+    // - the acknowledges decoded meanwhile are late acknowledges
+    auto exchange_request = [&](u8 const * request_payload, size_t request_payload_length) -> bool
+    {
+        size_t const request_size { 4+request_payload_length+1 };
+        u8 request[4+ESP32_REQUEST_MAX_LENGTH+1] { 0xFF, 0xFF, 0x01, (u8)(request_payload_length+1) };
+        memcpy(request+4, request_payload, request_payload_length);
+        request[request_size-1] = compute_checksum(request);
+        request_reply_length = 0;
+        request_instruction = request_payload[0];
+        request_sent = request_payload;
+        request_sent_length = request_payload_length;
+        if(!write_frame(fd, request, request_size))
         {
-            printf("failed to drain port");
+            printf("failed to write to port");
             close(fd);
             exit(EXIT_FAILURE);
         }
-        */
+        recorder.record(FLIGHT_TX_REQUEST, monotonic_time_ns(), tx_count, request, request_size);
 
-        // Read buffer
-    	// If we do not get data within 1 second we assume ESP32 stopped sending and we send again
-        size_t const rx_buffer_size { 128 };
-        u8 rx_buffer[rx_buffer_size] {0};
-    	size_t const expected_lenght {4 + 1 + sizeof(parameters_control_acknowledge_format) + 1}; // header + status + pos + load + chksum
-        size_t received_length {0};
-    	while(received_length<expected_lenght)
+        bool late_acknowledge {false};
+        int64_t const deadline_ns { monotonic_time_ns() + request_timeout_ms*1000000LL };
+        for(;;)
         {
-            ssize_t read_length = read(
-                fd,
-                (char*)(rx_buffer+received_length),
-                expected_lenght-received_length
-            );
+            while(decode_acknowledge(FLIGHT_RX_LATE_ACK)) late_acknowledge = true;
+            if(request_instruction<0) break; // replied
+            int64_t const remaining_ns { deadline_ns - monotonic_time_ns() };
+            if(remaining_ns<=0) break;
+            struct pollfd pfd { fd, POLLIN, 0 };
+            int const ready = poll(&pfd, 1, (int)((remaining_ns+999999)/1000000));
+            if(ready<0)
+            {
+                if(errno==EINTR) continue;
+                printf("failed to poll port");
+                close(fd);
+                exit(EXIT_FAILURE);
+            }
+            if(ready==0) break; // time out
+            ssize_t const read_length = read(fd, (char*)rx_buffer, rx_buffer_size);
             if(read_length<0)
             {
+                if(errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR) continue;
                 printf("failed to read from port");
                 close(fd);
                 exit(EXIT_FAILURE);
             }
-            if (print_debug_max)
+            rx_data = rx_buffer;
+            rx_length = read_length;
+        }
+        bool const replied { request_instruction<0 };
+        request_instruction = -1;
+        if(late_acknowledge)
+        {
+            snapshot.timestamp_ns = monotonic_time_ns();
+            update_timing(0);
+            publish();
+        }
+        return replied;
+    };
+
+    // Forward the request posted by the server and post its reply
+    auto forward_request = [&]()
+    {
+        esp32_request & mailbox = control_block->request;
+        bool const replied { exchange_request(mailbox.request, mailbox.request_length) };
+
+        // the server forwards the reply (reply_length 0 : no reply in time)
+        mailbox.reply_length = replied ? (u8)request_reply_length : 0;
+        memcpy(mailbox.reply, request_reply, mailbox.reply_length);
+        mailbox.state.store(ESP32_REQUEST_DONE, std::memory_order_release);
+        eventfd_write(feedback_event_fd, 1);
+    };
+
+    // Acknowledge fields to negotiate : requested, protocol version 2 in use, ESP32 not given up
+    auto feedback_fields_due = [&]() -> bool
+    {
+        return requested_feedback_fields!=0 && feedback_fields==0 && protocol_version>=HOST_PROTOCOL_VERSION_2
+            && feedback_fields_attempts<protocol_max_attempts && monotonic_time_ns()>=feedback_fields_retry_ns;
+    };
+
+    // Request the acknowledge fields (SET_CONFIG), with no CONTROL frame in flight
+    // - a NACK keeps the fields of the protocol version (older firmware)
+    auto negotiate_feedback_fields = [&]()
+    {
+        ++feedback_fields_attempts;
+        feedback_fields_retry_ns = monotonic_time_ns() + 1000000000LL;
+        u8 request[1+1+4] { INST_SET_CONFIG, HOST_CONFIG_FEEDBACK_FIELDS };
+        memcpy(request+2, &requested_feedback_fields, 4);
+        if(!exchange_request(request, sizeof(request))) return; // no reply, sent again later
+        if(request_reply_length==1+1+1+4 && request_reply[0]==HOST_STATUS_OK && request_reply[2]==HOST_CONFIG_FEEDBACK_FIELDS)
+        {
+            memcpy(&feedback_fields, request_reply+3, 4);
+            printf("esp32_protocol: acknowledge fields 0x%x (%zu bytes)\n", feedback_fields, feedback_fields_size(feedback_fields));
+        }
+        else
+        {
+            feedback_fields_attempts = protocol_max_attempts;
+            printf("esp32_protocol: acknowledge fields not supported by the ESP32\n");
+        }
+        fflush(stdout);
+    };
+
+    /*
+     * Pipelined control-loop : up to pipeline_depth CONTROL_SEQ frames in flight, so that the
+     * next frame is on the UART while the ESP32 processes the previous one.
+     * The ESP32 acknowledges the frames in order, echoing their sequence number : an acknowledge
+     * also tells that the older frames still in flight were lost. A frame not acknowledged within
+     * ack_timeout_ms is given up. In fixed-rate mode, one frame is sent per period, and the period
+     * is a deadline miss when pipeline_depth frames are still in flight.
+     */
+    if(pipeline_depth>1)
+    {
+        sched_stats.pipeline_depth = pipeline_depth;
+        control_block->scheduler.write(sched_stats);
+        bool sequence_echoed {false};
+        bool send_due {true};
+        u8 next_sequence {0};
+        for(;;)
+        {
+            // give up the frames not acknowledged in time
+            int64_t const now_ns { monotonic_time_ns() };
+            while(in_flight_count>0 && now_ns-in_flight[0].tx_time_ns>=ack_timeout_ms*1000000LL)
+            {
+                memmove(in_flight, in_flight+1, (--in_flight_count)*sizeof(in_flight_frame));
+                time_out();
+            }
+
+            // ESP32 firmware without CONTROL_SEQ : fall back to stop-and-wait CONTROL exchanges
+            if(!sequence_echoed && tx_count>=pipeline_probe_frames)
+            {
+                printf("%s: no sequence number echoed by the ESP32, pipelining disabled\n", __func__);
+                fflush(stdout);
+                break;
+            }
+
+            // forward a request posted by the server, or negotiate the acknowledge fields, once the pipeline is drained
+            bool const request_pending { control_block->request.state.load(std::memory_order_acquire)==ESP32_REQUEST_PENDING
+                || feedback_fields_due() };
+            if(request_pending && in_flight_count==0)
+            {
+                if(feedback_fields_due()) negotiate_feedback_fields();
+                else forward_request();
+                continue;
+            }
+
+            // send the next frame (free-running : fill the pipeline)
+            if(send_due && !request_pending && in_flight_count<(size_t)pipeline_depth)
+            {
+                in_flight[in_flight_count].sequence = next_sequence;
+                in_flight[in_flight_count].tx_time_ns = send_control(next_sequence);
+                ++in_flight_count;
+                ++next_sequence;
+                ++sched_stats.cycles;
+                control_block->scheduler.write(sched_stats);
+                send_due = timer_fd<0;
+                continue;
+            }
+
+            // wait for bytes, the next period or the time-out of the oldest frame
+            int timeout_ms {-1};
+            if(in_flight_count>0)
+            {
+                int64_t const remaining_ns { in_flight[0].tx_time_ns + ack_timeout_ms*1000000LL - now_ns };
+                timeout_ms = (int)((remaining_ns+999999)/1000000);
+            }
+            struct pollfd pfd[2] { { fd, POLLIN, 0 }, { timer_fd, POLLIN, 0 } };
+            int const ready = poll(pfd, timer_fd>=0 ? 2 : 1, timeout_ms);
+            if(ready<0)
+            {
+                if(errno==EINTR) continue;
+                printf("failed to poll port");
+                close(fd);
+                exit(EXIT_FAILURE);
+            }
+
+            // Fixed-rate mode : next period
+            if(timer_fd>=0 && (pfd[1].revents & POLLIN))
             {
-                printf("uart read:%lu, waiting for %lu/%lu\n",read_length, received_length,expected_lenght);
+                uint64_t expirations {0};
+                if(read(timer_fd, &expirations, sizeof(expirations))==sizeof(expirations))
+                {
+                    account_period(expirations);
+                    if(send_due) ++sched_stats.deadline_misses; // pipeline still full since the previous period
+                    send_due = true;
+                }
             }
-            if(read_length==0)
+
+            // decode the acknowledges
+            if(pfd[0].revents & POLLIN)
             {
-              // time out
-              break;
+                ssize_t const read_length = read(fd, (char*)rx_buffer, rx_buffer_size);
+                if(read_length<0 && errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR)
+                {
+                    printf("failed to read from port");
+                    close(fd);
+                    exit(EXIT_FAILURE);
+                }
+                rx_data = rx_buffer;
+                rx_length = read_length>0 ? read_length : 0;
+                while(decode_acknowledge(FLIGHT_RX_ACK))
+                {
+                    snapshot.timestamp_ns = monotonic_time_ns();
+                    if(ack_sequence>=0) sequence_echoed = true;
+                    int const position { ack_sequence>=0 ? find_in_flight(ack_sequence) : -1 };
+                    int64_t host_tx_ns {0};
+                    if(position>=0)
+                    {
+                        // the older frames in flight will not be acknowledged anymore
+                        for(int lost=0; lost<position; ++lost) time_out();
+                        host_tx_ns = in_flight[position].tx_time_ns;
+                        control_block->link.rtt.record(snapshot.timestamp_ns-host_tx_ns);
+                        in_flight_count -= position+1;
+                        memmove(in_flight, in_flight+position+1, in_flight_count*sizeof(in_flight_frame));
+                    }
+                    update_timing(host_tx_ns);
+                    publish();
+                }
             }
-    	    received_length += read_length;
-    	}
 
-        // not enough data received ?
-    	if(received_length<expected_lenght) continue;
+            // stats
+            control_block->link.update_rx_counters(parser.f_monitor);
+            control_block->scheduler.write(sched_stats);
+        }
+        in_flight_count = 0;
+        sched_stats.pipeline_depth = 1;
+        control_block->scheduler.write(sched_stats);
+    }
+
+    // control-loop
+    for (;;)
+    {
+        // heart-beat
+        if (print_debug_max)
+        {
+            printf(".");
+        }
+
+        // Fixed-rate mode : wait for the next period
+        if(timer_fd>=0)
+        {
+            uint64_t expirations {0};
+            if(read(timer_fd, &expirations, sizeof(expirations))!=sizeof(expirations))
+            {
+                if(errno==EINTR) continue;
+                printf("failed to read timer");
+                close(fd);
+                exit(EXIT_FAILURE);
+            }
+            account_period(expirations);
+        }
 
         /*
-         * Decode a CONTROL ACK frame
+         * Acknowledges of timed-out exchanges may still be on their way : decode whatever
+         * arrived since the last acknowledge, so that a late one is never taken for the
+         * acknowledge of the next CONTROL frame. Its feedback is still published.
          */
 
-        bool const rx_header_check {
-                    (rx_buffer[0]==0xFF)
-                &&  (rx_buffer[1]==0xFF)
-                &&  (rx_buffer[2]==0x01) // my ID
-                &&  (rx_buffer[3]<=(rx_buffer_size-4)) // keep the header in the rx buffer
-        };
-        if(!rx_header_check)
+        bool late_acknowledge {false};
+        for(;;)
         {
-            // log
-            if (print_debug)
-    	    {
-                printf("RX frame error : header invalid!\n");
-    	    }
-            // next
-            continue;
+            while(decode_acknowledge(FLIGHT_RX_LATE_ACK)) late_acknowledge = true;
+            ssize_t const read_length = read(fd, (char*)rx_buffer, rx_buffer_size);
+            if(read_length<=0) break;
+            rx_data = rx_buffer;
+            rx_length = read_length;
+        }
+        if(late_acknowledge)
+        {
+            snapshot.timestamp_ns = monotonic_time_ns();
+            update_timing(0);
+            publish();
         }
 
-        // checksum
-        u8 expected_checksum {0};
-        bool const rx_checksum {checksum(rx_buffer,expected_checksum)};
+        /*
+         * Negotiate the acknowledge fields, forward a request posted by the server, then send a CONTROL frame
+         */
 
-        // waiting for a valid instruction and checksum...
-        bool const rx_payload_checksum_check {
-                    (rx_buffer[4]==0x00)
-                &&  rx_checksum
-        };
-        if(!rx_payload_checksum_check)
+        if(feedback_fields_due())
+        {
+            negotiate_feedback_fields();
+        }
+        if(control_block->request.state.load(std::memory_order_acquire)==ESP32_REQUEST_PENDING)
+        {
+            forward_request();
+        }
+
+        int64_t const tx_time_ns { send_control(-1) };
+
+        /*
+         * Wait for the CONTROL ACK frame, decoding bytes as they arrive.
+         * If we do not get a valid acknowledge within ack_timeout_ms, we assume the frame
+         * or its acknowledge was lost and we send again.
+         */
+
+        bool acknowledged {false};
+        int64_t const deadline_ns { timer_fd>=0 ? period_deadline_ns : monotonic_time_ns() + ack_timeout_ms*1000000LL };
+        while(!acknowledged)
+        {
+            // decode buffered bytes
+            acknowledged = decode_acknowledge(FLIGHT_RX_ACK);
+            if(acknowledged)
+            {
+                snapshot.timestamp_ns = monotonic_time_ns();
+                control_block->link.rtt.record(snapshot.timestamp_ns-tx_time_ns);
+                update_timing(tx_time_ns);
+                publish();
+                break;
+            }
+
+            // all bytes decoded
+            // wait for more bytes
+            int64_t const remaining_ns { deadline_ns - monotonic_time_ns() };
+            if(remaining_ns<=0) break;
+            struct pollfd pfd { fd, POLLIN, 0 };
+            int const ready = poll(&pfd, 1, (int)((remaining_ns+999999)/1000000));
+            if(ready<0)
+            {
+                if(errno==EINTR) continue;
+                printf("failed to poll port");
+                close(fd);
+                exit(EXIT_FAILURE);
+            }
+            if(ready==0) break; // time out
+
+            ssize_t const read_length = read(fd, (char*)rx_buffer, rx_buffer_size);
+            if(read_length<0)
+            {
+                if(errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR) continue;
+                printf("failed to read from port");
+                close(fd);
+                exit(EXIT_FAILURE);
+            }
+            if (print_debug_max)
+            {
+                printf("uart read:%ld\n",read_length);
+            }
+            rx_data = rx_buffer;
+            rx_length = read_length;
+        }
+
+        // stats
+        if(!acknowledged) time_out();
+        control_block->link.update_rx_counters(parser.f_monitor);
+        ++sched_stats.cycles;
+        control_block->scheduler.write(sched_stats);
+
+        // not acknowledged in time ?
+        if(!acknowledged)
         {
-            // log
             if (print_debug)
-    	    {
-                    printf("RX frame error : bad instruction [%d] or checksum [received:%d,expected:%d]!\n",rx_buffer[4],rx_buffer[rx_buffer[3]+3],expected_checksum);
-    	    }
-            // next
+            {
+                printf("RX frame error : time-out!\n");
+            }
             continue;
         }
 
-        // decode parameters
-        memcpy(&control_block->feedback,rx_buffer+5,sizeof(parameters_control_acknowledge_format));
-
         // log
         if (print_debug)
     	{
             printf("Present Position: %d %d %d %d %d %d %d %d %d %d %d %d\n",
-            control_block->feedback.present_position[0],control_block->feedback.present_position[1],control_block->feedback.present_position[2],
-            control_block->feedback.present_position[3],control_block->feedback.present_position[4],control_block->feedback.present_position[5],
-            control_block->feedback.present_position[6],control_block->feedback.present_position[7],control_block->feedback.present_position[8],
-            control_block->feedback.present_position[9],control_block->feedback.present_position[10],control_block->feedback.present_position[11]
+            snapshot.feedback.present_position[0],snapshot.feedback.present_position[1],snapshot.feedback.present_position[2],
+            snapshot.feedback.present_position[3],snapshot.feedback.present_position[4],snapshot.feedback.present_position[5],
+            snapshot.feedback.present_position[6],snapshot.feedback.present_position[7],snapshot.feedback.present_position[8],
+            snapshot.feedback.present_position[9],snapshot.feedback.present_position[10],snapshot.feedback.present_position[11]
             );
             printf("            Load: %d %d %d %d %d %d %d %d %d %d %d %d\n",
-            control_block->feedback.present_load[0],control_block->feedback.present_load[1],control_block->feedback.present_load[2],
-            control_block->feedback.present_load[3],control_block->feedback.present_load[4],control_block->feedback.present_load[5],
-            control_block->feedback.present_load[6],control_block->feedback.present_load[7],control_block->feedback.present_load[8],
-            control_block->feedback.present_load[9],control_block->feedback.present_load[10],control_block->feedback.present_load[11]
+            snapshot.feedback.present_load[0],snapshot.feedback.present_load[1],snapshot.feedback.present_load[2],
+            snapshot.feedback.present_load[3],snapshot.feedback.present_load[4],snapshot.feedback.present_load[5],
+            snapshot.feedback.present_load[6],snapshot.feedback.present_load[7],snapshot.feedback.present_load[8],
+            snapshot.feedback.present_load[9],snapshot.feedback.present_load[10],snapshot.feedback.present_load[11]
             );
 
             printf("Attitude:  ax:%.3f  ay:%.3f  az:%.3f  gx:%.3f  gy:%.3f  gz:%.3f\n",
-                control_block->feedback.ax, control_block->feedback.ay, control_block->feedback.az,
-                control_block->feedback.gx, control_block->feedback.gy, control_block->feedback.gz
+                snapshot.feedback.ax, snapshot.feedback.ay, snapshot.feedback.az,
+                snapshot.feedback.gx, snapshot.feedback.gy, snapshot.feedback.gz
             );
-            printf("Power:  %.3fV  %.3fA\n", control_block->feedback.voltage_V, control_block->feedback.current_A);
+            printf("Power:  %.3fV  %.3fA\n", snapshot.feedback.voltage_V, snapshot.feedback.current_A);
 	   }
     }
 }
 
+// Replay of a flight recording, instead of the ESP32 link
+// - parameter (input/output) : the client/server shared-memory buffer
+// - parameter (input) : an eventfd signaled on each new feedback generation when the server has subscribers
+// The recorded acknowledges are published in order, the setpoints written by the clients are
+// recorded (as CONTROL frames) by the flight recorder. The task exits at the end of the recording,
+// the server keeps serving the last feedback.
+void esp32_replay(setpoint_and_feedback_data * control_block, int feedback_event_fd)
+{
+    // Check control block once
+    if(control_block==NULL) exit(EXIT_FAILURE);
+
+    // Load the acknowledges of the recording, before the flight recorder may rotate the same file
+    std::vector<flight_record> records;
+    std::vector<uint32_t> record_fields;
+    {
+        std::vector<flight_record> all_records;
+        uint64_t first_index {0};
+        int64_t realtime_offset_ns {0};
+        if(!load_flight_recording(replay_filename, all_records, first_index, realtime_offset_ns)) exit(EXIT_FAILURE);
+        // the acknowledges are kept with the fields in use when they were recorded
+        control_acknowledge ack;
+        flight_feedback_fields fields;
+        for(auto const & record : all_records)
+        {
+            fields.update(record);
+            if(!decode_flight_acknowledge(record, fields.fields, ack)) continue;
+            records.push_back(record);
+            record_fields.push_back(fields.fields);
+        }
+    }
+    if(records.empty())
+    {
+        printf("%s: no acknowledge to replay in %s\n", __func__, replay_filename);
+        exit(EXIT_FAILURE);
+    }
+
+    flight_recorder recorder;
+    if(recorder_capacity>0 && !recorder.open(recorder_filename, recorder_capacity))
+    {
+        printf("%s: flight recorder disabled\n", __func__);
+    }
+
+    setup_realtime();
+
+    parameters_control_instruction_format control;
+    setpoint_arbiter arbiter;
+    feedback_snapshot snapshot;
+    scheduler_stats sched_stats;
+    memset(&sched_stats, 0, sizeof(sched_stats));
+    control_block->scheduler.write(sched_stats);
+
+    int64_t const start_ns { monotonic_time_ns() };
+    uint32_t setpoint_sequence { legacy_setpoints_sequence(control_block) };
+    uint64_t lockstep_timeouts {0};
+    for(size_t index=0; index<records.size(); ++index)
+    {
+        flight_record const & record = records[index];
+
+        // pace the acknowledges
+        if(replay_mode==REPLAY_REALTIME)
+        {
+            int64_t const deadline_ns { start_ns + (record.timestamp_ns-records.front().timestamp_ns) };
+            struct timespec ts { (time_t)(deadline_ns/1000000000LL), (long)(deadline_ns%1000000000LL) };
+            while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)==EINTR);
+        }
+        else if(replay_mode==REPLAY_LOCKSTEP && snapshot.generation>0)
+        {
+            // wait for the clients to react to the previous feedback
+            int64_t const deadline_ns { monotonic_time_ns() + replay_lockstep_timeout_ms*1000000LL };
+            while(legacy_setpoints_sequence(control_block)==setpoint_sequence)
+            {
+                if(monotonic_time_ns()>deadline_ns)
+                {
+                    ++lockstep_timeouts;
+                    break;
+                }
+                struct timespec const ts {0, 20000};
+                nanosleep(&ts, NULL);
+            }
+            setpoint_sequence = legacy_setpoints_sequence(control_block);
+        }
+
+        // record the setpoints the ESP32 would have received
+        size_t const tx_payload_length { sizeof(parameters_control_instruction_format) + 2 };
+        size_t const tx_buffer_size { tx_payload_length + 4 };
+        u8 tx_buffer[tx_buffer_size] { 0xFF, 0xFF, 0x01, tx_payload_length, INST_CONTROL };
+        arbiter.select(control_block, snapshot.generation>0 ? snapshot.feedback.present_position : nullptr, control);
+        memcpy(tx_buffer+5,&control,sizeof(parameters_control_instruction_format));
+        tx_buffer[tx_buffer_size-1] = compute_checksum(tx_buffer);
+        int64_t const tx_time_ns { monotonic_time_ns() };
+        recorder.record(FLIGHT_TX_CONTROL, tx_time_ns, ++sched_stats.cycles, tx_buffer, tx_buffer_size);
+        control_block->link.frames_sent.store(sched_stats.cycles, std::memory_order_relaxed);
+
+        // publish the recorded feedback
+        control_acknowledge ack;
+        decode_flight_acknowledge(record, record_fields[index], ack);
+        snapshot.feedback = ack.feedback;
+        snapshot.fields = ack.fields;
+        snapshot.extra = ack.extra;
+        ++snapshot.generation;
+        // the recorded ESP32 times can not be converted to the time of the replay
+        snapshot.timing.generation = snapshot.generation;
+        snapshot.timing.protocol_version = ack.version;
+        snapshot.timing.frame_counter = ack.timing.frame_counter;
+        snapshot.timestamp_ns = monotonic_time_ns();
+        recorder.record(FLIGHT_RX_ACK, snapshot.timestamp_ns, sched_stats.cycles, record.frame, record.length);
+        publish_feedback(control_block, snapshot);
+        if(control_block->feedback_subscribers.load(std::memory_order_relaxed)>0)
+        {
+            eventfd_write(feedback_event_fd, 1);
+        }
+        control_block->scheduler.write(sched_stats);
+    }
+
+    double const elapsed_s { (double)(monotonic_time_ns()-start_ns)*1e-9 };
+    printf("%s: %zu acknowledges replayed in %.3fs (%.0f/s)", __func__, records.size(), elapsed_s, (double)records.size()/elapsed_s);
+    if(replay_mode==REPLAY_LOCKSTEP) printf(", %llu without client setpoint", (unsigned long long)lockstep_timeouts);
+    printf("\n");
+    exit(EXIT_SUCCESS);
+}
+
+// Per-client state of the socket server
+struct client_state
+{
+    int fd {-1};
+    // feedback subscription (0 : not subscribed)
+    u16 decimation {0};
+    uint64_t last_generation {0};
+    // setpoint lease (-1 : none, setpoints go to the legacy shared setpoints)
+    int lease_slot {-1};
+    uint32_t lease_owner {0};
+    u8 lease_priority {0};
+    u16 lease_ms {0};
+    // replies not sent yet (socket full), oldest first : EPOLLOUT is armed while not empty
+    std::deque<std::vector<u8>> pending;
+};
+
+// Request forwarded to the ESP32 on behalf of a client (INST_ESP32)
+struct forwarded_request
+{
+    int fd {-1};            // client, -1 once the client closed its socket
+    bool posted {false};    // in the request mailbox
+    u8 length {0};
+    u8 payload[ESP32_REQUEST_MAX_LENGTH];
+};
+
+// Count of subscribed clients, mirrored in the control block for the ESP32 task
+static void update_subscribers(setpoint_and_feedback_data * control_block, std::map<int,client_state> const & clients)
+{
+    uint32_t subscribers {0};
+    for(auto const & client : clients)
+    {
+        if(client.second.decimation>0) ++subscribers;
+    }
+    control_block->feedback_subscribers.store(subscribers, std::memory_order_relaxed);
+}
+
+// Build a feedback packet
+// - return the length of the packet written into s_buffer
+static size_t encode_feedback(feedback_snapshot const & snapshot, u8 instruction, u8 * s_buffer)
+{
+    feedback_packet packet;
+    packet.generation = snapshot.generation;
+    packet.timestamp_ns = snapshot.timestamp_ns;
+    packet.feedback = snapshot.feedback;
+    s_buffer[0]= 2 + sizeof(feedback_packet);
+    s_buffer[1]= instruction;
+    memcpy(&s_buffer[2], &packet, sizeof(feedback_packet));
+    return s_buffer[0];
+}
+
+// Send a packet to a client, queued while its socket is full
+// - return false when the client terminated or does not read its replies : it must be closed
+static bool send_packet(int epoll_fd, client_state & client, u8 const * buffer, size_t length)
+{
+    if(client.pending.empty())
+    {
+        if(send(client.fd, buffer, length, MSG_NOSIGNAL | MSG_DONTWAIT)!=-1) return true;
+        if(errno!=EAGAIN && errno!=EWOULDBLOCK) return false;
+        // wait for the socket to be writable
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLOUT;
+        event.data.fd = client.fd;
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client.fd, &event)==-1) return false;
+    }
+    if(client.pending.size()>=MAX_PENDING_PACKETS) return false;
+    client.pending.emplace_back(buffer, buffer+length);
+    return true;
+}
+
+// Send the queued packets of a client, once its socket is writable
+// - return false when the client terminated
+static bool flush_packets(int epoll_fd, client_state & client)
+{
+    while(!client.pending.empty())
+    {
+        std::vector<u8> const & packet = client.pending.front();
+        if(send(client.fd, packet.data(), packet.size(), MSG_NOSIGNAL | MSG_DONTWAIT)==-1)
+        {
+            return errno==EAGAIN || errno==EWOULDBLOCK;
+        }
+        client.pending.pop_front();
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = client.fd;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client.fd, &event)!=-1;
+}
+
+// Post the oldest forwarded request in the mailbox of the ESP32 task, once the mailbox is idle
+static void post_request(setpoint_and_feedback_data * control_block, std::deque<forwarded_request> & requests)
+{
+    esp32_request & mailbox = control_block->request;
+    if(requests.empty() || requests.front().posted) return;
+    if(mailbox.state.load(std::memory_order_acquire)!=ESP32_REQUEST_IDLE) return;
+    mailbox.request_length = requests.front().length;
+    memcpy(mailbox.request, requests.front().payload, requests.front().length);
+    requests.front().posted = true;
+    mailbox.state.store(ESP32_REQUEST_PENDING, std::memory_order_release);
+}
+
+// Forward the reply of the ESP32 to the client of the posted request, then post the next request
+// - return the client that must be closed, -1 if none
+static int complete_request(setpoint_and_feedback_data * control_block, int epoll_fd, std::map<int,client_state> & clients,
+    std::deque<forwarded_request> & requests)
+{
+    esp32_request & mailbox = control_block->request;
+    if(mailbox.state.load(std::memory_order_acquire)!=ESP32_REQUEST_DONE) return -1;
+    int terminated {-1};
+    if(!requests.empty() && requests.front().posted)
+    {
+        std::map<int,client_state>::iterator client = clients.find(requests.front().fd);
+        if(client!=clients.end())
+        {
+            u8 s_buffer[2+ESP32_REQUEST_MAX_LENGTH] { (u8)(2+mailbox.reply_length), INST_ESP32 };
+            memcpy(&s_buffer[2], mailbox.reply, mailbox.reply_length);
+            if(!send_packet(epoll_fd, client->second, s_buffer, s_buffer[0])) terminated = client->first;
+        }
+        requests.pop_front();
+    }
+    mailbox.state.store(ESP32_REQUEST_IDLE, std::memory_order_release);
+    post_request(control_block, requests);
+    return terminated;
+}
+
+// Build the reply to a malformed request or an unknown instruction
+static size_t encode_error(u8 const * r_buffer, size_t r_length, u8 * s_buffer)
+{
+    s_buffer[0]= 3;
+    s_buffer[1]= INST_ERROR;
+    s_buffer[2]= r_length>=2 ? r_buffer[1] : 0;
+    return s_buffer[0];
+}
+
+// Handle one client request
+// - return the length of the reply written into s_buffer, an INST_ERROR reply for a malformed request
+// - an ESP32 request is queued in requests, and replied later : 0 is returned
+static size_t handle_request(setpoint_and_feedback_data * control_block, client_state & client, std::deque<forwarded_request> & requests,
+    u8 const * r_buffer, size_t r_length, u8 * s_buffer)
+{
+    // reject runt packets
+    if(r_length<2 || r_buffer[0]!=r_length) return encode_error(r_buffer, r_length, s_buffer);
+
+    // setpoint instructions
+    if(r_buffer[1]==INST_SETPOS || r_buffer[1]==INST_SETPOS_GETALL)
+    {
+        if(r_buffer[0] != 2 + sizeof(parameters_control_instruction_format)) return encode_error(r_buffer, r_length, s_buffer);
+        parameters_control_instruction_format control;
+        memcpy(&control, &r_buffer[2], sizeof(parameters_control_instruction_format));
+        if(client.lease_slot<0)
+        {
+            control_block->control.write(control);
+        }
+        else if(!write_setpoint_slot(control_block, client.lease_slot, client.lease_owner, control))
+        {
+            // the lease expired and its slot was taken over : try to get another one, else drop the setpoints
+            client.lease_slot = acquire_setpoint_slot(control_block, client.lease_priority, client.lease_ms, client.lease_owner);
+            if(client.lease_slot>=0) write_setpoint_slot(control_block, client.lease_slot, client.lease_owner, control);
+        }
+        if(r_buffer[1]==INST_SETPOS)
+        {
+            s_buffer[0]= 2;
+            s_buffer[1]= INST_SETPOS;
+            return s_buffer[0];
+        }
+    }
+
+    // lease instruction
+    if(r_buffer[1]==INST_LEASE)
+    {
+        if(r_buffer[0] != 2 + sizeof(u8) + sizeof(u16)) return encode_error(r_buffer, r_length, s_buffer);
+        if(client.lease_slot>=0) release_setpoint_slot(control_block, client.lease_slot, client.lease_owner);
+        client.lease_slot = -1;
+        client.lease_priority = r_buffer[2];
+        memcpy(&client.lease_ms, &r_buffer[3], sizeof(u16));
+        if(client.lease_ms>0)
+        {
+            client.lease_slot = acquire_setpoint_slot(control_block, client.lease_priority, client.lease_ms, client.lease_owner);
+        }
+        s_buffer[0]= 3;
+        s_buffer[1]= INST_LEASE;
+        s_buffer[2]= (client.lease_ms==0 || client.lease_slot>=0) ? 1 : 0;
+        return s_buffer[0];
+    }
+
+    // trajectory instruction
+    if(r_buffer[1]==INST_TRAJECTORY)
+    {
+        if(r_buffer[0]<TRAJECTORY_PACKET_HEADER || (r_buffer[0]-TRAJECTORY_PACKET_HEADER)%TRAJECTORY_PACKET_POINT_SIZE!=0) return encode_error(r_buffer, r_length, s_buffer);
+        size_t const count { (size_t)(r_buffer[0]-TRAJECTORY_PACKET_HEADER)/TRAJECTORY_PACKET_POINT_SIZE };
+        if(count>TRAJECTORY_PACKET_POINTS) return encode_error(r_buffer, r_length, s_buffer);
+        bool const replace { r_buffer[2]==1 };
+        int64_t base_ns;
+        memcpy(&base_ns, &r_buffer[3], sizeof(int64_t));
+        trajectory_point points[TRAJECTORY_PACKET_POINTS];
+        for(size_t point=0; point<count; ++point)
+        {
+            u8 const * p_buffer { &r_buffer[TRAJECTORY_PACKET_HEADER+point*TRAJECTORY_PACKET_POINT_SIZE] };
+            uint32_t offset_us;
+            memcpy(&offset_us, p_buffer, sizeof(uint32_t));
+            points[point].target_ns = base_ns + (int64_t)offset_us*1000LL;
+            memcpy(points[point].control.torque_enable, &r_buffer[11], sizeof(points[point].control.torque_enable));
+            memcpy(points[point].control.goal_position, p_buffer+4, sizeof(points[point].control.goal_position));
+        }
+        int queued {0};
+        if(client.lease_slot>=0)
+        {
+            queued = push_trajectory(control_block, client.lease_slot, client.lease_owner, points, count, replace);
+            if(queued<0)
+            {
+                // the lease expired and its slot was taken over : try to get another one
+                client.lease_slot = acquire_setpoint_slot(control_block, client.lease_priority, client.lease_ms, client.lease_owner);
+                queued = client.lease_slot>=0 ? push_trajectory(control_block, client.lease_slot, client.lease_owner, points, count, replace) : 0;
+            }
+        }
+        s_buffer[0]= 3;
+        s_buffer[1]= INST_TRAJECTORY;
+        s_buffer[2]= queued>0 ? (u8)queued : 0;
+        return s_buffer[0];
+    }
+
+    // ESP32 request : forwarded by the ESP32 task between two CONTROL exchanges
+    if(r_buffer[1]==INST_ESP32)
+    {
+        size_t const length { (size_t)r_buffer[0]-2 };
+        u8 const instruction { length>0 ? r_buffer[2] : (u8)INST_CONTROL };
+        // the proxy owns the acknowledge layout
+        bool const sets_feedback_fields { instruction==INST_SET_CONFIG && length>1 && r_buffer[3]==HOST_CONFIG_FEEDBACK_FIELDS };
+        if(length==0 || length>ESP32_REQUEST_MAX_LENGTH || replay_filename!=nullptr || sets_feedback_fields
+            || instruction==INST_CONTROL || instruction==INST_CONTROL_SEQ || instruction==INST_PROTOCOL)
+        {
+            // no reply from the ESP32
+            s_buffer[0]= 2;
+            s_buffer[1]= INST_ESP32;
+            return s_buffer[0];
+        }
+        forwarded_request request;
+        request.fd = client.fd;
+        request.length = (u8)length;
+        memcpy(request.payload, &r_buffer[2], length);
+        requests.push_back(request);
+        post_request(control_block, requests);
+        return 0;
+    }
+
+    // subscribe instruction
+    if(r_buffer[1]==INST_SUBSCRIBE)
+    {
+        if(r_buffer[0] != 2 + sizeof(u16)) return encode_error(r_buffer, r_length, s_buffer);
+        memcpy(&client.decimation, &r_buffer[2], sizeof(u16));
+        feedback_snapshot snapshot;
+        control_block->feedback.read(snapshot);
+        client.last_generation = snapshot.generation;
+        s_buffer[0]= 2;
+        s_buffer[1]= INST_SUBSCRIBE;
+        return s_buffer[0];
+    }
+
+    // feedback instructions : all fields of a reply come from the same feedback generation
+    if(r_buffer[1]!=INST_SETPOS_GETALL && r_buffer[0]!=2) return encode_error(r_buffer, r_length, s_buffer);
+    feedback_snapshot snapshot;
+    control_block->feedback.read(snapshot);
+
+    switch(r_buffer[1])
+    {
+    case INST_GETSCHED:
+        {
+            scheduler_stats stats;
+            control_block->scheduler.read(stats);
+            s_buffer[0]= 2 + sizeof(scheduler_stats);
+            s_buffer[1]= INST_GETSCHED;
+            memcpy(&s_buffer[2], &stats, sizeof(scheduler_stats));
+        }
+        break;
+
+    case INST_GETSTATS:
+        {
+            link_stats_summary summary;
+            get_link_stats_summary(control_block->link, summary);
+            s_buffer[0]= 2 + sizeof(link_stats_summary);
+            s_buffer[1]= INST_GETSTATS;
+            memcpy(&s_buffer[2], &summary, sizeof(link_stats_summary));
+        }
+        break;
+
+    case INST_GETTIMING:
+        s_buffer[0]= 2 + sizeof(feedback_timing);
+        s_buffer[1]= INST_GETTIMING;
+        memcpy(&s_buffer[2], &snapshot.timing, sizeof(feedback_timing));
+        break;
+
+    case INST_GETEXTRA:
+        {
+            feedback_extra extra;
+            extra.generation = snapshot.generation;
+            extra.fields = snapshot.fields;
+            extra.extra = snapshot.extra;
+            s_buffer[0]= 2 + sizeof(feedback_extra);
+            s_buffer[1]= INST_GETEXTRA;
+            memcpy(&s_buffer[2], &extra, sizeof(feedback_extra));
+        }
+        break;
+
+    case INST_GETALL:
+    case INST_SETPOS_GETALL:
+        encode_feedback(snapshot, r_buffer[1], s_buffer);
+        break;
+
+    case INST_GETPOS:
+        s_buffer[0]= 2 + 12*sizeof(u16);
+        s_buffer[1]= INST_GETPOS;
+        memcpy(&s_buffer[2], snapshot.feedback.present_position, 12*sizeof(u16));
+        break;
+
+    case INST_GETLOAD:
+        s_buffer[0]= 2 + 12*sizeof(s16);
+        s_buffer[1]= INST_GETLOAD;
+        memcpy(&s_buffer[2], snapshot.feedback.present_load, 12*sizeof(s16));
+        break;
+
+    case INST_GETIMU:
+        s_buffer[0]= 2 + 6*sizeof(float);
+        s_buffer[1]= INST_GETIMU;
+        memcpy(&s_buffer[2], &snapshot.feedback.ax, 6*sizeof(float));
+        break;
+
+    case INST_GETPOWER:
+        s_buffer[0]= 2 + 2*sizeof(float);
+        s_buffer[1]= INST_GETPOWER;
+        memcpy(&s_buffer[2], &snapshot.feedback.voltage_V, 2*sizeof(float));
+        break;
+
+    default:
+        // unknown instruction
+        return encode_error(r_buffer, r_length, s_buffer);
+    }
+    return s_buffer[0];
+}
+
+// Close a client connection and forget its state
+// - its queued ESP32 requests are dropped, the reply of a posted one is ignored
+static void close_client(setpoint_and_feedback_data * control_block, int epoll_fd, std::map<int,client_state> & clients,
+    std::deque<forwarded_request> & requests, int fd)
+{
+    for(std::deque<forwarded_request>::iterator request = requests.begin(); request!=requests.end();)
+    {
+        if(request->fd!=fd) ++request;
+        else if(request->posted) (request++)->fd = -1;
+        else request = requests.erase(request);
+    }
+    std::map<int,client_state>::iterator client = clients.find(fd);
+    if(client!=clients.end() && client->second.lease_slot>=0)
+    {
+        release_setpoint_slot(control_block, client->second.lease_slot, client->second.lease_owner);
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    clients.erase(fd);
+}
+
+// Push the last feedback generation to subscribed clients, according to their decimation
+static void push_feedback(setpoint_and_feedback_data * control_block, std::map<int,client_state> & clients)
+{
+    feedback_snapshot snapshot;
+    control_block->feedback.read(snapshot);
+
+    u8 s_buffer[256];
+    size_t s_length {0};
+    for(auto & client : clients)
+    {
+        client_state & state = client.second;
+        if(state.decimation==0) continue;
+        if(snapshot.generation-state.last_generation < state.decimation) continue;
+        state.last_generation = snapshot.generation;
+        if(s_length==0) s_length = encode_feedback(snapshot, INST_FEEDBACK, s_buffer);
+        // never block the server on a slow subscriber : the packet is lost if its socket is full,
+        // or if replies are queued (they are never delayed by pushed packets), see INST_SUBSCRIBE
+        if(!state.pending.empty()) continue;
+        send(state.fd, s_buffer, s_length, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+}
+
+// Parse a comma separated list of acknowledge field names into a field mask
+// - "packed" stands for the fields of protocol version 2, packed
+// - the mask must fit in a frame, and have a position field : the present pose is held from it
+static bool parse_feedback_fields(char const * list, uint32_t & fields)
+{
+    fields = 0;
+    std::string const names { list };
+    size_t start {0};
+    while (start <= names.size()) {
+        size_t end { names.find(',', start) };
+        if (end == std::string::npos) end = names.size();
+        std::string const name { names.substr(start, end-start) };
+        start = end + 1;
+        if (name == "packed") {
+            fields |= FEEDBACK_FIELDS_PACKED;
+            continue;
+        }
+        size_t field {0};
+        while (field < FEEDBACK_FIELD_COUNT && name != feedback_fields[field].name) ++field;
+        if (field == FEEDBACK_FIELD_COUNT) {
+            fprintf(stderr, "unknown feedback field: %s\n", name.c_str());
+            return false;
+        }
+        fields |= 1u << field;
+    }
+    if (!is_valid_feedback_fields(fields) || !(fields & ((1u << FEEDBACK_POSITION) | (1u << FEEDBACK_POSITION_PACKED)))) {
+        fprintf(stderr, "invalid feedback fields: %s (%zu bytes, at most %d, position required)\n",
+            list, feedback_fields_size(fields), FEEDBACK_FIELDS_MAX_SIZE);
+        return false;
+    }
+    return true;
+}
+
+static void usage(char const * name)
+{
+    printf("usage: %s [options]\n", name);
+    printf("  --device <path>          UART device connected to the ESP32, default is %s\n", filename);
+    printf("  --rate <Hz>              fixed control rate (e.g. 250, 500, 1000), default is free-running\n");
+    printf("  --fifo <priority>        run the ESP32 control loop with SCHED_FIFO at this priority (1..99)\n");
+    printf("  --cpu <n>                pin the ESP32 control loop to CPU n\n");
+    printf("  --mlock                  lock the ESP32 control loop memory (mlockall)\n");
+    printf("  --pipeline <depth>       CONTROL frames kept in flight (1..%d), default is 1 (stop-and-wait)\n", MAX_PIPELINE_DEPTH);
+    printf("  --protocol <version>     host protocol version requested to the ESP32, default is %d\n", HOST_PROTOCOL_VERSION);
+    printf("                           (1 : no negotiation, 2 : timestamped acknowledges)\n");
+    printf("  --feedback <fields>      acknowledge fields requested to the ESP32 with protocol version 2, comma separated,\n");
+    printf("                           among");
+    for(auto const & field : feedback_fields) printf(" %s", field.name);
+    printf(",\n");
+    printf("                           or packed (packed_position,packed_load,raw_imu,packed_power,timing) ;\n");
+    printf("                           a position field is required, default is the fields of the protocol version\n");
+    printf("  --recorder <path>        flight recorder file, default is %s (tmpfs, lost on reboot)\n", recorder_filename);
+    printf("  --recorder-records <n>   flight recorder size in frames, default is %u, 0 disables it\n", recorder_capacity);
+    printf("  --group <name>           let the members of this group use the socket and the shared memory,\n");
+    printf("                           default is the owner only (created under the umask)\n");
+    printf("  --replay <path>          replay the acknowledges of a flight recording instead of the ESP32 link\n");
+    printf("  --replay-mode <mode>     realtime (recorded timing, default), fast (as fast as possible),\n");
+    printf("                           lockstep (next acknowledge once the clients wrote new setpoints)\n");
+}
+
 int main(int argc, char *argv[])
 {
-    // allocate a shared-memory buffer for setpoint and feedback data exchange between clients and server
-    void * control_block = mmap(NULL, sizeof(setpoint_and_feedback_data), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    /* parse command line */
+    static struct option const long_options[] = {
+        {"device", required_argument, 0, 'd'},
+        {"rate",  required_argument, 0, 'r'},
+        {"fifo",  required_argument, 0, 'f'},
+        {"cpu",   required_argument, 0, 'c'},
+        {"mlock", no_argument,       0, 'm'},
+        {"pipeline", required_argument, 0, 'p'},
+        {"protocol", required_argument, 0, 'V'},
+        {"feedback", required_argument, 0, 'F'},
+        {"recorder", required_argument, 0, 'R'},
+        {"recorder-records", required_argument, 0, 'N'},
+        {"replay", required_argument, 0, 'P'},
+        {"replay-mode", required_argument, 0, 'M'},
+        {"group", required_argument, 0, 'g'},
+        {"help",  no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+    for (;;) {
+        int c = getopt_long(argc, argv, "d:r:f:c:mp:V:F:R:N:P:M:g:h", long_options, NULL);
+        if (c == -1) break;
+        switch (c) {
+        case 'd':
+            filename = optarg;
+            break;
+        case 'r':
+            control_rate_hz = atoi(optarg);
+            break;
+        case 'f':
+            sched_fifo_priority = atoi(optarg);
+            break;
+        case 'c':
+            cpu_affinity = atoi(optarg);
+            break;
+        case 'm':
+            lock_memory = true;
+            break;
+        case 'p':
+            pipeline_depth = atoi(optarg);
+            break;
+        case 'V':
+            requested_protocol_version = atoi(optarg);
+            break;
+        case 'F':
+            if (!parse_feedback_fields(optarg, requested_feedback_fields)) {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'R':
+            recorder_filename = optarg;
+            break;
+        case 'N':
+            recorder_capacity = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'P':
+            replay_filename = optarg;
+            break;
+        case 'M':
+            if (!strcmp(optarg, "realtime"))      replay_mode = REPLAY_REALTIME;
+            else if (!strcmp(optarg, "fast"))     replay_mode = REPLAY_FAST;
+            else if (!strcmp(optarg, "lockstep")) replay_mode = REPLAY_LOCKSTEP;
+            else {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'g':
+            group_name = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if (control_rate_hz < 0 || control_rate_hz > 10000 || sched_fifo_priority < 0 || sched_fifo_priority > 99
+        || pipeline_depth < 1 || pipeline_depth > MAX_PIPELINE_DEPTH
+        || requested_protocol_version < HOST_PROTOCOL_VERSION_1 || requested_protocol_version > HOST_PROTOCOL_VERSION
+        || (requested_feedback_fields != 0 && requested_protocol_version < HOST_PROTOCOL_VERSION_2)) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    gid_t group_id {(gid_t)-1};
+    if (group_name) {
+        struct group const * group = getgrnam(group_name);
+        if (!group) {
+            fprintf(stderr, "unknown group: %s\n", group_name);
+            exit(EXIT_FAILURE);
+        }
+        group_id = group->gr_gid;
+    }
+
+    // allocate a named shared-memory segment for setpoint and feedback data exchange between clients and server
+    shm_unlink(ESP32_PROXY_SHM_NAME);
+    int shm_fd = shm_open(ESP32_PROXY_SHM_NAME, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0660);
+    if (shm_fd == -1) {
+        perror("shm_open");
+        exit(EXIT_FAILURE);
+    }
+    // any client with write access commands the servos : the owner, and the group when one is given
+    if (group_name && (fchown(shm_fd, (uid_t)-1, group_id) == -1 || fchmod(shm_fd, 0660) == -1)) {
+        perror("shm group");
+        exit(EXIT_FAILURE);
+    }
+    if (ftruncate(shm_fd, sizeof(setpoint_and_feedback_data)) == -1) {
+        perror("ftruncate");
+        exit(EXIT_FAILURE);
+    }
+    void * control_block = mmap(NULL, sizeof(setpoint_and_feedback_data), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if (control_block == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    close(shm_fd);
     memset(control_block, 0, sizeof(setpoint_and_feedback_data));
+    new (control_block) setpoint_and_feedback_data();
+
+    /* initialize setpoints before any client or the ESP32 task can access them */
+    {
+        parameters_control_instruction_format control;
+
+        // Initialize all control/goal_position to neutral
+        u16 const neutral_pos {512};
+        for(auto & goal_position : control.goal_position)
+        {
+            goal_position = neutral_pos;
+        }
+
+        // Initialize all control/torque_switch to enable
+        for(auto & torque_enable : control.torque_enable)
+        {
+            torque_enable = 1;
+        }
+        reinterpret_cast<setpoint_and_feedback_data*>(control_block)->control.write(control);
+    }
+
+    /* segment is ready : let shared-memory clients map it */
+    {
+        shared_memory_header & header = reinterpret_cast<setpoint_and_feedback_data*>(control_block)->header;
+        header.version = ESP32_PROXY_SHM_VERSION;
+        header.size = sizeof(setpoint_and_feedback_data);
+        header.server_pid = getpid();
+        header.magic.store(ESP32_PROXY_SHM_MAGIC, std::memory_order_release);
+    }
 
     /* print version string */
     printf("%s\n", version);
 
-    /* start UART protocol with ESP32 */
+    /* signal new feedback generations from the UART protocol task to the server */
+    int feedback_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (feedback_event_fd == -1) {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+
+    /* start UART protocol with ESP32, or the replay of a recording */
     int pid = fork();
     if (pid == 0)
     {
-	   esp32_protocol(reinterpret_cast<setpoint_and_feedback_data*>(control_block));
+        if (replay_filename)
+            esp32_replay(reinterpret_cast<setpoint_and_feedback_data*>(control_block), feedback_event_fd);
+        else
+            esp32_protocol(reinterpret_cast<setpoint_and_feedback_data*>(control_block), feedback_event_fd);
     }
 
     /* Create local socket. */
 
-    int connection_socket = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    int connection_socket = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (connection_socket == -1) {
         perror("socket");
         exit(EXIT_FAILURE);
@@ -327,6 +1762,10 @@ int main(int argc, char *argv[])
         perror("bind");
         exit(EXIT_FAILURE);
     }
+    if (group_name && (chown(SOCKET_NAME, (uid_t)-1, group_id) == -1 || chmod(SOCKET_NAME, 0660) == -1)) {
+        perror("socket group");
+        exit(EXIT_FAILURE);
+    }
 
     /*
      * Prepare for accepting connections. The backlog size is set
@@ -340,92 +1779,155 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+    /*
+     * All clients are served by this single process : the listening
+     * socket and every client socket are registered on one epoll
+     * instance, and the state of each client is kept in a map.
+     */
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = connection_socket;
+    ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection_socket, &event);
+    if (ret == -1) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+    event.data.fd = feedback_event_fd;
+    ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, feedback_event_fd, &event);
+    if (ret == -1) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+
     /* This is the main loop for handling connections. */
 
-    int data_socket {0};
-    u8 r_buffer[38];
-    u8 s_buffer[38];
+    std::map<int,client_state> clients;
+    std::deque<forwarded_request> requests;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    u8 r_buffer[256];
+    u8 s_buffer[256];
     for (;;) {
 
-        /* Wait for incoming connection. */
+        /* Wait for incoming connections and data packets. */
 
-        data_socket = accept(connection_socket, NULL, NULL);
-        if (data_socket == -1) {
-            perror("accept");
+        int event_count = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+        if (event_count == -1) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
             exit(EXIT_FAILURE);
         }
 
-	pid = fork();
-        if (pid == 0) {
-
-            for (;;) {
-
-                /* Wait for next data packet. */
-
-                ret = read(data_socket, r_buffer, sizeof(r_buffer));
-                if (ret == -1) {
-                    /* client terminated? */
-                    exit(EXIT_SUCCESS);
+        for (int index = 0; index < event_count; ++index) {
+
+            int fd = events[index].data.fd;
+
+            /* Accept all pending connections. */
+
+            if (fd == connection_socket) {
+                for (;;) {
+                    int data_socket = accept4(connection_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (data_socket == -1) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                            perror("accept");
+                        }
+                        break;
+                    }
+                    memset(&event, 0, sizeof(event));
+                    event.events = EPOLLIN;
+                    event.data.fd = data_socket;
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, data_socket, &event) == -1) {
+                        perror("epoll_ctl");
+                        close(data_socket);
+                        continue;
+                    }
+                    clients[data_socket].fd = data_socket;
                 }
+                continue;
+            }
 
-                /* Handle commands. */
-		int offset;
-                offset = 0;
-                if(r_buffer[1] == INST_SETPOS && r_buffer[0] == 38) {
-                    memcpy((char*)control_block + offset, &r_buffer[2], sizeof(parameters_control_instruction_format));
-                    s_buffer[0]= 2;
-                    s_buffer[1]= INST_SETPOS;
-                }
+            /* Forward the reply of the ESP32 to a request, push new feedback to subscribers. */
 
-                offset = sizeof(parameters_control_instruction_format);
-                if(r_buffer[1] == INST_GETPOS && r_buffer[0] == 2) {
-                    s_buffer[0]= 2 + 12*sizeof(u16);
-                    s_buffer[1]= INST_GETPOS;
-                    memcpy(&s_buffer[2], (char*)control_block + offset, 12*sizeof(u16));
+            if (fd == feedback_event_fd) {
+                eventfd_t value;
+                eventfd_read(feedback_event_fd, &value);
+                int const terminated = complete_request(reinterpret_cast<setpoint_and_feedback_data*>(control_block), epoll_fd, clients, requests);
+                if (terminated >= 0) {
+                    close_client(reinterpret_cast<setpoint_and_feedback_data*>(control_block), epoll_fd, clients, requests, terminated);
+                    update_subscribers(reinterpret_cast<setpoint_and_feedback_data*>(control_block), clients);
                 }
+                push_feedback(reinterpret_cast<setpoint_and_feedback_data*>(control_block), clients);
+                continue;
+            }
 
-                offset += 12*sizeof(u16);
-                if(r_buffer[1] == INST_GETLOAD && r_buffer[0] == 2) {
-                    s_buffer[0]= 2 + 12*sizeof(s16);
-                    s_buffer[1]= INST_GETLOAD;
-                    memcpy(&s_buffer[2], (char*)control_block + offset, 12*sizeof(s16));
-                }
+            std::map<int,client_state>::iterator client = clients.find(fd);
+            if (client == clients.end()) continue;
 
-                offset += 12*sizeof(s16);
-                if(r_buffer[1] == INST_GETIMU && r_buffer[0] == 2) {
-                    s_buffer[0]= 2 + 6*sizeof(float);
-                    s_buffer[1]= INST_GETIMU;
-                    memcpy(&s_buffer[2], (char*)control_block + offset, 6*sizeof(float));
-                }
+            /* Send the replies queued while its socket was full. */
 
-                offset += 6*sizeof(float);
-                if(r_buffer[1] == INST_GETPOWER && r_buffer[0] == 2) {
-                    s_buffer[0]= 2 + 2*sizeof(float);
-                    s_buffer[1]= INST_GETPOWER;
-                    memcpy(&s_buffer[2], (char*)control_block + offset, 2*sizeof(float));
-                }
+            bool terminated = (events[index].events & EPOLLERR) != 0;
+            if (!terminated && (events[index].events & EPOLLOUT)) {
+                terminated = !flush_packets(epoll_fd, client->second);
+            }
 
-                /* Send result. */
+            /*
+             * Drain all pending data packets of this client, a client that hung up too :
+             * the requests it sent before closing its socket are still handled.
+             */
 
-                ret = write(data_socket, s_buffer, s_buffer[0]);
-                if (ret == -1) {
+            bool const hung_up = (events[index].events & EPOLLHUP) != 0;
+            while (!terminated) {
+                ssize_t r_length = recv(fd, r_buffer, sizeof(r_buffer), 0);
+                if (r_length == -1) {
                     /* client terminated? */
-                    exit(EXIT_SUCCESS);
+                    terminated = (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+                    break;
+                }
+                if (r_length == 0) {
+                    /* client terminated */
+                    terminated = true;
+                    break;
                 }
 
+                /* Handle commands. */
+
+                size_t s_length = handle_request(
+                    reinterpret_cast<setpoint_and_feedback_data*>(control_block),
+                    client->second, requests, r_buffer, r_length, s_buffer);
+                if (s_length == 0) continue;
+
+                /* Send result, queued while the socket is full. */
+
+                if (!send_packet(epoll_fd, client->second, s_buffer, s_length) && !hung_up) {
+                    /* client terminated, or does not read its replies */
+                    terminated = true;
+                }
             }
-        }
-        else {
-            close(data_socket);
-            continue;
+            if (hung_up) {
+                terminated = true;
+            }
+            if (terminated) {
+                close_client(reinterpret_cast<setpoint_and_feedback_data*>(control_block), epoll_fd, clients, requests, fd);
+            }
+            update_subscribers(reinterpret_cast<setpoint_and_feedback_data*>(control_block), clients);
         }
     }
 
+    close(epoll_fd);
+
     close(connection_socket);
 
-    /* Unlink the socket. */
+    /* Unlink the socket and the shared-memory segment. */
 
     unlink(SOCKET_NAME);
+    shm_unlink(ESP32_PROXY_SHM_NAME);
 
     exit(EXIT_SUCCESS);
 }
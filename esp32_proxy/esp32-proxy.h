@@ -5,12 +5,167 @@
 #ifndef _esp32_proxy__H
 #define _esp32_proxy__H
 
+#include <stdint.h>
+
+#include "mini_pupper_host_base.h"
+
 #define SOCKET_NAME "/tmp/esp32-proxy.socket"
 
+/* SOCKET PROTOCOL
+ *
+ *  Packet format (SOCK_SEQPACKET) :
+ *   Length      (8bits) : Packet length in bytes, including length and instruction
+ *   Instruction (8bits) : INST_xxx
+ *   Parameters (N bytes)
+ *
+ *  INST_SUBSCRIBE : parameter is a decimation factor (u16, little endian).
+ *   The proxy replies [2,INST_SUBSCRIBE], then pushes an INST_FEEDBACK packet carrying the
+ *   latest feedback generation once at least <decimation> ESP32 acknowledges were decoded
+ *   since the last push. A decimation of 0 unsubscribes.
+ *   Pushed packets are interleaved with the replies to other requests of the same client.
+ *   Pushes are lossy, even with a decimation of 1 : generations decoded while the proxy is
+ *   busy are coalesced into the latest one, and a push is dropped while the socket of the
+ *   subscriber is full or replies to it are queued. Subscribers detect the lost generations
+ *   from the gaps of feedback_packet::generation.
+ *
+ *  INST_GETALL : the proxy replies an INST_GETALL packet carrying a feedback_packet,
+ *   i.e. the whole ESP32 acknowledge of one generation.
+ *
+ *  INST_SETPOS_GETALL : parameters are the same as INST_SETPOS. The proxy stores the
+ *   setpoints and replies like INST_GETALL, so a control tick takes one round trip.
+ *
+ *  INST_GETSCHED : the proxy replies an INST_GETSCHED packet carrying the scheduler_stats
+ *   of the ESP32 control loop (control rate, deadline misses, wake-up jitter).
+ *
+ *  INST_GETSTATS : the proxy replies an INST_GETSTATS packet carrying the link_stats_summary
+ *   of the serial link (frame counters, error counters, CONTROL->ACK round-trip time).
+ *   The full round-trip time histogram is available in shared memory (see esp32-proxy-stats).
+ *
+ *  INST_LEASE : parameters are a priority (u8) and a lease duration in ms (u16, little endian).
+ *   The proxy replies [3,INST_LEASE,granted]. Once granted, the setpoints of this client go to
+ *   its own staging slot : the ESP32 receives the setpoints of the live lease with the highest
+ *   priority, never a mixture. The lease stays live while the client writes setpoints more often
+ *   than its duration. When no lease is live anymore, the ESP32 holds the present pose until a
+ *   client without lease writes setpoints. A duration of 0 releases the lease.
+ *   Closing the socket releases the lease too.
+ *
+ *  INST_TRAJECTORY : queues future setpoints in the lease slot of the client. Parameters are
+ *   a mode (u8, 0 : append, 1 : replace the queued points), a base time (s64, CLOCK_MONOTONIC ns),
+ *   the torque switches of all points (12 x u8), then up to TRAJECTORY_PACKET_POINTS points, each
+ *   a target time offset from the base time (u32, us) and goal positions (12 x u16).
+ *   The proxy replies [3,INST_TRAJECTORY,queued points]. Points are ignored without a lease,
+ *   when the queue is full, or when they are not after the last queued point.
+ *   The setpoints of each CONTROL frame are interpolated so that every point is reached
+ *   at its target time. INST_SETPOS cancels the queued points.
+ *
+ *  INST_GETTIMING : the proxy replies an INST_GETTIMING packet carrying the feedback_timing of
+ *   the last feedback generation : the ESP32 times of the servo and IMU samples (host protocol
+ *   version 2), converted to CLOCK_MONOTONIC. The end-to-end delay of the servo feedback is
+ *   the decoding time (timestamp_ns of INST_GETALL) minus servo_time_ns.
+ *
+ *  INST_ESP32 : parameters are an ESP32 host instruction (INST_GET_STATS, INST_GET_CONFIG,
+ *   INST_SET_CONFIG, INST_READ_SERVO_REGISTERS, INST_WRITE_SERVO_REGISTERS, see
+ *   mini_pupper_host_base.h) and its parameters. The proxy sends it to the ESP32 between two
+ *   CONTROL exchanges and replies [N,INST_ESP32,status,instruction,parameters] with the reply
+ *   of the ESP32 (a HOST_STATUS_xxx NACK has no parameters), or [2,INST_ESP32] when the ESP32
+ *   did not reply in time or the instruction can not be forwarded (CONTROL, PROTOCOL).
+ *   Requests of all clients are forwarded one at a time, in order.
+ *
+ *  INST_GETEXTRA : the proxy replies an INST_GETEXTRA packet carrying the feedback_extra of the
+ *   last feedback generation : the acknowledge fields in use, the present speed and
+ *   temperature of the servos and the age of each servo feedback (SERVO_AGE_UNIT_US), valid when
+ *   their field is in the mask (see --feedback).
+ *
+ *  INST_ERROR : the proxy replies [3,INST_ERROR,instruction] to a malformed request or an unknown
+ *   instruction (instruction 0 when the packet is too short to carry one), so that a client never
+ *   waits for a reply that will not come.
+ */
+
 #define INST_SETPOS 0x01
 #define INST_GETPOS 0x02
 #define INST_GETLOAD 0x03
 #define INST_GETIMU 0x04
 #define INST_GETPOWER 0x05
+#define INST_SUBSCRIBE 0x06
+#define INST_FEEDBACK 0x07
+#define INST_GETALL 0x08
+#define INST_SETPOS_GETALL 0x09
+#define INST_GETSCHED 0x0A
+#define INST_GETSTATS 0x0B
+#define INST_LEASE 0x0C
+#define INST_TRAJECTORY 0x0D
+#define INST_GETTIMING 0x0E
+#define INST_ESP32 0x0F
+#define INST_GETEXTRA 0x10
+#define INST_ERROR 0xFF
+
+// INST_TRAJECTORY packet layout
+#define TRAJECTORY_PACKET_HEADER (2 + 1 + 8 + 12)
+#define TRAJECTORY_PACKET_POINT_SIZE (4 + 2*12)
+#define TRAJECTORY_PACKET_POINTS 8
+
+// Feedback packet parameters : one full ESP32 acknowledge with its generation
+struct feedback_packet
+{
+    uint64_t generation;    // incremented for each decoded acknowledge
+    int64_t timestamp_ns;   // CLOCK_MONOTONIC time the acknowledge was decoded
+    parameters_control_acknowledge_format feedback;
+};
+static_assert(sizeof(feedback_packet)==96, "feedback packet layout is part of the socket protocol");
+
+// Feedback timing parameters : ESP32 times converted to CLOCK_MONOTONIC
+// - the times are 0 when the ESP32 does not use host protocol version 2
+struct feedback_timing
+{
+    uint64_t generation;            // feedback generation these times belong to
+    uint32_t protocol_version;      // host protocol version of the acknowledge
+    uint32_t frame_counter;         // CONTROL acknowledges sent by the ESP32 since boot
+    int64_t servo_time_ns;          // oldest servo feedback sample
+    int64_t imu_time_ns;            // IMU sample
+    int64_t esp32_tx_time_ns;       // acknowledge sent by the ESP32
+    int64_t clock_uncertainty_ns;   // the ESP32 clock offset is known within +/- this value
+};
+static_assert(sizeof(feedback_timing)==48, "feedback timing layout is part of the socket protocol");
+
+// Feedback extra parameters : the fields beyond the CONTROL acknowledge of protocol version 1
+struct feedback_extra
+{
+    uint64_t generation;            // feedback generation these values belong to
+    uint32_t fields;                // acknowledge fields (FEEDBACK_xxx bits), the values of the other fields are 0
+    parameters_feedback_extra_format extra;
+};
+static_assert(sizeof(feedback_extra)==72, "feedback extra layout is part of the socket protocol");
+
+// Scheduler statistics of the ESP32 control loop
+struct scheduler_stats
+{
+    uint32_t rate_hz;           // fixed control rate, 0 means free-running
+    uint32_t pipeline_depth;    // CONTROL frames kept in flight, 1 means stop-and-wait
+    uint64_t cycles;            // CONTROL frames sent
+    uint64_t deadline_misses;   // exchanges not acknowledged before the next period (pipelined : periods without a frame sent, time-outs)
+    uint64_t overruns;          // periods skipped because the loop woke up too late
+    int64_t jitter_last_ns;     // wake-up latency after the period deadline
+    int64_t jitter_mean_ns;
+    int64_t jitter_max_ns;
+};
+static_assert(sizeof(scheduler_stats)==56, "scheduler stats layout is part of the socket protocol");
+
+// Serial link statistics
+struct link_stats_summary
+{
+    uint64_t frames_sent;       // CONTROL frames sent
+    uint64_t frames_received;   // frames decoded or rejected, and time-outs
+    uint64_t checksum_errors;
+    uint64_t syntax_errors;     // bad header, ID, length or status
+    uint64_t timeouts;          // CONTROL frames not acknowledged in time
+    uint64_t rtt_count;         // CONTROL->ACK round-trip time (ns)
+    uint64_t rtt_min_ns;
+    uint64_t rtt_mean_ns;
+    uint64_t rtt_p50_ns;
+    uint64_t rtt_p99_ns;
+    uint64_t rtt_p999_ns;
+    uint64_t rtt_max_ns;
+};
+static_assert(sizeof(link_stats_summary)==96, "link stats layout is part of the socket protocol");
 
 #endif //_esp32_proxy__H